@@ -0,0 +1,235 @@
+#include "autotune.h"
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+
+typedef struct {
+  double x_min;
+  double x_max;
+  double y_min;
+  double y_max;
+  int32_t iterations;
+} autotune_view_t;
+
+// The whole set, a zoom into the seahorse valley, and one deep
+// enough to need doubles
+static const autotune_view_t autotune_views[] = {
+  { -2.5, 1.0, -1.0, 1.0, 256 },
+  { -0.7475, -0.7395, 0.0950, 0.1050, 512 },
+  { -0.7436440, -0.7436436, 0.1318258, 0.1318261, 1024 },
+};
+
+static const int32_t autotune_n_views = sizeof(autotune_views) / sizeof(autotune_views[0]);
+
+
+// Seconds to render all of the views with p, the best of a few
+// tries. The cache is cleared first every time, so nothing is
+// reused from the try before.
+
+static double _autotune_measure(const autotune_profile_t * p, int64_t * pixels)
+{
+  if (pool_size() != p->threads) {
+    pool_init(p->threads);
+  }
+
+  double best = -1.0;
+
+  for (int32_t r = 0; r < AUTOTUNE_REPEATS; r++) {
+    double seconds = 0.0;
+    *pixels = 0;
+
+    for (int32_t v = 0; v < autotune_n_views; v++) {
+      args_t a;
+      memset(&a, 0, sizeof(a));
+      a.width = AUTOTUNE_WIDTH;
+      a.iterations = autotune_views[v].iterations;
+      a.threads = p->threads;
+      a.rows = p->rows;
+      a.variant = p->variant;
+      a.supersampling = 1;
+      a.power = 2;
+      a.precision = KERNEL_PRECISION_AUTO;
+      a.progress_fd = -1;
+      a.coloring = COLORIZE_BANDS;
+      a.x_min = autotune_views[v].x_min;
+      a.x_max = autotune_views[v].x_max;
+      a.y_min = autotune_views[v].y_min;
+      a.y_max = autotune_views[v].y_max;
+
+      mandelbrot_cleanup();
+      mandelbrot_init(&a);
+
+      const double started = stats_now();
+      mandelbrot_calculate_iterations();
+      seconds += stats_now() - started;
+      *pixels += (int64_t) width * height;
+    }
+
+    if (best < 0 || seconds < best) {
+      best = seconds;
+    }
+  }
+
+  mandelbrot_cleanup();
+
+  return best;
+}
+
+static void _autotune_try(const autotune_profile_t * p, autotune_profile_t * best, double * best_seconds)
+{
+  int64_t pixels;
+  const double seconds = _autotune_measure(p, &pixels);
+
+  printf("[autotune] threads = %2d, rows = %2d, kernel = %-6s %8.2f ms, %7.2f Mpixels/s\n",
+      p->threads, p->rows, kernel_variant_name(p->variant), 1e3 * seconds, 1e-6 * pixels / seconds);
+
+  if (*best_seconds < 0 || seconds < *best_seconds) {
+    *best = *p;
+    *best_seconds = seconds;
+  }
+}
+
+
+// The profile file
+
+static const char * _autotune_host(struct utsname * name)
+{
+  return uname(name) == 0 && name->nodename[0] != '\0' ? name->nodename : "localhost";
+}
+
+int32_t autotune_profile_path(char * path, const size_t size)
+{
+  struct utsname name;
+  const char * host = _autotune_host(&name);
+
+  const char * config = getenv("XDG_CONFIG_HOME");
+  const char * home = getenv("HOME");
+
+  if (config != NULL && config[0] != '\0') {
+    snprintf(path, size, "%s/mandelbrot/%s.profile", config, host);
+  } else if (home != NULL && home[0] != '\0') {
+    snprintf(path, size, "%s/.config/mandelbrot/%s.profile", home, host);
+  } else {
+    return 1;
+  }
+
+  return 0;
+}
+
+int32_t autotune_load(const char * filename, autotune_profile_t * profile)
+{
+  FILE * fp = fopen(filename, "r");
+  if (!fp) {
+    return 1;
+  }
+
+  char line[256];
+  char key[64];
+  char value[64];
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (line[0] == '#' || sscanf(line, "%63s %63s", key, value) != 2) {
+      continue;
+    }
+
+    if (strcmp(key, "threads") == 0 && atoi(value) >= 1) {
+      profile->threads = atoi(value);
+    } else if (strcmp(key, "rows") == 0 && atoi(value) >= 1) {
+      profile->rows = atoi(value);
+    } else if (strcmp(key, "variant") == 0 && kernel_variant_parse(value) != KERNEL_VARIANT_INVALID) {
+      profile->variant = kernel_variant_parse(value);
+    }
+  }
+
+  fclose(fp);
+  return 0;
+}
+
+// Creates the directories above filename that are missing
+
+static int32_t _autotune_directories(const char * filename)
+{
+  char path[AUTOTUNE_PATH_SIZE];
+  snprintf(path, sizeof(path), "%s", filename);
+
+  for (char * p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+    *p = '\0';
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+      return 1;
+    }
+    *p = '/';
+  }
+
+  return 0;
+}
+
+static int32_t _autotune_write(const char * filename, const autotune_profile_t * profile)
+{
+  if (_autotune_directories(filename) != 0) {
+    critical("failed to create the directory for '%s'\n", filename);
+    return 2;
+  }
+
+  FILE * fp = fopen(filename, "w");
+  if (!fp) {
+    critical("failed to open file '%s' in write mode\n", filename);
+    return 2;
+  }
+
+  struct utsname name;
+  fprintf(fp, "# The fastest settings on %s, from mandelbrot --autotune\n", _autotune_host(&name));
+  fprintf(fp, "threads %d\n", profile->threads);
+  fprintf(fp, "rows %d\n", profile->rows);
+  fprintf(fp, "variant %s\n", kernel_variant_name(profile->variant));
+
+  return fclose(fp) == 0 ? 0 : 2;
+}
+
+
+// One setting at a time: the kernel variant with every CPU busy,
+// then the thread count with that variant, then the rows per work
+// unit with both
+
+int32_t autotune_run(const char * filename)
+{
+  const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  const int32_t n_cpus = cpus < 1 ? 1 : cpus;
+
+  printf("[autotune] %d CPUs, %d views of %d pixels wide, best of %d\n",
+      n_cpus, autotune_n_views, AUTOTUNE_WIDTH, AUTOTUNE_REPEATS);
+
+  autotune_profile_t best = { n_cpus, 1, KERNEL_VARIANT_AUTO };
+  double best_seconds = -1.0;
+
+  const int32_t variants[] = { KERNEL_VARIANT_SCALAR, KERNEL_VARIANT_LANES };
+  for (int32_t i = 0; i < 2; i++) {
+    const autotune_profile_t p = { n_cpus, 1, variants[i] };
+    _autotune_try(&p, &best, &best_seconds);
+  }
+
+  for (int32_t threads = 1; threads < 2 * n_cpus; threads *= 2) {
+    const autotune_profile_t p = { threads < n_cpus ? threads : n_cpus, 1, best.variant };
+    if (p.threads != n_cpus) {
+      _autotune_try(&p, &best, &best_seconds);
+    }
+  }
+
+  for (int32_t rows = 2; rows <= AUTOTUNE_MAX_ROWS; rows *= 2) {
+    const autotune_profile_t p = { best.threads, rows, best.variant };
+    _autotune_try(&p, &best, &best_seconds);
+  }
+
+  printf("[autotune] Best: threads = %d, rows = %d, kernel = %s\n",
+      best.threads, best.rows, kernel_variant_name(best.variant));
+
+  const int32_t status = _autotune_write(filename, &best);
+  if (status == 0) {
+    printf("[autotune] Written to '%s'\n", filename);
+  }
+
+  return status;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "mandelbrot.h"
+
+
+// Settings tuned to the machine. --autotune renders a few small,
+// typical views with every candidate thread count, number of rows
+// per work unit and kernel variant, and writes the fastest to a
+// profile. Later runs load the profile for whatever is not given on
+// the command line.
+//
+// The profile is a text file of "key value" lines, one per host,
+// at $XDG_CONFIG_HOME/mandelbrot/HOSTNAME.profile, or under
+// ~/.config without XDG_CONFIG_HOME.
+
+#define AUTOTUNE_WIDTH 256
+#define AUTOTUNE_REPEATS 3
+#define AUTOTUNE_MAX_ROWS 32
+#define AUTOTUNE_PATH_SIZE 4096
+
+typedef struct {
+  int32_t threads;
+  int32_t rows;
+  int32_t variant;
+} autotune_profile_t;
+
+
+// The profile of this host. Returns 1 when there is no home to
+// keep it in.
+extern int32_t autotune_profile_path(char * path, const size_t size);
+
+// Returns 0 when filename was read, and fills in only the settings
+// found in it
+extern int32_t autotune_load(const char * filename, autotune_profile_t * profile);
+
+// Measures every candidate and writes the best to filename
+extern int32_t autotune_run(const char * filename);
@@ -0,0 +1,514 @@
+#include "batch.h"
+
+
+// A finished image on its way to a writer
+
+typedef struct {
+  int64_t job;
+  char * output;
+  image_t * img;
+  int32_t iterations;
+  const char * kernel;
+  double render_seconds;
+  double finish_seconds;
+  double queued;
+} batch_item_t;
+
+// Bounded queue between the render loop and the writers. The render
+// loop waits when it is full, so at most BATCH_QUEUE images wait to
+// be written.
+
+typedef struct {
+  batch_item_t items[BATCH_QUEUE];
+  int32_t head;
+  int32_t count;
+  int32_t closed;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+
+  FILE * results;
+  pthread_mutex_t results_lock;
+  int64_t failed;
+} batch_t;
+
+
+// Results log, one JSON object per job
+
+static void _batch_string(FILE * fp, const char * s)
+{
+  if (s == NULL) {
+    fprintf(fp, "null");
+    return;
+  }
+
+  fputc('"', fp);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') {
+      fputc('\\', fp);
+    }
+    if ((unsigned char) *s >= 0x20) {
+      fputc(*s, fp);
+    }
+  }
+  fputc('"', fp);
+}
+
+static void _batch_error(batch_t * b, const int64_t job, const char * output, const char * message)
+{
+  pthread_mutex_lock(&b->results_lock);
+
+  fprintf(b->results, "{\"job\": %ld, \"output\": ", (long) job);
+  _batch_string(b->results, output);
+  fprintf(b->results, ", \"status\": \"error\", \"message\": ");
+  _batch_string(b->results, message);
+  fprintf(b->results, "}\n");
+  fflush(b->results);
+  b->failed++;
+
+  pthread_mutex_unlock(&b->results_lock);
+
+  error("Job %ld: %s\n", (long) job, message);
+}
+
+static void _batch_done(batch_t * b, const batch_item_t * item, const double waited, const double written)
+{
+  pthread_mutex_lock(&b->results_lock);
+
+  fprintf(b->results, "{\"job\": %ld, \"output\": ", (long) item->job);
+  _batch_string(b->results, item->output);
+  fprintf(b->results, ", \"status\": \"ok\", \"width\": %d, \"height\": %d, "
+      "\"iterations\": %d, \"kernel\": \"%s\", \"render_seconds\": %.6f, "
+      "\"finish_seconds\": %.6f, \"queue_seconds\": %.6f, \"write_seconds\": %.6f}\n",
+      item->img->width, item->img->height, item->iterations, item->kernel,
+      item->render_seconds, item->finish_seconds, waited, written);
+  fflush(b->results);
+
+  pthread_mutex_unlock(&b->results_lock);
+}
+
+
+// Writers
+
+static void * _batch_writer(void * ptr)
+{
+  batch_t * b = ptr;
+
+  trace_thread_name("writer");
+
+  while (true)
+  {
+    pthread_mutex_lock(&b->lock);
+    while (b->count == 0 && !b->closed) {
+      pthread_cond_wait(&b->not_empty, &b->lock);
+    }
+    if (b->count == 0) {
+      pthread_mutex_unlock(&b->lock);
+      break;
+    }
+
+    batch_item_t item = b->items[b->head];
+    b->head = (b->head + 1) % BATCH_QUEUE;
+    b->count--;
+    pthread_cond_signal(&b->not_full);
+    pthread_mutex_unlock(&b->lock);
+
+    const double started = stats_now();
+    const int32_t status = image_write_png(item.img, item.output);
+    const double written = stats_now() - started;
+
+    if (status != 0) {
+      _batch_error(b, item.job, item.output, "failed to write the image");
+    } else {
+      _batch_done(b, &item, started - item.queued, written);
+    }
+
+    image_destroy(item.img);
+    mem_free(item.output);
+  }
+
+  return NULL;
+}
+
+static void _batch_push(batch_t * b, const batch_item_t * item)
+{
+  // Time spent here is the writers falling behind
+  const int64_t begin = trace_begin();
+
+  pthread_mutex_lock(&b->lock);
+  while (b->count == BATCH_QUEUE) {
+    pthread_cond_wait(&b->not_full, &b->lock);
+  }
+  trace_end("queue_full", "io", begin, -1);
+  b->items[(b->head + b->count) % BATCH_QUEUE] = *item;
+  b->count++;
+  pthread_cond_signal(&b->not_empty);
+  pthread_mutex_unlock(&b->lock);
+}
+
+
+// Jobs. A flat JSON object of strings, numbers and booleans. Strings
+// are unescaped in place, so they point into the line.
+
+enum batch_value {
+  BATCH_STRING,
+  BATCH_NUMBER,
+  BATCH_BOOLEAN,
+};
+
+static void _batch_space(char ** p)
+{
+  while (**p == ' ' || **p == '\t' || **p == '\r' || **p == '\n') {
+    (*p)++;
+  }
+}
+
+static char * _batch_parse_string(char ** p)
+{
+  if (**p != '"') {
+    return NULL;
+  }
+
+  char * start = ++(*p);
+  char * out = start;
+
+  while (**p != '"') {
+    if (**p == '\0') {
+      return NULL;
+    }
+    if (**p == '\\') {
+      (*p)++;
+      switch (**p) {
+        case 'n': *out++ = '\n'; break;
+        case 't': *out++ = '\t'; break;
+        case '"': case '\\': case '/': *out++ = **p; break;
+        default: return NULL;
+      }
+      (*p)++;
+    } else {
+      *out++ = *(*p)++;
+    }
+  }
+
+  (*p)++;
+  *out = '\0';
+  return start;
+}
+
+// Returns an error message, or NULL when the key was used
+static const char * _batch_set(args_t * a, char ** output, double * at, const char * key,
+    const int32_t type, const char * text, const double number)
+{
+  #define BATCH_NUMBER_KEY(name, field) \
+    if (strcmp(key, name) == 0) { \
+      if (type != BATCH_NUMBER) { \
+        return "\"" name "\" takes a number"; \
+      } \
+      field = number; \
+      return NULL; \
+    }
+  // Numbers for int32_t fields, which are whole and within range
+  // before they are converted
+  #define BATCH_INTEGER_KEY(name, field, min, max) \
+    if (strcmp(key, name) == 0) { \
+      if (type != BATCH_NUMBER || number != floor(number) || number < (min) || number > (max)) { \
+        return "\"" name "\" takes a whole number within range"; \
+      } \
+      field = (int32_t) number; \
+      return NULL; \
+    }
+  #define BATCH_FLAG_KEY(name, field) \
+    if (strcmp(key, name) == 0) { \
+      if (type != BATCH_BOOLEAN) { \
+        return "\"" name "\" takes true or false"; \
+      } \
+      field = number != 0; \
+      return NULL; \
+    }
+
+  if (at != NULL && strcmp(key, "t") == 0) {
+    if (type != BATCH_NUMBER || number < 0) {
+      return "\"t\" takes seconds from the start";
+    }
+    *at = number;
+    return NULL;
+  }
+  if (strcmp(key, "output") == 0) {
+    if (type != BATCH_STRING) {
+      return "\"output\" takes a file name";
+    }
+    *output = (char *) text;
+    return NULL;
+  }
+  if (strcmp(key, "iterations") == 0) {
+    if (type == BATCH_STRING && strcmp(text, "auto") == 0) {
+      a->iterations = ITERATIONS_AUTO;
+      return NULL;
+    }
+    if (type != BATCH_NUMBER || number != floor(number) || number < 1 || number >= INT32_MAX) {
+      return "\"iterations\" takes a positive whole number or \"auto\"";
+    }
+    a->iterations = (int32_t) number;
+    return NULL;
+  }
+  if (strcmp(key, "precision") == 0) {
+    a->precision = type == BATCH_STRING ? kernel_precision_parse(text) : KERNEL_PRECISION_INVALID;
+    return a->precision == KERNEL_PRECISION_INVALID ? "\"precision\" takes auto, float, double or long" : NULL;
+  }
+  if (strcmp(key, "coloring") == 0) {
+    a->coloring = type == BATCH_STRING ? colorize_mode_parse(text) : COLORIZE_INVALID;
+    return a->coloring == COLORIZE_INVALID ? "\"coloring\" takes bands or histogram" : NULL;
+  }
+
+  BATCH_INTEGER_KEY("width", a->width, 16, BATCH_MAX_SIZE);
+  BATCH_INTEGER_KEY("supersampling", a->supersampling, 1, 16);
+  BATCH_INTEGER_KEY("power", a->power, KERNEL_MIN_POWER, KERNEL_MAX_POWER);
+  BATCH_INTEGER_KEY("buddhabrot", a->buddhabrot, 0, INT32_MAX);
+  BATCH_NUMBER_KEY("xmin", a->x_min);
+  BATCH_NUMBER_KEY("xmax", a->x_max);
+  BATCH_NUMBER_KEY("ymin", a->y_min);
+  BATCH_NUMBER_KEY("ymax", a->y_max);
+  BATCH_NUMBER_KEY("cx", a->julia_x);
+  BATCH_NUMBER_KEY("cy", a->julia_y);
+  BATCH_FLAG_KEY("gamma", a->gamma);
+  BATCH_FLAG_KEY("julia", a->julia);
+  BATCH_FLAG_KEY("indexed", a->indexed);
+
+  #undef BATCH_NUMBER_KEY
+  #undef BATCH_INTEGER_KEY
+  #undef BATCH_FLAG_KEY
+
+  return "unknown key";
+}
+
+const char * batch_parse(char * line, args_t * a, char ** output, double * at)
+{
+  char * p = line;
+
+  _batch_space(&p);
+  if (*p++ != '{') {
+    return "expected a JSON object";
+  }
+  _batch_space(&p);
+
+  while (*p != '}')
+  {
+    const char * key = _batch_parse_string(&p);
+    if (key == NULL) {
+      return "expected a key";
+    }
+    _batch_space(&p);
+    if (*p++ != ':') {
+      return "expected ':' after a key";
+    }
+    _batch_space(&p);
+
+    int32_t type;
+    const char * text = NULL;
+    double number = 0;
+
+    if (*p == '"') {
+      type = BATCH_STRING;
+      text = _batch_parse_string(&p);
+      if (text == NULL) {
+        return "unterminated string";
+      }
+    } else if (strncmp(p, "true", 4) == 0 || strncmp(p, "false", 5) == 0) {
+      type = BATCH_BOOLEAN;
+      number = *p == 't';
+      p += number ? 4 : 5;
+    } else {
+      char * end;
+      type = BATCH_NUMBER;
+      number = strtod(p, &end);
+      if (end == p) {
+        return "expected a string, number, true or false";
+      }
+      p = end;
+    }
+
+    const char * message = _batch_set(a, output, at, key, type, text, number);
+    if (message != NULL) {
+      return message;
+    }
+
+    _batch_space(&p);
+    if (*p == ',') {
+      p++;
+      _batch_space(&p);
+    } else if (*p != '}') {
+      return "expected ',' or '}'";
+    }
+  }
+
+  if (a->width < 16) {
+    return "width must be at least 16";
+  }
+  if (a->supersampling < 1 || a->supersampling > 16) {
+    return "supersampling must be from 1 to 16";
+  }
+  if (a->power < KERNEL_MIN_POWER || a->power > KERNEL_MAX_POWER) {
+    return "power must be from 2 to 8";
+  }
+  if (!(a->x_max > a->x_min) || !(a->y_max > a->y_min)) {
+    return "xmax and ymax must be above xmin and ymin";
+  }
+  if (a->buddhabrot > 0 && a->julia) {
+    return "buddhabrot can not be combined with julia";
+  }
+
+  // Samples are indexed with int32_t, height as the render gets it
+  const double height = a->height > 0 ? a->height
+    : round(a->width * (a->y_max - a->y_min) / (a->x_max - a->x_min));
+  const double samples = (double) a->width * height * a->supersampling * a->supersampling;
+  if (!(samples <= INT32_MAX)) {
+    return "the image has too many samples";
+  }
+
+  return NULL;
+}
+
+char * batch_read_line(FILE * fp, char ** buffer, size_t * size)
+{
+  size_t length = 0;
+
+  if (*buffer == NULL) {
+    *size = 4096;
+    *buffer = mem_alloc(*size);
+  }
+
+  while (fgets(*buffer + length, *size - length, fp) != NULL) {
+    length += strlen(*buffer + length);
+    if (length > 0 && (*buffer)[length - 1] == '\n') {
+      (*buffer)[length - 1] = '\0';
+      return *buffer;
+    }
+    if (length + 1 == *size) {
+      *size *= 2;
+      *buffer = mem_realloc(*buffer, *size);
+    }
+  }
+
+  return length > 0 ? *buffer : NULL;
+}
+
+
+// The render loop
+
+int32_t batch_run(const args_t * defaults, const char * jobs, const char * results)
+{
+  const int32_t from_stdin = strcmp(jobs, "-") == 0;
+  FILE * in = from_stdin ? stdin : fopen(jobs, "r");
+  if (!in) {
+    critical("failed to open file '%s' in read mode\n", jobs);
+    return 2;
+  }
+
+  const int32_t to_stdout = results == NULL || strcmp(results, "-") == 0;
+  batch_t b;
+  memset(&b, 0, sizeof(b));
+  b.results = to_stdout ? stdout : fopen(results, "w");
+  if (!b.results) {
+    critical("failed to open file '%s' in write mode\n", results);
+    if (!from_stdin) {
+      fclose(in);
+    }
+    return 2;
+  }
+
+  pthread_mutex_init(&b.lock, NULL);
+  pthread_mutex_init(&b.results_lock, NULL);
+  pthread_cond_init(&b.not_empty, NULL);
+  pthread_cond_init(&b.not_full, NULL);
+
+  pthread_t writers[BATCH_WRITERS];
+  for (int32_t i = 0; i < BATCH_WRITERS; i++) {
+    pthread_create(&writers[i], NULL, _batch_writer, &b);
+  }
+
+  char * line = NULL;
+  size_t size = 0;
+  int64_t job = 0;
+  const double started = stats_now();
+
+  while (batch_read_line(in, &line, &size) != NULL)
+  {
+    char * p = line;
+    _batch_space(&p);
+    if (*p == '\0') {
+      continue;
+    }
+
+    // Every job starts from the command line options
+    args_t a = *defaults;
+    char * output = NULL;
+    a.progress = 0;
+    a.state = NULL;
+    a.resume = 0;
+    a.pyramid = 0;
+
+    const char * message = batch_parse(line, &a, &output, NULL);
+    if (message == NULL && output == NULL) {
+      message = "no \"output\"";
+    }
+    if (message != NULL) {
+      _batch_error(&b, job++, output, message);
+      continue;
+    }
+    a.filename = output;
+
+    const int64_t begin = trace_begin();
+
+    batch_item_t item;
+    item.job = job++;
+    item.output = mem_alloc(strlen(output) + 1);
+    strcpy(item.output, output);
+
+    mandelbrot_init(&a);
+    image_t * img = mandelbrot_calculate();
+    item.render_seconds = stats.render_seconds;
+    item.iterations = n_iterations;
+    item.kernel = kernel->name;
+
+    const double finishing = stats_now();
+    item.img = image_finish(img, a.supersampling, a.gamma);
+    if (a.indexed && item.img->mode == IMAGE_MODE_RGB) {
+      image_t * old = item.img;
+      item.img = image_quantize(old);
+      image_destroy(old);
+    }
+    item.finish_seconds = stats_now() - finishing;
+    item.queued = stats_now();
+    trace_end("job", "phase", begin, item.job);
+
+    _batch_push(&b, &item);
+  }
+
+  mem_free(line);
+  if (!from_stdin) {
+    fclose(in);
+  }
+
+  // Let the writers drain the queue
+  pthread_mutex_lock(&b.lock);
+  b.closed = 1;
+  pthread_cond_broadcast(&b.not_empty);
+  pthread_mutex_unlock(&b.lock);
+
+  for (int32_t i = 0; i < BATCH_WRITERS; i++) {
+    pthread_join(writers[i], NULL);
+  }
+
+  info("Batch: %ld jobs, %ld failed, in %.2fs\n", (long) job, (long) b.failed, stats_now() - started);
+
+  if (!to_stdout) {
+    fclose(b.results);
+  }
+
+  pthread_mutex_destroy(&b.lock);
+  pthread_mutex_destroy(&b.results_lock);
+  pthread_cond_destroy(&b.not_empty);
+  pthread_cond_destroy(&b.not_full);
+
+  return b.failed > 0 ? 1 : 0;
+}
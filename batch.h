@@ -0,0 +1,38 @@
+#pragma once
+
+#include "mandelbrot.h"
+
+
+// Batch mode. Renders every job in a JSON lines file in one
+// process, on the one worker pool. Each line is an object with the
+// output file and any options that differ from the command line:
+//
+//   {"output": "a.png", "width": 1920, "iterations": "auto",
+//    "xmin": -0.55, "xmax": -0.53, "ymin": 0.49, "ymax": 0.5}
+//
+// Keys are the long option names, with true or false for flags.
+// PNGs are encoded and written by background threads while the
+// next job renders, and every job gets a line with its timings in
+// the results log.
+
+#define BATCH_WRITERS 2
+#define BATCH_QUEUE 4
+
+// Widest image a job may ask for. Numbers for integer options have to
+// be whole and within range, and a job fails otherwise.
+#define BATCH_MAX_SIZE 65536
+
+
+// jobs and results may be "-" for stdin and stdout. Returns 0 when
+// every job was written.
+extern int32_t batch_run(const args_t * defaults, const char * jobs, const char * results);
+
+// Applies one line to a, which holds the defaults, and points output
+// into the line (NULL if it has none). With at, a "t" key with the
+// seconds from the start is accepted as well. Returns an error
+// message, or NULL.
+extern const char * batch_parse(char * line, args_t * a, char ** output, double * at);
+
+// A whole line of any length, without the newline, into buffer.
+// Returns NULL at the end of the file.
+extern char * batch_read_line(FILE * fp, char ** buffer, size_t * size);
@@ -0,0 +1,269 @@
+#include "buddha.h"
+
+
+// Samples are split into chunks, each with a random generator
+// seeded by its index, so the image is the same for any number of
+// threads. Every pool thread counts into its own buffer, and the
+// buffers are summed row by row at the end.
+
+#define BUDDHA_CHUNK 16384
+#define BUDDHA_BATCH 256
+#define BUDDHA_SEED 0x6d616e64656c6272
+
+typedef struct {
+  const viewport_t * view;
+  const kernel_t * kernel;
+  const kernel_params_t * params;
+  int64_t samples;
+  uint32_t ** density;
+  int32_t n_density;
+  image_t * field;
+} buddha_ctx_t;
+
+
+// SplitMix64, and a uniform double in [0, 1) from it
+
+static uint64_t _buddha_random(uint64_t * state)
+{
+  uint64_t z = (*state += 0x9e3779b97f4a7c15);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return z ^ (z >> 31);
+}
+
+static double _buddha_uniform(uint64_t * state)
+{
+  return (double) (_buddha_random(state) >> 11) * 0x1.0p-53;
+}
+
+
+// Points in the main cardioid and the period-2 bulb never escape.
+// Skipping them saves running the most expensive orbits to the cap.
+
+static int32_t _buddha_inside(const double x, const double y, const int32_t power)
+{
+  if (power != 2) {
+    return 0;
+  }
+
+  const double q = (x - 0.25) * (x - 0.25) + y * y;
+  if (q * (q + (x - 0.25)) <= 0.25 * y * y) {
+    return 1;
+  }
+  return (x + 1.0) * (x + 1.0) + y * y <= 0.0625;
+}
+
+
+// Run an escaping orbit again and count every pixel it visits. Only
+// points above the real axis are sampled, the orbit of the
+// conjugate point is the mirror image and is counted along with it.
+
+static void _buddha_trace(
+    const viewport_t * view,
+    uint32_t * density,
+    const double cx,
+    const double cy,
+    const int32_t steps,
+    const int32_t power
+  )
+{
+  const double sx = (double) view->width / view->x_range;
+  const double sy = (double) view->height / view->y_range;
+  const double y_max = view->y_min + view->y_range;
+
+  double x = 0;
+  double y = 0;
+
+  for (int32_t i = 0; i < steps; i++)
+  {
+    double zx = x, zy = y;
+    for (int32_t p = 1; p < power; p++) {
+      const double t = zx * x - zy * y;
+      zy = zx * y + zy * x;
+      zx = t;
+    }
+    x = zx + cx;
+    y = zy + cy;
+
+    const double fx = (x - view->x_min) * sx;
+    if (fx < 0 || fx >= view->width) {
+      continue;
+    }
+
+    const int32_t px = (int32_t) fx;
+    const double fy = (y_max - y) * sy;
+    const double fm = (y_max + y) * sy;
+
+    if (fy >= 0 && fy < view->height) {
+      density[(int32_t) fy * view->width + px]++;
+    }
+    if (fm >= 0 && fm < view->height) {
+      density[(int32_t) fm * view->width + px]++;
+    }
+  }
+}
+
+static void _buddha_chunk(void * ptr, const int32_t chunk, const int32_t thread)
+{
+  const buddha_ctx_t * ctx = ptr;
+  const int32_t power = ctx->kernel->power;
+  const int32_t max = ctx->params->iterations;
+  uint32_t * density = ctx->density[thread];
+
+  const int64_t first = (int64_t) chunk * BUDDHA_CHUNK;
+  const int64_t n = ctx->samples - first < BUDDHA_CHUNK ? ctx->samples - first : BUDDHA_CHUNK;
+
+  uint64_t state = BUDDHA_SEED ^ ((uint64_t) chunk << 20);
+
+  double * cx = mem_alloc(sizeof(double) * BUDDHA_BATCH);
+  double * cy = mem_alloc(sizeof(double) * BUDDHA_BATCH);
+  int32_t * out = mem_alloc(sizeof(int32_t) * BUDDHA_BATCH);
+
+  for (int64_t k = 0; k < n; )
+  {
+    // Sample c over [-2, 2] x [0, 2] and escape test in batches
+    int32_t m = 0;
+    for (; m < BUDDHA_BATCH && k < n; k++) {
+      const double x = -2.0 + 4.0 * _buddha_uniform(&state);
+      const double y = 2.0 * _buddha_uniform(&state);
+      if (!_buddha_inside(x, y, power)) {
+        cx[m] = x;
+        cy[m] = y;
+        m++;
+      }
+    }
+
+    ctx->kernel->solve(ctx->params, cx, cy, m, out, NULL);
+
+    for (int32_t l = 0; l < m; l++) {
+      if (out[l] < max) {
+        _buddha_trace(ctx->view, density, cx[l], cy[l], out[l], power);
+      }
+    }
+  }
+
+  mem_free(cx);
+  mem_free(cy);
+  mem_free(out);
+}
+
+static void _buddha_reduce_row(void * ptr, const int32_t py, const int32_t thread)
+{
+  (void) thread;
+
+  const buddha_ctx_t * ctx = ptr;
+  const int32_t w = ctx->view->width;
+  union pixel * row = &ctx->field->pixels[py * w];
+
+  for (int32_t px = 0; px < w; px++) {
+    uint64_t sum = 0;
+    for (int32_t t = 0; t < ctx->n_density; t++) {
+      sum += ctx->density[t][py * w + px];
+    }
+    row[px].i32 = sum > INT32_MAX ? INT32_MAX : (int32_t) sum;
+  }
+}
+
+image_t * buddha_render(
+    const viewport_t * view,
+    const kernel_t * kernel,
+    const kernel_params_t * params,
+    const int64_t samples
+  )
+{
+  const int64_t pixels = (int64_t) view->width * view->height;
+
+  buddha_ctx_t ctx = {
+    .view = view,
+    .kernel = kernel,
+    .params = params,
+    .samples = samples,
+    .n_density = pool_size(),
+    .field = image_new(view->width, view->height, IMAGE_MODE_ITERATIONS),
+  };
+
+  ctx.density = mem_alloc(sizeof(uint32_t *) * ctx.n_density);
+  for (int32_t t = 0; t < ctx.n_density; t++) {
+    ctx.density[t] = mem_alloc(sizeof(uint32_t) * pixels);
+  }
+
+  pool_parallel_for((samples + BUDDHA_CHUNK - 1) / BUDDHA_CHUNK, _buddha_chunk, &ctx);
+  pool_parallel_for(view->height, _buddha_reduce_row, &ctx);
+
+  for (int32_t t = 0; t < ctx.n_density; t++) {
+    mem_free(ctx.density[t]);
+  }
+  mem_free(ctx.density);
+
+  return ctx.field;
+}
+
+
+// Levels for coloring
+
+typedef struct {
+  image_t * field;
+  double scale;
+  int32_t * maximum;
+  uint64_t ** histograms;
+} buddha_levels_t;
+
+static void _buddha_max_row(void * ptr, const int32_t py, const int32_t thread)
+{
+  const buddha_levels_t * ctx = ptr;
+  const int32_t w = ctx->field->width;
+  const union pixel * row = &ctx->field->pixels[py * w];
+
+  for (int32_t px = 0; px < w; px++) {
+    if (row[px].i32 > ctx->maximum[thread]) {
+      ctx->maximum[thread] = row[px].i32;
+    }
+  }
+}
+
+static void _buddha_level_row(void * ptr, const int32_t py, const int32_t thread)
+{
+  const buddha_levels_t * ctx = ptr;
+  const int32_t w = ctx->field->width;
+  union pixel * row = &ctx->field->pixels[py * w];
+  uint64_t * histogram = ctx->histograms[thread];
+
+  for (int32_t px = 0; px < w; px++) {
+    const int32_t level = (int32_t) (sqrt((double) row[px].i32) * ctx->scale + 0.5);
+    row[px].i32 = level;
+    histogram[level]++;
+  }
+}
+
+void buddha_levels(image_t * field, const int32_t levels, uint64_t * histogram)
+{
+  const int32_t threads = pool_size();
+
+  buddha_levels_t ctx = {
+    .field = field,
+    .maximum = mem_alloc(sizeof(int32_t) * threads),
+    .histograms = mem_alloc(sizeof(uint64_t *) * threads),
+  };
+
+  pool_parallel_for(field->height, _buddha_max_row, &ctx);
+
+  int32_t maximum = 0;
+  for (int32_t t = 0; t < threads; t++) {
+    maximum = ctx.maximum[t] > maximum ? ctx.maximum[t] : maximum;
+    ctx.histograms[t] = mem_alloc(sizeof(uint64_t) * (levels + 1));
+  }
+  ctx.scale = maximum > 0 ? (double) (levels - 1) / sqrt((double) maximum) : 0.0;
+
+  pool_parallel_for(field->height, _buddha_level_row, &ctx);
+
+  memset(histogram, 0, sizeof(uint64_t) * (levels + 1));
+  for (int32_t t = 0; t < threads; t++) {
+    for (int32_t i = 0; i <= levels; i++) {
+      histogram[i] += ctx.histograms[t][i];
+    }
+    mem_free(ctx.histograms[t]);
+  }
+
+  mem_free(ctx.histograms);
+  mem_free(ctx.maximum);
+}
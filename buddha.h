@@ -0,0 +1,33 @@
+#pragma once
+
+#include <math.h>
+
+#include "cache.h"
+#include "image.h"
+#include "kernel.h"
+#include "pool.h"
+#include "utils.h"
+
+
+// Buddhabrot: density of the orbits of escaping points. Points c
+// are sampled at random over the square around the set, and every
+// orbit that escapes before the cap is run again to count the
+// pixels of the view it passes through.
+
+// Number of levels the densities are mapped to for coloring
+#define BUDDHA_LEVELS 256
+
+
+// Returns a field of visit counts (in i32) for the view. kernel
+// must be a Mandelbrot kernel and is used for the escape test.
+extern image_t * buddha_render(
+    const viewport_t * view,
+    const kernel_t * kernel,
+    const kernel_params_t * params,
+    const int64_t samples
+  );
+
+// Maps the counts in the field to 0 .. levels - 1 on a square root
+// scale, in place, and counts every level into histogram (levels +
+// 1 entries, the last one stays 0)
+extern void buddha_levels(image_t * field, const int32_t levels, uint64_t * histogram);
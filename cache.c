@@ -0,0 +1,252 @@
+#include "cache.h"
+
+
+// Global state: Cached fields and a mutex, since prefetched
+// fields are stored from a background thread
+
+static cache_entry_t cache_entries[CACHE_SIZE];
+static int32_t cache_count = 0;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// Pixel centers closer than this (in pixels) are treated as the
+// same sample. Well below anything visible, but loose enough for
+// the rounding in the coordinates of deep views.
+
+#define CACHE_TOLERANCE 1e-4
+
+
+// Aligned zooms. With the old pixel spacing d and the new one s * d,
+// the new samples are at u + (q + 0.5) s and the old ones at p + 0.5,
+// in old pixels from x_min. They meet when u + 0.5 s - 0.5 is a
+// multiple of s when zooming in, or of 1 when zooming out, so the
+// centered u is rounded to the nearest such offset. Rows count up
+// from y_min the same way.
+
+static double _viewport_align(const double u, const double s)
+{
+  const double step = s < 1.0 ? s : 1.0;
+  return round((u + 0.5 * s - 0.5) / step) * step - 0.5 * s + 0.5;
+}
+
+static viewport_t _viewport_zoom(const viewport_t * v, const double s)
+{
+  const double dx = v->x_range / v->width;
+  const double dy = v->y_range / v->height;
+
+  viewport_t zoomed = *v;
+  zoomed.x_range = v->x_range * s;
+  zoomed.y_range = v->y_range * s;
+  zoomed.x_min = v->x_min + _viewport_align(0.5 * v->width * (1.0 - s), s) * dx;
+  zoomed.y_min = v->y_min + _viewport_align(0.5 * v->height * (1.0 - s), s) * dy;
+
+  return zoomed;
+}
+
+viewport_t viewport_zoom_in(const viewport_t * v, const int32_t factor)
+{
+  return _viewport_zoom(v, 1.0 / factor);
+}
+
+viewport_t viewport_zoom_out(const viewport_t * v, const int32_t factor)
+{
+  return _viewport_zoom(v, (double) factor);
+}
+
+
+// Store and clear
+
+void _cache_remove(const int32_t i)
+{
+  image_destroy(cache_entries[i].field);
+  cache_entries[i] = cache_entries[--cache_count];
+}
+
+void cache_store(
+    const viewport_t * view,
+    const kernel_t * kernel,
+    const kernel_params_t * params,
+    image_t * field,
+    const int32_t prefetched
+  )
+{
+  pthread_mutex_lock(&cache_lock);
+
+  // A new render replaces the previous one and everything that
+  // was prefetched around it. Prefetched fields are dropped when
+  // there is no room for them.
+  if (!prefetched) {
+    while (cache_count > 0) {
+      _cache_remove(0);
+    }
+  } else if (cache_count == CACHE_SIZE) {
+    pthread_mutex_unlock(&cache_lock);
+    image_destroy(field);
+    return;
+  }
+
+  cache_entry_t entry = {
+    .view = *view,
+    .kernel = kernel,
+    .params = *params,
+    .field = field,
+    .prefetched = prefetched,
+  };
+  cache_entries[cache_count++] = entry;
+
+  pthread_mutex_unlock(&cache_lock);
+}
+
+image_t * cache_take(const image_t * field)
+{
+  image_t * taken = NULL;
+
+  pthread_mutex_lock(&cache_lock);
+
+  for (int32_t i = 0; i < cache_count && taken == NULL; i++) {
+    if (cache_entries[i].field == field) {
+      taken = cache_entries[i].field;
+      cache_entries[i] = cache_entries[--cache_count];
+    }
+  }
+
+  pthread_mutex_unlock(&cache_lock);
+
+  return taken;
+}
+
+void cache_clear()
+{
+  pthread_mutex_lock(&cache_lock);
+
+  while (cache_count > 0) {
+    _cache_remove(0);
+  }
+
+  pthread_mutex_unlock(&cache_lock);
+}
+
+
+// Lookup. Maps every column and row of the requested view to the
+// column or row of a cached field with the same pixel center, or
+// -1. Pans by whole pixels and integer zooms (in or out) with
+// aligned centers all show up as partial maps.
+//
+// Samples sit in the middle of their pixels, so a zoom exactly about
+// the center of the view is rarely aligned. Zooming in by two puts
+// every new center a quarter of an old pixel off, and zooming out by
+// two only lines up when the size is odd. viewport_zoom_in() and
+// viewport_zoom_out() move the zoom onto the old grid instead.
+
+int32_t _cache_map(const double p, const int32_t size)
+{
+  const double r = round(p);
+  if (fabs(p - r) > CACHE_TOLERANCE || r < 0 || r >= size) {
+    return -1;
+  }
+  return (int32_t) r;
+}
+
+int32_t _cache_map_columns(const viewport_t * view, const viewport_t * old, int32_t * col_src)
+{
+  int32_t mapped = 0;
+
+  for (int32_t px = 0; px < view->width; px++) {
+    const double x = viewport_x(view, px);
+    const double p = (x - old->x_min) / old->x_range * old->width - 0.5;
+    col_src[px] = _cache_map(p, old->width);
+    mapped += col_src[px] >= 0;
+  }
+
+  return mapped;
+}
+
+int32_t _cache_map_rows(const viewport_t * view, const viewport_t * old, int32_t * row_src)
+{
+  int32_t mapped = 0;
+
+  for (int32_t py = 0; py < view->height; py++) {
+    const double y = viewport_y(view, py);
+    const double p = old->height - (y - old->y_min) / old->y_range * old->height - 0.5;
+    row_src[py] = _cache_map(p, old->height);
+    mapped += row_src[py] >= 0;
+  }
+
+  return mapped;
+}
+
+int32_t _cache_matches(
+    const cache_entry_t * entry,
+    const kernel_t * kernel,
+    const kernel_params_t * params
+  )
+{
+  return entry->kernel == kernel
+    && entry->params.iterations == params->iterations
+    && entry->params.julia_x == params->julia_x
+    && entry->params.julia_y == params->julia_y;
+}
+
+int32_t cache_contains(
+    const viewport_t * view,
+    const kernel_t * kernel,
+    const kernel_params_t * params
+  )
+{
+  int32_t found = 0;
+
+  pthread_mutex_lock(&cache_lock);
+
+  for (int32_t i = 0; i < cache_count && !found; i++) {
+    const cache_entry_t * entry = &cache_entries[i];
+    found = _cache_matches(entry, kernel, params)
+      && memcmp(&entry->view, view, sizeof(viewport_t)) == 0;
+  }
+
+  pthread_mutex_unlock(&cache_lock);
+
+  return found;
+}
+
+const cache_entry_t * cache_lookup(
+    const viewport_t * view,
+    const kernel_t * kernel,
+    const kernel_params_t * params,
+    int32_t * col_src,
+    int32_t * row_src
+  )
+{
+  const cache_entry_t * best = NULL;
+  int64_t best_covered = 0;
+
+  int32_t * cols = mem_alloc(sizeof(int32_t) * view->width);
+  int32_t * rows = mem_alloc(sizeof(int32_t) * view->height);
+
+  pthread_mutex_lock(&cache_lock);
+
+  for (int32_t i = 0; i < cache_count; i++) {
+    const cache_entry_t * entry = &cache_entries[i];
+    if (!_cache_matches(entry, kernel, params)) {
+      continue;
+    }
+
+    const int64_t covered =
+      (int64_t) _cache_map_columns(view, &entry->view, cols) *
+      (int64_t) _cache_map_rows(view, &entry->view, rows);
+
+    if (covered > best_covered) {
+      best = entry;
+      best_covered = covered;
+      memcpy(col_src, cols, sizeof(int32_t) * view->width);
+      memcpy(row_src, rows, sizeof(int32_t) * view->height);
+    }
+  }
+
+  pthread_mutex_unlock(&cache_lock);
+
+  mem_free(cols);
+  mem_free(rows);
+
+  return best;
+}
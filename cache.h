@@ -0,0 +1,84 @@
+#pragma once
+
+#include <pthread.h>
+
+#include "image.h"
+#include "kernel.h"
+#include "utils.h"
+
+
+// A grid of pixel centers in the complex plane. Pixel px, py is
+// centered on viewport_x(px), viewport_y(py), with y pointing up.
+
+typedef struct {
+  double x_min;
+  double x_range;
+  double y_min;
+  double y_range;
+  int32_t width;
+  int32_t height;
+} viewport_t;
+
+static inline double viewport_x(const viewport_t * v, const int32_t px)
+{
+  const double p = ((double) px) + 0.5;
+  return v->x_min + (p / ((double) v->width)) * v->x_range;
+}
+
+static inline double viewport_y(const viewport_t * v, const int32_t py)
+{
+  const double h = (double) v->height;
+  const double p = ((double) py) + 0.5;
+  return v->y_min + ((h - p) / h) * v->y_range;
+}
+
+// Zooms by an integer factor about the center of v, moved by less
+// than a pixel so that samples of the new view fall on those of v:
+// every factor-th column and row when zooming in, and every column
+// and row of v when zooming out. A cached v then fills those in.
+extern viewport_t viewport_zoom_in(const viewport_t * v, const int32_t factor);
+extern viewport_t viewport_zoom_out(const viewport_t * v, const int32_t factor);
+
+
+// Cache of computed iteration fields. Holds the last render and
+// whatever neighbouring views have been prefetched since. Fields
+// are owned by the cache once stored.
+
+#define CACHE_SIZE 8
+
+typedef struct {
+  viewport_t view;
+  const kernel_t * kernel;
+  kernel_params_t params;
+  image_t * field;
+  int32_t prefetched;
+} cache_entry_t;
+
+
+extern void cache_store(
+    const viewport_t * view,
+    const kernel_t * kernel,
+    const kernel_params_t * params,
+    image_t * field,
+    const int32_t prefetched
+  );
+
+extern int32_t cache_contains(
+    const viewport_t * view,
+    const kernel_t * kernel,
+    const kernel_params_t * params
+  );
+
+extern const cache_entry_t * cache_lookup(
+    const viewport_t * view,
+    const kernel_t * kernel,
+    const kernel_params_t * params,
+    int32_t * col_src,
+    int32_t * row_src
+  );
+
+// Removes the entry holding field and hands the field over to the
+// caller, or returns NULL if it is not in the cache
+extern image_t * cache_take(const image_t * field);
+
+extern void cache_clear();
@@ -223,18 +223,150 @@ typedef struct {
 
 color_range_t * color_gradient;
 int32_t color_gradient_size = 0;
-int32_t n_iterations = 0;
+static int32_t n_iterations = 0;
+
+// The gradient looked up once for every possible value
+hsv_t * color_table = NULL;
 
 void _c_create_gradient(int32_t iterations);
 void _c_prepare_gradients(color_step_t * steps, int32_t n_steps);
+hsv_t _c_search_gradient(int32_t value);
+
+// Band gradients are kept by cap, so a run of renders that share
+// caps builds each one only once. The current gradient is either
+// one of those or a histogram one of its own.
+
+#define GRADIENT_CACHE_SIZE 8
+
+typedef struct {
+  int32_t iterations;
+  color_range_t * gradient;
+  int32_t gradient_size;
+  hsv_t * table;
+} gradient_entry_t;
+
+static gradient_entry_t gradient_cache[GRADIENT_CACHE_SIZE];
+static int32_t gradient_cache_next = 0;
+static bool color_cached = false;
+
+void _c_release_current()
+{
+  if (color_gradient != NULL && !color_cached) {
+    mem_free(color_gradient);
+    mem_free(color_table);
+  }
+  color_gradient = NULL;
+  color_table = NULL;
+}
 
 void colorize_init(int32_t iterations)
 {
+  _c_release_current();
+
   n_iterations = iterations;
+  color_cached = true;
+
+  for (int32_t k = 0; k < GRADIENT_CACHE_SIZE; k++) {
+    const gradient_entry_t * entry = &gradient_cache[k];
+    if (entry->table != NULL && entry->iterations == iterations) {
+      color_gradient = entry->gradient;
+      color_gradient_size = entry->gradient_size;
+      color_table = entry->table;
+      return;
+    }
+  }
+
   _c_create_gradient(iterations);
+
+  color_table = (hsv_t *) mem_alloc(sizeof(hsv_t) * (iterations + 1));
+  for (int32_t i = 0; i <= iterations; i++) {
+    color_table[i] = _c_search_gradient(i);
+  }
+
+  // Replace the oldest
+  gradient_entry_t * entry = &gradient_cache[gradient_cache_next];
+  gradient_cache_next = (gradient_cache_next + 1) % GRADIENT_CACHE_SIZE;
+
+  mem_free(entry->gradient);
+  mem_free(entry->table);
+  entry->iterations = iterations;
+  entry->gradient = color_gradient;
+  entry->gradient_size = color_gradient_size;
+  entry->table = color_table;
+}
+
+// Histogram equalization. The histogram has a count for every
+// number of iterations from 0 to the cap. Escaped pixels are spread
+// over a single pass through the color scheme by the share of
+// escaped pixels that needed fewer iterations, so every color covers
+// about as many pixels regardless of the cap. Pixels at the cap are
+// black as usual.
+
+#define HISTOGRAM_SPAN (RGB_COLORS_COUNT * 50)
+
+void colorize_init_histogram(int32_t iterations, const uint64_t * histogram)
+{
+  _c_release_current();
+
+  n_iterations = iterations;
+  color_cached = false;
+
+  // The bands for one pass through the colors, without the black
+  // they fade into at the end
+  _c_create_gradient(HISTOGRAM_SPAN + 2);
+
+  uint64_t escaped = 0;
+  for (int32_t i = 0; i < iterations; i++) {
+    escaped += histogram[i];
+  }
+
+  color_table = (hsv_t *) mem_alloc(sizeof(hsv_t) * (iterations + 1));
+
+  uint64_t below = 0;
+  for (int32_t i = 0; i < iterations; i++) {
+    const double t = escaped > 0 ? (double) below / (double) escaped : 0.0;
+    color_table[i] = _c_search_gradient((int32_t) round(t * HISTOGRAM_SPAN));
+    below += histogram[i];
+  }
+  color_table[iterations] = rgb_to_hsv(RGB_BLACK);
+}
+
+int32_t colorize_mode_parse(const char * name)
+{
+  if (strcmp(name, "bands") == 0) {
+    return COLORIZE_BANDS;
+  } else if (strcmp(name, "histogram") == 0) {
+    return COLORIZE_HISTOGRAM;
+  }
+  return COLORIZE_INVALID;
+}
+
+const char * colorize_mode_name(const int32_t mode)
+{
+  switch (mode) {
+    case COLORIZE_BANDS:
+      return "bands";
+    case COLORIZE_HISTOGRAM:
+      return "histogram";
+    default:
+      return "unknown";
+  }
 }
 
 hsv_t colorize(int32_t value)
+{
+  if (value >= 0 && value <= n_iterations) {
+    return color_table[value];
+  }
+  return _c_search_gradient(value);
+}
+
+int32_t colorize_range()
+{
+  return n_iterations;
+}
+
+hsv_t _c_search_gradient(int32_t value)
 {
   int32_t i_min = 0;
   int32_t i_max = color_gradient_size;
@@ -350,3 +482,190 @@ void _c_prepare_gradients(color_step_t * steps, int32_t n_steps)
   }
   #endif
 }
+
+
+// Palettes. The colors in use are sorted and merged. If there are
+// too many, the box of colors with the widest channel is split at
+// its weighted median along that channel until there are enough
+// boxes, and each box becomes its weighted mean. Every color then
+// gets the nearest palette entry.
+
+typedef struct {
+  rgb_t color;
+  uint64_t weight;
+} palette_entry_t;
+
+typedef struct {
+  int32_t start;
+  int32_t end;
+  int32_t channel;  // Widest one
+  int32_t range;
+} palette_box_t;
+
+static _Thread_local int32_t palette_channel;
+
+static uint32_t _palette_key(const rgb_t c)
+{
+  return ((uint32_t) c.r << 16) | ((uint32_t) c.g << 8) | c.b;
+}
+
+static uint8_t _palette_value(const rgb_t c, const int32_t channel)
+{
+  return channel == 0 ? c.r : channel == 1 ? c.g : c.b;
+}
+
+static int _palette_compare_key(const void * a, const void * b)
+{
+  const uint32_t ka = _palette_key(((const palette_entry_t *) a)->color);
+  const uint32_t kb = _palette_key(((const palette_entry_t *) b)->color);
+  return (ka > kb) - (ka < kb);
+}
+
+static int _palette_compare_channel(const void * a, const void * b)
+{
+  const int32_t va = _palette_value(((const palette_entry_t *) a)->color, palette_channel);
+  const int32_t vb = _palette_value(((const palette_entry_t *) b)->color, palette_channel);
+  return (va > vb) - (va < vb);
+}
+
+// Finds the widest channel of a box
+static void _palette_measure(const palette_entry_t * entries, palette_box_t * box)
+{
+  uint8_t lo[3] = { 255, 255, 255 };
+  uint8_t hi[3] = { 0, 0, 0 };
+
+  for (int32_t i = box->start; i < box->end; i++) {
+    for (int32_t c = 0; c < 3; c++) {
+      const uint8_t v = _palette_value(entries[i].color, c);
+      lo[c] = v < lo[c] ? v : lo[c];
+      hi[c] = v > hi[c] ? v : hi[c];
+    }
+  }
+
+  box->channel = 0;
+  for (int32_t c = 1; c < 3; c++) {
+    if (hi[c] - lo[c] > hi[box->channel] - lo[box->channel]) {
+      box->channel = c;
+    }
+  }
+  box->range = hi[box->channel] - lo[box->channel];
+}
+
+int32_t palette_build(
+    const rgb_t * colors,
+    const uint64_t * weights,
+    const int32_t n,
+    rgb_t * palette,
+    uint8_t * indices
+  )
+{
+  palette_entry_t * entries = mem_alloc(sizeof(palette_entry_t) * (n + 1));
+  int32_t m = 0;
+
+  for (int32_t i = 0; i < n; i++) {
+    if (weights == NULL || weights[i] > 0) {
+      palette_entry_t entry = { colors[i], weights ? weights[i] : 1 };
+      entries[m++] = entry;
+    }
+  }
+  if (m == 0) {
+    palette_entry_t entry = { RGB_BLACK, 1 };
+    entries[m++] = entry;
+  }
+
+  // Merge the same colors
+  qsort(entries, m, sizeof(palette_entry_t), _palette_compare_key);
+  int32_t unique = 1;
+  for (int32_t i = 1; i < m; i++) {
+    if (_palette_key(entries[i].color) == _palette_key(entries[unique - 1].color)) {
+      entries[unique - 1].weight += entries[i].weight;
+    } else {
+      entries[unique++] = entries[i];
+    }
+  }
+
+  int32_t size = 0;
+
+  if (unique <= PALETTE_SIZE) {
+    for (int32_t i = 0; i < unique; i++) {
+      palette[size++] = entries[i].color;
+    }
+  } else {
+    palette_box_t boxes[PALETTE_SIZE];
+    boxes[0].start = 0;
+    boxes[0].end = unique;
+    _palette_measure(entries, &boxes[0]);
+    size = 1;
+
+    while (size < PALETTE_SIZE)
+    {
+      int32_t best = -1;
+      for (int32_t b = 0; b < size; b++) {
+        if (boxes[b].range > 0 && (best < 0 || boxes[b].range > boxes[best].range)) {
+          best = b;
+        }
+      }
+      if (best < 0) {
+        break;
+      }
+
+      palette_box_t * box = &boxes[best];
+      palette_channel = box->channel;
+      qsort(&entries[box->start], box->end - box->start, sizeof(palette_entry_t),
+          _palette_compare_channel);
+
+      uint64_t total = 0;
+      for (int32_t i = box->start; i < box->end; i++) {
+        total += entries[i].weight;
+      }
+
+      int32_t split = box->start + 1;
+      uint64_t below = entries[box->start].weight;
+      while (split < box->end - 1 && 2 * below < total) {
+        below += entries[split++].weight;
+      }
+
+      boxes[size].start = split;
+      boxes[size].end = box->end;
+      box->end = split;
+      _palette_measure(entries, box);
+      _palette_measure(entries, &boxes[size]);
+      size++;
+    }
+
+    for (int32_t b = 0; b < size; b++) {
+      uint64_t sum[3] = { 0, 0, 0 };
+      uint64_t total = 0;
+      for (int32_t i = boxes[b].start; i < boxes[b].end; i++) {
+        for (int32_t c = 0; c < 3; c++) {
+          sum[c] += _palette_value(entries[i].color, c) * entries[i].weight;
+        }
+        total += entries[i].weight;
+      }
+      palette[b].r = (sum[0] + total / 2) / total;
+      palette[b].g = (sum[1] + total / 2) / total;
+      palette[b].b = (sum[2] + total / 2) / total;
+      palette[b].a = 0;
+    }
+  }
+
+  for (int32_t i = 0; i < n; i++) {
+    int32_t nearest = 0;
+    int32_t distance = INT32_MAX;
+    for (int32_t k = 0; k < size && distance > 0; k++) {
+      const int32_t dr = colors[i].r - palette[k].r;
+      const int32_t dg = colors[i].g - palette[k].g;
+      const int32_t db = colors[i].b - palette[k].b;
+      const int32_t d = dr * dr + dg * dg + db * db;
+      if (d < distance) {
+        nearest = k;
+        distance = d;
+      }
+    }
+    indices[i] = (uint8_t) nearest;
+  }
+
+  mem_free(entries);
+
+  return size;
+}
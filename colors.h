@@ -30,10 +30,43 @@ union pixel {
 };
 
 
+enum colorize_mode {
+    COLORIZE_INVALID = -1,
+    COLORIZE_BANDS = 0,      // Repeating bands every 50 iterations
+    COLORIZE_HISTOGRAM = 1,  // One pass through the colors, equalized
+};
+
+
+// Most colors an indexed image can have
+#define PALETTE_SIZE 256
+
+
 extern void colorize_init(const int32_t iterations);
 
+extern void colorize_init_histogram(const int32_t iterations, const uint64_t * histogram);
+
+extern int32_t colorize_mode_parse(const char * name);
+
+extern const char * colorize_mode_name(const int32_t mode);
+
 extern hsv_t colorize(const int32_t iterations);
 
+// Values from 0 to this have an entry in the current gradient
+extern int32_t colorize_range();
+
+// Picks a palette of at most PALETTE_SIZE colors for n colors, given
+// how often each is used (weights), and the palette index of each in
+// indices. The palette is exact when there are no more distinct
+// colors in use than fit, and a median cut of them otherwise.
+// Returns the palette size.
+extern int32_t palette_build(
+    const rgb_t * colors,
+    const uint64_t * weights,
+    const int32_t n,
+    rgb_t * palette,
+    uint8_t * indices
+  );
+
 extern rgb_t hsv_to_rgb(const hsv_t hsv);
 
 extern hsv_t rgb_to_hsv(const rgb_t rgb);
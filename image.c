@@ -33,15 +33,24 @@ image_t * image_new(
     const int32_t mode
   )
 {
+  // Indexed pixels are bytes, with the palette right after them
+  const size_t pixels = mode == IMAGE_MODE_INDEXED
+    ? (width * height + sizeof(union pixel) - 1) / sizeof(union pixel) + PALETTE_SIZE
+    : (size_t) width * height;
+
   size_t size;
   size = sizeof(image_t);
-  size = size + width * height * sizeof(union pixel);
+  size = size + pixels * sizeof(union pixel);
 
   image_t * img = mem_alloc(size);
 
   img->width = width;
   img->height = height;
   img->mode = mode;
+  img->palette_size = 0;
+  img->palette = mode == IMAGE_MODE_INDEXED
+    ? &img->pixels[pixels - PALETTE_SIZE].rgb
+    : NULL;
 
   return img;
 }
@@ -52,60 +61,159 @@ void image_destroy(image_t * img)
 }
 
 
-// Function to downscale by a factor 2 (2x2 px -> 1 px)
+// Context for passes that map one image onto another row by row
+
+typedef struct {
+  const image_t * in;
+  image_t * out;
+} image_pass_t;
+
+
+// Function to downscale by an integer factor (f x f px -> 1 px).
+// Rows of the output are spread over the worker pool. Each
+// channel is averaged as a byte, which works for both HSV and
+// RGB images. With gamma set, RGB images are averaged in linear
+// light instead of on the sRGB encoded values.
+
+#define DOWNSCALE_SHIFT 40
+
+typedef struct {
+  const image_t * in;
+  image_t * out;
+  int32_t factor;
+  int32_t gamma;
+  uint32_t * sums;  // One row of channel sums per thread
+} downscale_ctx_t;
 
-hsv_t _downscale_average(hsv_t * hsv, int32_t n);
+static uint16_t srgb_to_linear[256];
+static uint8_t linear_to_srgb[65536];
+static pthread_once_t gamma_tables_once = PTHREAD_ONCE_INIT;
 
-image_t * image_downscale(const image_t * img)
+void _downscale_gamma_tables();
+void _downscale_row(void * ptr, const int32_t y, const int32_t thread);
+
+image_t * image_downscale(
+    const image_t * img,
+    const int32_t factor,
+    const int32_t gamma
+  )
 {
   if (img == NULL) {
     critical("image_downscale() received NULL\n");
     return NULL;
   }
 
-  int32_t width = img->width / 2;
-  int32_t height = img->height / 2;
-
-  image_t * out = image_new(width, height, IMAGE_MODE_HSV);
+  if (factor < 1 || factor > DOWNSCALE_MAX_FACTOR) {
+    critical("image_downscale() received factor %d\n", factor);
+    return NULL;
+  }
 
-  hsv_t hsv[4];
-  union pixel px;
+  int32_t width = img->width / factor;
+  int32_t height = img->height / factor;
 
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      hsv[0] = image_get_pixel(img, x * 2 + 0, y * 2 + 0).hsv;
-      hsv[1] = image_get_pixel(img, x * 2 + 1, y * 2 + 0).hsv;
-      hsv[2] = image_get_pixel(img, x * 2 + 0, y * 2 + 1).hsv;
-      hsv[3] = image_get_pixel(img, x * 2 + 1, y * 2 + 1).hsv;
+  image_t * out = image_new(width, height, img->mode);
 
-      px.hsv = _downscale_average(&hsv[0], 4);
+  downscale_ctx_t ctx = {
+    .in = img,
+    .out = out,
+    .factor = factor,
+    .gamma = gamma && img->mode == IMAGE_MODE_RGB,
+    .sums = mem_alloc(sizeof(uint32_t) * 4 * width * pool_size()),
+  };
 
-      image_set_pixel(out, x, y, px);
-    }
+  if (ctx.gamma) {
+    pthread_once(&gamma_tables_once, _downscale_gamma_tables);
   }
 
+  perf_parallel_for("downscale", "pixel", width, height, _downscale_row, &ctx);
+
+  mem_free(ctx.sums);
+
   return (image_t * ) out;
 }
 
-hsv_t _downscale_average(hsv_t * hsv, int32_t n)
+void _downscale_gamma_tables()
 {
-  const double f = 1 / (double) n;
-  double h = 0.0, s = 0.0, v = 0.0;
+  for (int32_t i = 0; i < 256; i++) {
+    const double c = i / 255.0;
+    const double l = c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+    srgb_to_linear[i] = (uint16_t) round(l * 65535.0);
+  }
 
-  for (int32_t i = 0; i < n; i++)
-  {
-    h += hsv[i].h * f;
-    s += hsv[i].s * f;
-    v += hsv[i].v * f;
+  for (int32_t i = 0; i < 65536; i++) {
+    const double l = i / 65535.0;
+    const double c = l <= 0.0031308 ? l * 12.92 : 1.055 * pow(l, 1.0 / 2.4) - 0.055;
+    linear_to_srgb[i] = (uint8_t) round(c * 255.0);
   }
+}
 
-  hsv_t out = { round(h), round(s), round(v), 0 };
+void _downscale_row(void * ptr, const int32_t y, const int32_t thread)
+{
+  const downscale_ctx_t * ctx = ptr;
+  const int32_t f = ctx->factor;
+  const int32_t n = f * f;
+  const int32_t width = ctx->out->width;
+  const int32_t channels = width * 4;
+
+  uint32_t * restrict sums = &ctx->sums[channels * thread];
+  uint8_t * restrict dst = (uint8_t *) &ctx->out->pixels[y * width];
+
+  memset(sums, 0, sizeof(uint32_t) * channels);
+
+  // Sum up the f x f block behind each output channel
+  for (int32_t sy = 0; sy < f; sy++) {
+    const uint8_t * restrict src = (const uint8_t *)
+      &ctx->in->pixels[(y * f + sy) * ctx->in->width];
+
+    if (ctx->gamma) {
+      for (int32_t x = 0; x < width; x++) {
+        for (int32_t sx = 0; sx < f; sx++) {
+          const uint8_t * s = &src[(x * f + sx) * 4];
+          sums[x * 4 + 0] += srgb_to_linear[s[0]];
+          sums[x * 4 + 1] += srgb_to_linear[s[1]];
+          sums[x * 4 + 2] += srgb_to_linear[s[2]];
+        }
+      }
+    } else {
+      for (int32_t sx = 0; sx < f; sx++) {
+        for (int32_t x = 0; x < width; x++) {
+          sums[x * 4 + 0] += src[(x * f + sx) * 4 + 0];
+          sums[x * 4 + 1] += src[(x * f + sx) * 4 + 1];
+          sums[x * 4 + 2] += src[(x * f + sx) * 4 + 2];
+        }
+      }
+    }
+  }
 
-  return out;
+  if (ctx->gamma) {
+    const float inv = 1.0f / (float) n;
+    for (int32_t c = 0; c < channels; c++) {
+      dst[c] = linear_to_srgb[(uint16_t) (sums[c] * inv + 0.5f)];
+    }
+  } else {
+    // round(sum / n) as a multiplication by the reciprocal
+    // of 2n, which is exact for the range of sums we can get
+    const uint64_t d = 2 * (uint64_t) n;
+    const uint64_t m = ((1ULL << DOWNSCALE_SHIFT) + d - 1) / d;
+    for (int32_t c = 0; c < channels; c++) {
+      dst[c] = (uint8_t) (((2 * (uint64_t) sums[c] + n) * m) >> DOWNSCALE_SHIFT);
+    }
+  }
+
+  // The fourth channel (alpha) is unused
+  for (int32_t x = 0; x < width; x++) {
+    dst[x * 4 + 3] = 0;
+  }
 }
 
 
-// Convert an image in HSV to RGB
+// Convert an image in HSV to RGB. Same conversion as hsv_to_rgb()
+// in colors.c, but in integer math with the six hue sectors picked
+// by selects instead of a switch, so the row loop vectorizes. All
+// divisions have odd denominators and never round a tie, so the
+// result is identical to the floating point version.
+
+void _hsv_to_rgb_row(void * ptr, const int32_t y, const int32_t thread);
 
 image_t * image_hsv_to_rgb(const image_t * img)
 {
@@ -118,20 +226,354 @@ image_t * image_hsv_to_rgb(const image_t * img)
   int32_t height = img->height;
 
   image_t * out = image_new(width, height, IMAGE_MODE_RGB);
-  hsv_t hsv;
-  union pixel px;
-
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      hsv = image_get_pixel(img, x, y).hsv;
-      px.rgb = hsv_to_rgb(hsv);
-      image_set_pixel(out, x, y, px);
+  image_pass_t ctx = { img, out };
+
+  perf_parallel_for("hsv_to_rgb", "pixel", width, height, _hsv_to_rgb_row, &ctx);
+
+  return out;
+}
+
+void _hsv_to_rgb_row(void * ptr, const int32_t y, const int32_t thread)
+{
+  (void) thread;
+
+  const image_pass_t * ctx = ptr;
+  const int32_t width = ctx->in->width;
+  const uint8_t * restrict src = (const uint8_t *) &ctx->in->pixels[y * width];
+  uint8_t * restrict dst = (uint8_t *) &ctx->out->pixels[y * width];
+
+  for (int32_t x = 0; x < width; x++) {
+    const uint32_t h = src[x * 4 + 0];
+    const uint32_t s = src[x * 4 + 1];
+    const uint32_t v = src[x * 4 + 2];
+
+    // Sector i = floor(h * 6 / 255) and the fraction f / 255 within it.
+    // h = 255 is 360 degrees, which wraps around to sector 0.
+    uint32_t i = (h * 6) / 255;
+    uint32_t f = h * 6 - i * 255;
+    i = i == 6 ? 0 : i;
+
+    const uint32_t p = (2 * v * (255 - s) + 255) / 510;
+    const uint32_t q = (2 * v * (65025 - s * f) + 65025) / 130050;
+    const uint32_t t = (2 * v * (65025 - s * (255 - f)) + 65025) / 130050;
+
+    const uint32_t r = (i == 0 || i == 5) ? v : i == 1 ? q : (i == 4) ? t : p;
+    const uint32_t g = (i == 1 || i == 2) ? v : i == 0 ? t : (i == 3) ? q : p;
+    const uint32_t b = (i == 3 || i == 4) ? v : i == 2 ? t : (i == 5) ? q : p;
+
+    dst[x * 4 + 0] = (uint8_t) r;
+    dst[x * 4 + 1] = (uint8_t) g;
+    dst[x * 4 + 2] = (uint8_t) b;
+    dst[x * 4 + 3] = 0;
+  }
+}
+
+
+// Colorize an image of iteration counts into HSV
+
+void _colorize_row(void * ptr, const int32_t y, const int32_t thread);
+
+image_t * image_colorize(const image_t * img)
+{
+  if (img == NULL) {
+    critical("image_colorize() received NULL\n");
+    return (image_t * ) NULL;
+  }
+
+  image_t * out = image_new(img->width, img->height, IMAGE_MODE_HSV);
+  image_pass_t ctx = { img, out };
+
+  perf_parallel_for("colorize", "pixel", img->width, img->height, _colorize_row, &ctx);
+
+  return out;
+}
+
+void _colorize_row(void * ptr, const int32_t y, const int32_t thread)
+{
+  (void) thread;
+
+  const image_pass_t * ctx = ptr;
+  const int32_t width = ctx->in->width;
+  const union pixel * src = &ctx->in->pixels[y * width];
+  union pixel * dst = &ctx->out->pixels[y * width];
+
+  for (int32_t x = 0; x < width; x++) {
+    dst[x].hsv = colorize(src[x].i32);
+  }
+}
+
+
+// Indexed images. Every iteration count maps to one gradient entry,
+// so the palette comes from the gradient and the pixels are written
+// as indices straight from the counts, without HSV or RGB images in
+// between. Entries are weighted by how many pixels use them, in case
+// there are too many colors.
+
+typedef struct {
+  const image_t * in;
+  image_t * out;
+  int32_t n;
+  uint64_t ** counts;
+  const uint8_t * lut;
+} index_ctx_t;
+
+void _index_count_row(void * ptr, const int32_t y, const int32_t thread);
+void _index_row(void * ptr, const int32_t y, const int32_t thread);
+
+image_t * image_index(const image_t * field)
+{
+  if (field == NULL) {
+    critical("image_index() received NULL\n");
+    return (image_t * ) NULL;
+  }
+
+  const int32_t threads = pool_size();
+  const int32_t n = colorize_range() + 1;
+
+  image_t * out = image_new(field->width, field->height, IMAGE_MODE_INDEXED);
+
+  index_ctx_t ctx = {
+    .in = field,
+    .out = out,
+    .n = n,
+    .counts = mem_alloc(sizeof(uint64_t *) * threads),
+  };
+
+  for (int32_t t = 0; t < threads; t++) {
+    ctx.counts[t] = mem_alloc(sizeof(uint64_t) * n);
+  }
+
+  pool_parallel_for(field->height, _index_count_row, &ctx);
+
+  for (int32_t t = 1; t < threads; t++) {
+    for (int32_t i = 0; i < n; i++) {
+      ctx.counts[0][i] += ctx.counts[t][i];
     }
   }
 
+  // The gradient as RGB, converted the same way as full images
+  image_t * table = image_new(n, 1, IMAGE_MODE_HSV);
+  for (int32_t i = 0; i < n; i++) {
+    table->pixels[i].hsv = colorize(i);
+  }
+  image_t * rgb = image_hsv_to_rgb(table);
+  image_destroy(table);
+
+  rgb_t * colors = mem_alloc(sizeof(rgb_t) * n);
+  for (int32_t i = 0; i < n; i++) {
+    colors[i] = rgb->pixels[i].rgb;
+  }
+  image_destroy(rgb);
+
+  uint8_t * lut = mem_alloc(n);
+  out->palette_size = palette_build(colors, ctx.counts[0], n, out->palette, lut);
+  ctx.lut = lut;
+
+  perf_parallel_for("index", "pixel", field->width, field->height, _index_row, &ctx);
+
+  for (int32_t t = 0; t < threads; t++) {
+    mem_free(ctx.counts[t]);
+  }
+  mem_free(ctx.counts);
+  mem_free(colors);
+  mem_free(lut);
+
   return out;
 }
 
+void _index_count_row(void * ptr, const int32_t y, const int32_t thread)
+{
+  const index_ctx_t * ctx = ptr;
+  const int32_t width = ctx->in->width;
+  const union pixel * src = &ctx->in->pixels[y * width];
+  uint64_t * counts = ctx->counts[thread];
+
+  for (int32_t x = 0; x < width; x++) {
+    const int32_t v = src[x].i32;
+    counts[v < 0 ? 0 : v >= ctx->n ? ctx->n - 1 : v]++;
+  }
+}
+
+void _index_row(void * ptr, const int32_t y, const int32_t thread)
+{
+  (void) thread;
+
+  const index_ctx_t * ctx = ptr;
+  const int32_t width = ctx->in->width;
+  const union pixel * src = &ctx->in->pixels[y * width];
+  uint8_t * dst = (uint8_t *) ctx->out->pixels + (size_t) y * width;
+
+  for (int32_t x = 0; x < width; x++) {
+    const int32_t v = src[x].i32;
+    dst[x] = ctx->lut[v < 0 ? 0 : v >= ctx->n ? ctx->n - 1 : v];
+  }
+}
+
+
+// Quantize RGB, for images whose colors are averages. Colors are
+// counted in bins of 5 bits per channel, and every bin is its mean
+// color, so images with few colors keep them exactly.
+
+#define QUANTIZE_BINS (1 << 15)
+
+typedef struct {
+  uint64_t count;
+  uint64_t r;
+  uint64_t g;
+  uint64_t b;
+} quantize_bin_t;
+
+typedef struct {
+  const image_t * in;
+  image_t * out;
+  quantize_bin_t ** bins;
+  const uint8_t * lut;
+} quantize_ctx_t;
+
+void _quantize_count_row(void * ptr, const int32_t y, const int32_t thread);
+void _quantize_row(void * ptr, const int32_t y, const int32_t thread);
+
+static inline int32_t _quantize_bin(const rgb_t c)
+{
+  return ((c.r >> 3) << 10) | ((c.g >> 3) << 5) | (c.b >> 3);
+}
+
+image_t * image_quantize(const image_t * img)
+{
+  if (img == NULL) {
+    critical("image_quantize() received NULL\n");
+    return (image_t * ) NULL;
+  }
+
+  const int32_t threads = pool_size();
+
+  image_t * out = image_new(img->width, img->height, IMAGE_MODE_INDEXED);
+
+  quantize_ctx_t ctx = {
+    .in = img,
+    .out = out,
+    .bins = mem_alloc(sizeof(quantize_bin_t *) * threads),
+  };
+
+  for (int32_t t = 0; t < threads; t++) {
+    ctx.bins[t] = mem_alloc(sizeof(quantize_bin_t) * QUANTIZE_BINS);
+  }
+
+  pool_parallel_for(img->height, _quantize_count_row, &ctx);
+
+  rgb_t * colors = mem_alloc(sizeof(rgb_t) * QUANTIZE_BINS);
+  uint64_t * weights = mem_alloc(sizeof(uint64_t) * QUANTIZE_BINS);
+
+  for (int32_t i = 0; i < QUANTIZE_BINS; i++) {
+    quantize_bin_t bin = { 0, 0, 0, 0 };
+    for (int32_t t = 0; t < threads; t++) {
+      bin.count += ctx.bins[t][i].count;
+      bin.r += ctx.bins[t][i].r;
+      bin.g += ctx.bins[t][i].g;
+      bin.b += ctx.bins[t][i].b;
+    }
+
+    weights[i] = bin.count;
+    if (bin.count > 0) {
+      colors[i].r = (bin.r + bin.count / 2) / bin.count;
+      colors[i].g = (bin.g + bin.count / 2) / bin.count;
+      colors[i].b = (bin.b + bin.count / 2) / bin.count;
+    } else {
+      // Center of the bin, for the nearest palette entry
+      colors[i].r = ((i >> 10) << 3) | 4;
+      colors[i].g = (((i >> 5) & 31) << 3) | 4;
+      colors[i].b = ((i & 31) << 3) | 4;
+    }
+    colors[i].a = 0;
+  }
+
+  uint8_t * lut = mem_alloc(QUANTIZE_BINS);
+  out->palette_size = palette_build(colors, weights, QUANTIZE_BINS, out->palette, lut);
+  ctx.lut = lut;
+
+  perf_parallel_for("quantize", "pixel", img->width, img->height, _quantize_row, &ctx);
+
+  for (int32_t t = 0; t < threads; t++) {
+    mem_free(ctx.bins[t]);
+  }
+  mem_free(ctx.bins);
+  mem_free(colors);
+  mem_free(weights);
+  mem_free(lut);
+
+  return out;
+}
+
+void _quantize_count_row(void * ptr, const int32_t y, const int32_t thread)
+{
+  const quantize_ctx_t * ctx = ptr;
+  const int32_t width = ctx->in->width;
+  const union pixel * src = &ctx->in->pixels[y * width];
+  quantize_bin_t * bins = ctx->bins[thread];
+
+  for (int32_t x = 0; x < width; x++) {
+    quantize_bin_t * bin = &bins[_quantize_bin(src[x].rgb)];
+    bin->count++;
+    bin->r += src[x].rgb.r;
+    bin->g += src[x].rgb.g;
+    bin->b += src[x].rgb.b;
+  }
+}
+
+void _quantize_row(void * ptr, const int32_t y, const int32_t thread)
+{
+  (void) thread;
+
+  const quantize_ctx_t * ctx = ptr;
+  const int32_t width = ctx->in->width;
+  const union pixel * src = &ctx->in->pixels[y * width];
+  uint8_t * dst = (uint8_t *) ctx->out->pixels + (size_t) y * width;
+
+  for (int32_t x = 0; x < width; x++) {
+    dst[x] = ctx->lut[_quantize_bin(src[x].rgb)];
+  }
+}
+
+
+// Turn a colored render into the RGB image to write. Consumes img.
+// Averaging in linear light is done on RGB, so convert first then.
+
+image_t * image_finish(image_t * img, const int32_t factor, const int32_t gamma)
+{
+  if (img == NULL) {
+    critical("image_finish() received NULL\n");
+    return (image_t * ) NULL;
+  }
+
+  // Already final, indexed images are never supersampled
+  if (img->mode == IMAGE_MODE_INDEXED) {
+    return img;
+  }
+
+  if (gamma && img->mode == IMAGE_MODE_HSV) {
+    image_t * old = img;
+    img = image_hsv_to_rgb(old);
+    image_destroy(old);
+  }
+
+  if (factor > 1) {
+    image_t * old = img;
+    img = image_downscale(old, factor, gamma);
+    image_destroy(old);
+    if (img == NULL) {
+      return NULL;
+    }
+  }
+
+  if (img->mode == IMAGE_MODE_HSV) {
+    image_t * old = img;
+    img = image_hsv_to_rgb(old);
+    image_destroy(old);
+  }
+
+  return img;
+}
+
 
 // Write image to file as PNG
 
@@ -147,6 +589,7 @@ int32_t image_write_png(const image_t * img, const char * filename) {
   }
 
   int status = -1;
+  const int64_t begin = trace_begin();
 
   FILE *fp;
 
@@ -162,6 +605,7 @@ int32_t image_write_png(const image_t * img, const char * filename) {
 
   int32_t pixel_size = 3;
   int32_t depth = 8;
+  const int32_t indexed = img->mode == IMAGE_MODE_INDEXED;
 
   fp = fopen(filename, "wb");
   if (!fp) {
@@ -169,6 +613,26 @@ int32_t image_write_png(const image_t * img, const char * filename) {
     return 2;
   }
 
+  // Rows to write, filled before libpng can jump back to the error
+  // path. Indexed rows are written as they are, RGB ones are packed
+  // into rows of their own, which stay ours after png_set_rows().
+  row_pointers = mem_alloc(height * sizeof(png_byte *));
+  for (y = 0; y < height; y++) {
+    if (indexed) {
+      row_pointers[y] = (png_byte *) img->pixels + y * width;
+      continue;
+    }
+
+    png_byte * row = mem_alloc(sizeof(uint8_t) * width * pixel_size);
+    row_pointers[y] = row;
+    for (x = 0; x < width; x++) {
+      rgb_t px = image_get_pixel(img, x, y).rgb;
+      *row++ = px.r;
+      *row++ = px.g;
+      *row++ = px.b;
+    }
+  }
+
   png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
   if (png_ptr == NULL) {
       goto png_create_write_struct_failed;
@@ -191,23 +655,20 @@ int32_t image_write_png(const image_t * img, const char * filename) {
     width,
     height,
     depth,
-    PNG_COLOR_TYPE_RGB,
+    indexed ? PNG_COLOR_TYPE_PALETTE : PNG_COLOR_TYPE_RGB,
     PNG_INTERLACE_NONE,
     PNG_COMPRESSION_TYPE_DEFAULT,
     PNG_FILTER_TYPE_DEFAULT
   );
 
-  // Fill data
-  row_pointers = png_malloc(png_ptr, height * sizeof (png_byte *));
-  for (y = 0; y < height; y++) {
-    png_byte *row = png_malloc(png_ptr, sizeof (uint8_t) * width * pixel_size);
-    row_pointers[y] = row;
-    for (x = 0; x < width; x++) {
-      rgb_t px = image_get_pixel(img, x, y).rgb;
-      *row++ = px.r;
-      *row++ = px.g;
-      *row++ = px.b;
+  if (indexed) {
+    png_color palette[PALETTE_SIZE];
+    for (int32_t i = 0; i < img->palette_size; i++) {
+      palette[i].red = img->palette[i].r;
+      palette[i].green = img->palette[i].g;
+      palette[i].blue = img->palette[i].b;
     }
+    png_set_PLTE(png_ptr, info_ptr, palette, img->palette_size);
   }
 
   // Write the image data to fp
@@ -224,5 +685,12 @@ png_create_info_struct_failed:
 png_create_write_struct_failed:
   fclose (fp);
 
+  for (y = 0; y < height && !indexed; y++) {
+    mem_free(row_pointers[y]);
+  }
+  mem_free(row_pointers);
+
+  trace_end("write_png", "io", begin, -1);
+
   return status;
 }
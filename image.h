@@ -6,6 +6,8 @@
 #include <png.h>
 
 #include "colors.h"
+#include "perf.h"
+#include "pool.h"
 #include "utils.h"
 
 
@@ -13,12 +15,16 @@ enum image_mode {
     IMAGE_MODE_GREYSCALE = 0,
     IMAGE_MODE_RGB = 1,
     IMAGE_MODE_HSV = 2,
+    IMAGE_MODE_ITERATIONS = 3,  // Iteration count per pixel in i32
+    IMAGE_MODE_INDEXED = 4,     // One byte per pixel into the palette
 };
 
 typedef struct {
     int32_t width;
     int32_t height;
     int32_t mode;
+    int32_t palette_size;  // Indexed images only
+    rgb_t * palette;
     union pixel pixels[];  // Hack-ish. Will allocate with number of pixels
 } image_t;
 
@@ -31,8 +37,25 @@ extern image_t * image_new(const int32_t width, const int32_t height, const int3
 
 extern void image_destroy(image_t * img);
 
-extern image_t * image_downscale(const image_t * img);
+// Largest factor image_downscale() takes, it returns NULL above it
+#define DOWNSCALE_MAX_FACTOR 64
+
+extern image_t * image_downscale(const image_t * img, const int32_t factor, const int32_t gamma);
 
 extern image_t * image_hsv_to_rgb(const image_t * img);
 
+extern image_t * image_colorize(const image_t * img);
+
+// Indexed image from iteration counts, through the current gradient
+extern image_t * image_index(const image_t * field);
+
+// Indexed image from RGB, with a median cut palette if there are
+// more colors than fit
+extern image_t * image_quantize(const image_t * img);
+
+// Downscales a colored render by factor and converts it to RGB,
+// destroying img. gamma averages in linear light. Returns NULL when
+// the factor is out of range.
+extern image_t * image_finish(image_t * img, const int32_t factor, const int32_t gamma);
+
 extern int32_t image_write_png(const image_t * img, const char * filename);
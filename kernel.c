@@ -0,0 +1,236 @@
+#include "kernel.h"
+
+#include <float.h>
+
+
+// The kernel implementations, one set per floating point type.
+// Lanes are sized for two 128-bit SIMD registers, so floats get
+// twice as many lanes as doubles. Long doubles are not vectorized
+// and only get the scalar variant.
+
+#define KERNEL_INLINE static inline __attribute__((always_inline))
+
+#define KERNEL_T float
+#define KERNEL_S f
+#define KERNEL_LANES 8
+#include "kernel_impl.h"
+#undef KERNEL_T
+#undef KERNEL_S
+#undef KERNEL_LANES
+
+#define KERNEL_T double
+#define KERNEL_S d
+#define KERNEL_LANES 4
+#include "kernel_impl.h"
+#undef KERNEL_T
+#undef KERNEL_S
+#undef KERNEL_LANES
+
+#define KERNEL_T long double
+#define KERNEL_S l
+#define KERNEL_LANES 1
+#include "kernel_impl.h"
+#undef KERNEL_T
+#undef KERNEL_S
+#undef KERNEL_LANES
+
+
+// Kernel definitions. For the Mandelbrot set z starts at 0 and
+// c is the point, for Julia sets z starts at the point and c is
+// fixed. Each kernel is the inlined loop above with constant
+// type, power and variant.
+
+#define KERNEL_DEFINE(TYPE, JULIA, POWER, S, VARIANT) \
+  static void kernel_##TYPE##_##POWER##_##S##_##VARIANT( \
+      const kernel_params_t * params, \
+      const double * cx, \
+      const double * cy, \
+      const int32_t n, \
+      int32_t * out, \
+      kernel_state_t * state) \
+  { \
+    _kernel_solve_##VARIANT##_##S(params, cx, cy, n, out, state, POWER, JULIA); \
+  }
+
+#define KERNEL_DEFINE_VARIANTS(TYPE, JULIA, POWER) \
+  KERNEL_DEFINE(TYPE, JULIA, POWER, f, scalar) \
+  KERNEL_DEFINE(TYPE, JULIA, POWER, f, lanes) \
+  KERNEL_DEFINE(TYPE, JULIA, POWER, d, scalar) \
+  KERNEL_DEFINE(TYPE, JULIA, POWER, d, lanes) \
+  KERNEL_DEFINE(TYPE, JULIA, POWER, l, scalar)
+
+#define KERNEL_DEFINE_POWERS(TYPE, JULIA) \
+  KERNEL_DEFINE_VARIANTS(TYPE, JULIA, 2) \
+  KERNEL_DEFINE_VARIANTS(TYPE, JULIA, 3) \
+  KERNEL_DEFINE_VARIANTS(TYPE, JULIA, 4) \
+  KERNEL_DEFINE_VARIANTS(TYPE, JULIA, 5) \
+  KERNEL_DEFINE_VARIANTS(TYPE, JULIA, 6) \
+  KERNEL_DEFINE_VARIANTS(TYPE, JULIA, 7) \
+  KERNEL_DEFINE_VARIANTS(TYPE, JULIA, 8)
+
+KERNEL_DEFINE_POWERS(mandelbrot, 0)
+KERNEL_DEFINE_POWERS(julia, 1)
+
+
+// Table of all kernels
+
+#define KERNEL_ENTRY(TYPE, JULIA, POWER, S, PRECISION, VARIANT, LANES) \
+  { #TYPE "-" #POWER " " #S " " #VARIANT, POWER, JULIA, \
+    KERNEL_PRECISION_##PRECISION, LANES, kernel_##TYPE##_##POWER##_##S##_##VARIANT }
+
+// The names use the suffix of the type: f(loat), d(ouble) or l(ong double)
+
+#define KERNEL_ENTRY_VARIANTS(TYPE, JULIA, POWER) \
+  KERNEL_ENTRY(TYPE, JULIA, POWER, f, FLOAT, scalar, 1), \
+  KERNEL_ENTRY(TYPE, JULIA, POWER, f, FLOAT, lanes, 8), \
+  KERNEL_ENTRY(TYPE, JULIA, POWER, d, DOUBLE, scalar, 1), \
+  KERNEL_ENTRY(TYPE, JULIA, POWER, d, DOUBLE, lanes, 4), \
+  KERNEL_ENTRY(TYPE, JULIA, POWER, l, LONG_DOUBLE, scalar, 1)
+
+#define KERNEL_ENTRY_POWERS(TYPE, JULIA) \
+  KERNEL_ENTRY_VARIANTS(TYPE, JULIA, 2), \
+  KERNEL_ENTRY_VARIANTS(TYPE, JULIA, 3), \
+  KERNEL_ENTRY_VARIANTS(TYPE, JULIA, 4), \
+  KERNEL_ENTRY_VARIANTS(TYPE, JULIA, 5), \
+  KERNEL_ENTRY_VARIANTS(TYPE, JULIA, 6), \
+  KERNEL_ENTRY_VARIANTS(TYPE, JULIA, 7), \
+  KERNEL_ENTRY_VARIANTS(TYPE, JULIA, 8)
+
+static const kernel_t kernels [] = {
+  KERNEL_ENTRY_POWERS(mandelbrot, 0),
+  KERNEL_ENTRY_POWERS(julia, 1),
+};
+
+static const int32_t kernels_count = sizeof(kernels) / sizeof(kernels[0]);
+
+
+// Pick a kernel. Without a preference for scalar or lanes the
+// widest variant available for the precision is used.
+
+const kernel_t * kernel_select(
+    const int32_t power,
+    const int32_t julia,
+    const int32_t precision,
+    const int32_t variant
+  )
+{
+  const kernel_t * best = NULL;
+
+  for (int32_t i = 0; i < kernels_count; i++) {
+    const kernel_t * k = &kernels[i];
+    if (k->power != power || k->julia != (julia ? 1 : 0) || k->precision != precision) {
+      continue;
+    }
+    if (variant == KERNEL_VARIANT_SCALAR && k->lanes == 1) {
+      return k;
+    }
+    if (variant == KERNEL_VARIANT_LANES && k->lanes > 1) {
+      return k;
+    }
+    if (best == NULL || k->lanes > best->lanes) {
+      best = k;
+    }
+  }
+
+  if (best == NULL) {
+    critical("No kernel for power %d (julia = %d, precision = %s)\n",
+        power, julia, kernel_precision_name(precision));
+  }
+
+  return best;
+}
+
+
+// Precision selection.
+//
+// Rounding errors in z grow at least in step with the iteration
+// count, and much faster on orbits close to the boundary, where any
+// error changes when they escape. So no view is safe in floats, which
+// are only used when asked for. Doubles are kept while the pixel
+// spacing stays well above the error that builds up linearly at the
+// magnitude of the coordinates in the view.
+
+#define KERNEL_PRECISION_MARGIN 8.0
+
+static double _kernel_error(const double epsilon, const double magnitude, const int32_t iterations)
+{
+  return KERNEL_PRECISION_MARGIN * epsilon * magnitude * (double) iterations;
+}
+
+int32_t kernel_precision_select(
+    const double spacing,
+    const double magnitude,
+    const int32_t iterations
+  )
+{
+  const double m = magnitude < 2.0 ? 2.0 : magnitude;
+
+  if (spacing >= _kernel_error(DBL_EPSILON, m, iterations)) {
+    return KERNEL_PRECISION_DOUBLE;
+  }
+
+  return KERNEL_PRECISION_LONG_DOUBLE;
+}
+
+int32_t kernel_precision_exhausted(const double spacing, const double magnitude)
+{
+  // Adjacent pixels a few ulps apart are the same point for all
+  // practical purposes, and coordinates are passed as doubles
+  return spacing < 4.0 * DBL_EPSILON * magnitude;
+}
+
+int32_t kernel_precision_parse(const char * name)
+{
+  if (strcmp(name, "auto") == 0) {
+    return KERNEL_PRECISION_AUTO;
+  } else if (strcmp(name, "float") == 0) {
+    return KERNEL_PRECISION_FLOAT;
+  } else if (strcmp(name, "double") == 0) {
+    return KERNEL_PRECISION_DOUBLE;
+  } else if (strcmp(name, "long") == 0) {
+    return KERNEL_PRECISION_LONG_DOUBLE;
+  }
+  return KERNEL_PRECISION_INVALID;
+}
+
+const char * kernel_precision_name(const int32_t precision)
+{
+  switch (precision) {
+    case KERNEL_PRECISION_AUTO:
+      return "auto";
+    case KERNEL_PRECISION_FLOAT:
+      return "float";
+    case KERNEL_PRECISION_DOUBLE:
+      return "double";
+    case KERNEL_PRECISION_LONG_DOUBLE:
+      return "long";
+    default:
+      return "unknown";
+  }
+}
+
+int32_t kernel_variant_parse(const char * name)
+{
+  if (strcmp(name, "auto") == 0) {
+    return KERNEL_VARIANT_AUTO;
+  } else if (strcmp(name, "scalar") == 0) {
+    return KERNEL_VARIANT_SCALAR;
+  } else if (strcmp(name, "lanes") == 0) {
+    return KERNEL_VARIANT_LANES;
+  }
+  return KERNEL_VARIANT_INVALID;
+}
+
+const char * kernel_variant_name(const int32_t variant)
+{
+  switch (variant) {
+    case KERNEL_VARIANT_AUTO:
+      return "auto";
+    case KERNEL_VARIANT_SCALAR:
+      return "scalar";
+    case KERNEL_VARIANT_LANES:
+      return "lanes";
+    default:
+      return "unknown";
+  }
+}
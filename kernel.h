@@ -0,0 +1,96 @@
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+
+// Escape-time kernels for z -> z^d + c. There is one compiled
+// variant per exponent d, fractal type (Mandelbrot or Julia),
+// floating point precision and loop shape, see kernel.c.
+
+#define KERNEL_MIN_POWER 2
+#define KERNEL_MAX_POWER 8
+
+
+enum kernel_precision {
+  KERNEL_PRECISION_INVALID = -2,
+  KERNEL_PRECISION_AUTO = -1,
+  KERNEL_PRECISION_FLOAT = 0,
+  KERNEL_PRECISION_DOUBLE = 1,
+  KERNEL_PRECISION_LONG_DOUBLE = 2,
+};
+
+enum kernel_variant {
+  KERNEL_VARIANT_INVALID = -1,
+  KERNEL_VARIANT_AUTO = 0,
+  KERNEL_VARIANT_SCALAR = 1,  // One point at a time
+  KERNEL_VARIANT_LANES = 2,   // Several points side by side (SIMD)
+};
+
+
+typedef struct {
+  int32_t iterations;
+  double julia_x;  // Fixed c for Julia sets
+  double julia_y;
+} kernel_params_t;
+
+
+// Orbits to continue instead of starting over. Every point starts
+// from its z after start iterations, and the z it stops at is
+// written back, so a later call with a higher cap can pick up
+// where this one left off.
+
+typedef struct {
+  double * zx;
+  double * zy;
+  int32_t start;
+} kernel_state_t;
+
+
+// Solve n points given by their coordinates and write the number
+// of iterations before escaping (or params->iterations) to out.
+// state is NULL for a fresh start.
+
+typedef void (*kernel_fn_t)(
+    const kernel_params_t * params,
+    const double * cx,
+    const double * cy,
+    const int32_t n,
+    int32_t * out,
+    kernel_state_t * state
+  );
+
+typedef struct {
+  const char * name;
+  int32_t power;
+  int32_t julia;
+  int32_t precision;
+  int32_t lanes;
+  kernel_fn_t solve;
+} kernel_t;
+
+
+extern const kernel_t * kernel_select(
+    const int32_t power,
+    const int32_t julia,
+    const int32_t precision,
+    const int32_t variant
+  );
+
+extern int32_t kernel_precision_select(
+    const double spacing,
+    const double magnitude,
+    const int32_t iterations
+  );
+
+extern int32_t kernel_precision_exhausted(const double spacing, const double magnitude);
+
+extern int32_t kernel_precision_parse(const char * name);
+
+extern const char * kernel_precision_name(const int32_t precision);
+
+extern int32_t kernel_variant_parse(const char * name);
+
+extern const char * kernel_variant_name(const int32_t variant);
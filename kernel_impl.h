@@ -0,0 +1,257 @@
+// Kernel implementation for one floating point type. Included
+// from kernel.c once per type with these defined:
+//
+//   KERNEL_T      the floating point type
+//   KERNEL_S      suffix for the function names (f, d, l)
+//   KERNEL_LANES  points solved side by side by the lanes variant
+//
+// Everything in here is always inlined into the kernels in
+// kernel.c with a constant power and fractal type.
+
+#define KERNEL_NAME__(name, suffix) name##_##suffix
+#define KERNEL_NAME_(name, suffix) KERNEL_NAME__(name, suffix)
+#define KERNEL_NAME(name) KERNEL_NAME_(name, KERNEL_S)
+
+
+KERNEL_INLINE void KERNEL_NAME(_kernel_mul)(
+    KERNEL_T * x,
+    KERNEL_T * y,
+    const KERNEL_T ax,
+    const KERNEL_T ay
+  )
+{
+  const KERNEL_T t = *x * ax - *y * ay;
+  *y = *x * ay + *y * ax;
+  *x = t;
+}
+
+
+// z^power, reusing the squares from the escape check for z^2 and
+// building higher powers by squaring and multiplying
+
+KERNEL_INLINE void KERNEL_NAME(_kernel_pow)(
+    KERNEL_T * x,
+    KERNEL_T * y,
+    const KERNEL_T x2,
+    const KERNEL_T y2,
+    const int32_t power
+  )
+{
+  const KERNEL_T z2x = x2 - y2;
+  const KERNEL_T z2y = 2 * *x * *y;
+  KERNEL_T zx = z2x, zy = z2y;
+  KERNEL_T z4x, z4y;
+
+  switch (power) {
+    case 2:
+      break;
+    case 3:
+      KERNEL_NAME(_kernel_mul)(&zx, &zy, *x, *y);
+      break;
+    case 4:
+      KERNEL_NAME(_kernel_mul)(&zx, &zy, z2x, z2y);
+      break;
+    case 5:
+      KERNEL_NAME(_kernel_mul)(&zx, &zy, z2x, z2y);
+      KERNEL_NAME(_kernel_mul)(&zx, &zy, *x, *y);
+      break;
+    case 6:
+      KERNEL_NAME(_kernel_mul)(&zx, &zy, *x, *y);
+      KERNEL_NAME(_kernel_mul)(&zx, &zy, zx, zy);
+      break;
+    case 7:
+      z4x = z2x; z4y = z2y;
+      KERNEL_NAME(_kernel_mul)(&z4x, &z4y, z2x, z2y);
+      KERNEL_NAME(_kernel_mul)(&zx, &zy, *x, *y);
+      KERNEL_NAME(_kernel_mul)(&zx, &zy, z4x, z4y);
+      break;
+    case 8:
+    default:
+      KERNEL_NAME(_kernel_mul)(&zx, &zy, zx, zy);
+      KERNEL_NAME(_kernel_mul)(&zx, &zy, zx, zy);
+      break;
+  }
+
+  *x = zx;
+  *y = zy;
+}
+
+
+// The iteration for a single point
+
+KERNEL_INLINE int32_t KERNEL_NAME(_kernel_point)(
+    KERNEL_T * zx,
+    KERNEL_T * zy,
+    const KERNEL_T cx,
+    const KERNEL_T cy,
+    const int32_t start,
+    const int32_t max,
+    const int32_t power
+  )
+{
+  KERNEL_T x = *zx, y = *zy;
+  KERNEL_T x2, y2;
+  int32_t i;
+
+  for (i = start; i < max; i++)
+  {
+    // Check if outside radius of two
+    x2 = x * x;
+    y2 = y * y;
+    if ((x2 + y2) > 4)
+    {
+      break;
+    }
+
+    KERNEL_NAME(_kernel_pow)(&x, &y, x2, y2, power);
+    x = x + cx;
+    y = y + cy;
+  }
+
+  *zx = x;
+  *zy = y;
+  return i;
+}
+
+
+// Scalar variant: one point after the other
+
+KERNEL_INLINE void KERNEL_NAME(_kernel_solve_scalar)(
+    const kernel_params_t * params,
+    const double * cx,
+    const double * cy,
+    const int32_t n,
+    int32_t * out,
+    kernel_state_t * state,
+    const int32_t power,
+    const int32_t julia
+  )
+{
+  const int32_t max = params->iterations;
+  const int32_t start = state ? state->start : 0;
+  const KERNEL_T jx = (KERNEL_T) params->julia_x;
+  const KERNEL_T jy = (KERNEL_T) params->julia_y;
+
+  for (int32_t k = 0; k < n; k++) {
+    const KERNEL_T px = (KERNEL_T) cx[k];
+    const KERNEL_T py = (KERNEL_T) cy[k];
+    KERNEL_T x = julia ? px : 0;
+    KERNEL_T y = julia ? py : 0;
+
+    if (state) {
+      x = (KERNEL_T) state->zx[k];
+      y = (KERNEL_T) state->zy[k];
+    }
+
+    out[k] = julia
+      ? KERNEL_NAME(_kernel_point)(&x, &y, jx, jy, start, max, power)
+      : KERNEL_NAME(_kernel_point)(&x, &y, px, py, start, max, power);
+
+    if (state) {
+      state->zx[k] = (double) x;
+      state->zy[k] = (double) y;
+    }
+  }
+}
+
+
+// Lanes variant: KERNEL_LANES points iterate side by side with
+// the escape check as a mask instead of a branch. The loop over
+// lanes has no control flow, so it can go into SIMD registers and
+// at the very least overlaps the latency of independent points.
+// Escaped lanes keep their last z and stop counting, and the
+// batch ends when no lane is left inside.
+
+KERNEL_INLINE void KERNEL_NAME(_kernel_lanes)(
+    KERNEL_T * restrict x,
+    KERNEL_T * restrict y,
+    const KERNEL_T * restrict cx,
+    const KERNEL_T * restrict cy,
+    int32_t * restrict count,
+    const int32_t start,
+    const int32_t max,
+    const int32_t power
+  )
+{
+  for (int32_t i = start; i < max; i++)
+  {
+    int32_t active = 0;
+
+    for (int32_t l = 0; l < KERNEL_LANES; l++) {
+      const KERNEL_T x2 = x[l] * x[l];
+      const KERNEL_T y2 = y[l] * y[l];
+      const int32_t inside = (x2 + y2) <= 4;
+
+      KERNEL_T zx = x[l], zy = y[l];
+      KERNEL_NAME(_kernel_pow)(&zx, &zy, x2, y2, power);
+
+      x[l] = inside ? zx + cx[l] : x[l];
+      y[l] = inside ? zy + cy[l] : y[l];
+      count[l] += inside;
+      active |= inside;
+    }
+
+    if (!active) {
+      break;
+    }
+  }
+}
+
+KERNEL_INLINE void KERNEL_NAME(_kernel_solve_lanes)(
+    const kernel_params_t * params,
+    const double * cx,
+    const double * cy,
+    const int32_t n,
+    int32_t * out,
+    kernel_state_t * state,
+    const int32_t power,
+    const int32_t julia
+  )
+{
+  const int32_t max = params->iterations;
+  const int32_t start = state ? state->start : 0;
+  const KERNEL_T jx = (KERNEL_T) params->julia_x;
+  const KERNEL_T jy = (KERNEL_T) params->julia_y;
+
+  KERNEL_T x[KERNEL_LANES], y[KERNEL_LANES];
+  KERNEL_T c_x[KERNEL_LANES], c_y[KERNEL_LANES];
+  int32_t count[KERNEL_LANES];
+
+  for (int32_t k = 0; k < n; k += KERNEL_LANES) {
+    const int32_t m = n - k < KERNEL_LANES ? n - k : KERNEL_LANES;
+
+    // Pad a short last batch by repeating its first point
+    for (int32_t l = 0; l < KERNEL_LANES; l++) {
+      const int32_t j = k + (l < m ? l : 0);
+      const KERNEL_T px = (KERNEL_T) cx[j];
+      const KERNEL_T py = (KERNEL_T) cy[j];
+      x[l] = julia ? px : 0;
+      y[l] = julia ? py : 0;
+      c_x[l] = julia ? jx : px;
+      c_y[l] = julia ? jy : py;
+      count[l] = start;
+      if (state) {
+        x[l] = (KERNEL_T) state->zx[j];
+        y[l] = (KERNEL_T) state->zy[j];
+      }
+    }
+
+    KERNEL_NAME(_kernel_lanes)(x, y, c_x, c_y, count, start, max, power);
+
+    for (int32_t l = 0; l < m; l++) {
+      out[k + l] = count[l];
+    }
+
+    if (state) {
+      for (int32_t l = 0; l < m; l++) {
+        state->zx[k + l] = (double) x[l];
+        state->zy[k + l] = (double) y[l];
+      }
+    }
+  }
+}
+
+
+#undef KERNEL_NAME
+#undef KERNEL_NAME_
+#undef KERNEL_NAME__
@@ -1,6 +1,14 @@
+#include "autotune.h"
+#include "batch.h"
 #include "mandelbrot.h"
+#include "outputs.h"
+#include "points.h"
+#include "pyramid.h"
+#include "resize.h"
+#include "verify.h"
 
 #include <argp.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -15,10 +23,41 @@ enum parameter_keys {
   VERBOSE = 'v',
   SUPERSAMPLING = 's',
   PROGRESS = 'p',
+  GAMMA = 'g',
+  JULIA = 'j',
   XMIN_KEY = 0x00100000,
   XMAX_KEY = 0x00100001,
   YMIN_KEY = 0x00100002,
   YMAX_KEY = 0x00100003,
+  POWER_KEY = 0x00100004,
+  CX_KEY = 0x00100005,
+  CY_KEY = 0x00100006,
+  PRECISION_KEY = 0x00100007,
+  STATS_KEY = 0x00100008,
+  STATE_KEY = 0x00100009,
+  RESUME_KEY = 0x0010000a,
+  COLORING_KEY = 0x0010000b,
+  BUDDHABROT_KEY = 0x0010000c,
+  PROGRESS_FD_KEY = 0x0010000d,
+  PYRAMID_KEY = 0x0010000e,
+  BATCH_KEY = 0x0010000f,
+  RESULTS_KEY = 0x00100010,
+  INDEXED_KEY = 0x00100011,
+  PERF_KEY = 0x00100012,
+  TRACE_KEY = 0x00100013,
+  KERNEL_KEY = 0x00100014,
+  ROWS_KEY = 0x00100015,
+  AUTOTUNE_KEY = 0x00100016,
+  PROFILE_KEY = 0x00100017,
+  OUTPUT_KEY = 0x00100018,
+  VERIFY_KEY = 0x00100019,
+  TOLERANCE_KEY = 0x0010001a,
+  MAX_THREADS_KEY = 0x0010001b,
+  CONTROL_KEY = 0x0010001c,
+  FOLLOW_KEY = 0x0010001d,
+  POINTS_KEY = 0x0010001e,
+  POINTS_OUTPUT_KEY = 0x0010001f,
+  FINAL_Z_KEY = 0x00100020,
 };
 
 const char * argp_program_version = "mandelbrot v0.1";
@@ -27,14 +66,45 @@ static char args_doc [] = "IMAGE.png";
 
 static struct argp_option options [] = {
   {"width", WIDTH, "WIDTH", 0, "Set output image width in pixels [default: 300]", -1},
-  {"iterations", ITERATIONS, "N", 0, "Number of iterations per pixel [default: 100]", -1},
-  {"supersampling", SUPERSAMPLING, 0, 0, "Sample with a factor 2x2 [default: no]", -1},
-  {"threads", THREADS, "NTHREADS", 0, "Set number of threads [default: 1]", -1},
+  {"iterations", ITERATIONS, "N", 0, "Number of iterations per pixel, or auto [default: 100]", -1},
+  {"supersampling", SUPERSAMPLING, "N", OPTION_ARG_OPTIONAL, "Sample with a factor NxN [default: no, N = 2]", -1},
+  {"gamma", GAMMA, 0, 0, "Average supersamples in linear light", -1},
+  {"threads", THREADS, "NTHREADS", 0, "Set number of threads [default: profile, or 1]", -1},
+  {"max-threads", MAX_THREADS_KEY, "N", 0, "Let the pool grow to N threads on SIGUSR1 and shrink on SIGUSR2 [default: fixed]", -1},
+  {"control", CONTROL_KEY, "FILE", 0, "Resize the pool to N on a line \"threads N\" in FILE, or after R rows on \"threads N at R\"", -1},
+  {"follow", FOLLOW_KEY, "SOURCES", 0, "Resize the pool by the load average and cgroup CPU quota, load and/or cgroup", -1},
+  {"rows", ROWS_KEY, "N", 0, "Rows a thread takes at a time [default: profile, or 1]", -1},
   {"progress", PROGRESS, 0, 0, "Show progress [default: no]", -1},
+  {"progress-fd", PROGRESS_FD_KEY, "FD", 0, "Write progress as JSON lines to descriptor FD", -1},
   {"xmin", XMIN_KEY, "F", 0, "Minimum X [default: -2.5]", -1},
   {"xmax", XMAX_KEY, "F", 0, "Maximum X [default:  1.0]", -1},
   {"ymin", YMIN_KEY, "F", 0, "Minimum Y [default: -1.0]", -1},
   {"ymax", YMAX_KEY, "F", 0, "Maximum Y [default:  1.0]", -1},
+  {"power", POWER_KEY, "D", 0, "Iterate z^D + c with D from 2 to 8 [default: 2]", -1},
+  {"julia", JULIA, 0, 0, "Draw the Julia set for c = cx + cy*i [default: no]", -1},
+  {"cx", CX_KEY, "F", 0, "Real part of c for --julia [default: -0.8]", -1},
+  {"cy", CY_KEY, "F", 0, "Imaginary part of c for --julia [default: 0.156]", -1},
+  {"precision", PRECISION_KEY, "P", 0, "Use auto, float, double or long [default: auto]", -1},
+  {"kernel", KERNEL_KEY, "K", 0, "Use auto, scalar or lanes kernels [default: profile, or auto]", -1},
+  {"coloring", COLORING_KEY, "MODE", 0, "Color by bands or histogram [default: bands]", -1},
+  {"indexed", INDEXED_KEY, 0, 0, "Write a PNG with a palette of up to 256 colors", -1},
+  {"output", OUTPUT_KEY, "FILE[,OPTS]", 0, "Also write FILE from the same render, with OPTS scale=N, coloring=MODE and format=png|indexed|raw", -1},
+  {"buddhabrot", BUDDHABROT_KEY, "N", OPTION_ARG_OPTIONAL, "Draw orbit densities with N samples per pixel [default: no, N = 100]", -1},
+  {"pyramid", PYRAMID_KEY, "SIZE", OPTION_ARG_OPTIONAL, "Write a Deep Zoom pyramid of SIZE pixel tiles to IMAGE.dzi [default: no, SIZE = 256]", -1},
+  {"points", POINTS_KEY, "FILE", 0, "Solve the (cx, cy) pairs of doubles in FILE, or - for stdin, without IMAGE", -1},
+  {"points-output", POINTS_OUTPUT_KEY, "FILE", 0, "Write the iterations of every --points point to FILE [default: stdout]", -1},
+  {"final-z", FINAL_Z_KEY, 0, 0, "Write where the orbit of every --points point stopped as well", -1},
+  {"batch", BATCH_KEY, "JOBS", 0, "Render every job in the JSON lines file JOBS, without IMAGE", -1},
+  {"results", RESULTS_KEY, "FILE", 0, "Write the timings of every --batch job to FILE [default: stdout]", -1},
+  {"perf", PERF_KEY, 0, 0, "Report hardware counters of the render and image passes", -1},
+  {"autotune", AUTOTUNE_KEY, 0, 0, "Measure the fastest threads, rows and kernel here and save them, without IMAGE", -1},
+  {"profile", PROFILE_KEY, "FILE", 0, "Load and save --autotune settings in FILE [default: ~/.config/mandelbrot/HOST.profile]", -1},
+  {"verify", VERIFY_KEY, "N", OPTION_ARG_OPTIONAL, "Check N pixels, or all, against the reference loop, without IMAGE [default: no, N = 100000]", -1},
+  {"tolerance", TOLERANCE_KEY, "F", 0, "Fraction of pixels --verify lets differ [default: 0.001]", -1},
+  {"trace", TRACE_KEY, "FILE", 0, "Write a Chrome trace of the threads' rows, passes and writes to FILE", -1},
+  {"stats", STATS_KEY, "FILE", 0, "Write render statistics as JSON to FILE", -1},
+  {"state", STATE_KEY, "FILE", 0, "Checkpoint to FILE and continue from it, also with more iterations", -1},
+  {"resume", RESUME_KEY, 0, 0, "Same as --state=IMAGE.png.state", -1},
   {"verbose", VERBOSE, 0, 0, "Print program parameters on start", -1},
   { 0 },
 };
@@ -52,9 +122,13 @@ static error_t parse_opt(int32_t key, char * arg, struct argp_state * state) {
       break;
 
     case ITERATIONS:
+      if (strcmp(arg, "auto") == 0) {
+        args->iterations = ITERATIONS_AUTO;
+        break;
+      }
       args->iterations = atoi(arg);
       if (args->iterations < 1) {
-        critical("Provide an integer to --iterations higher or equal to 1\n");
+        critical("Provide auto or an integer to --iterations higher or equal to 1\n");
         argp_usage(state);
       }
       break;
@@ -68,7 +142,15 @@ static error_t parse_opt(int32_t key, char * arg, struct argp_state * state) {
       break;
 
     case SUPERSAMPLING:
-      args->supersampling = 1;
+      args->supersampling = arg == NULL ? 2 : atoi(arg);
+      if (args->supersampling < 1 || args->supersampling > 16) {
+        critical("Provide an integer to --supersampling between 1 and 16\n");
+        argp_usage(state);
+      }
+      break;
+
+    case GAMMA:
+      args->gamma = 1;
       break;
 
     case PROGRESS:
@@ -95,6 +177,184 @@ static error_t parse_opt(int32_t key, char * arg, struct argp_state * state) {
       args->y_max = strtod(arg, NULL);
       break;
 
+    case POWER_KEY:
+      args->power = atoi(arg);
+      if (args->power < KERNEL_MIN_POWER || args->power > KERNEL_MAX_POWER) {
+        critical("Provide an integer to --power between %d and %d\n",
+            KERNEL_MIN_POWER, KERNEL_MAX_POWER);
+        argp_usage(state);
+      }
+      break;
+
+    case JULIA:
+      args->julia = 1;
+      break;
+
+    case CX_KEY:
+      args->julia_x = strtod(arg, NULL);
+      break;
+
+    case CY_KEY:
+      args->julia_y = strtod(arg, NULL);
+      break;
+
+    case PRECISION_KEY:
+      args->precision = kernel_precision_parse(arg);
+      if (args->precision == KERNEL_PRECISION_INVALID) {
+        critical("Provide auto, float, double or long to --precision\n");
+        argp_usage(state);
+      }
+      break;
+
+    case STATS_KEY:
+      args->stats = arg;
+      break;
+
+    case STATE_KEY:
+      args->state = arg;
+      break;
+
+    case COLORING_KEY:
+      args->coloring = colorize_mode_parse(arg);
+      if (args->coloring == COLORIZE_INVALID) {
+        critical("Provide bands or histogram to --coloring\n");
+        argp_usage(state);
+      }
+      break;
+
+    case BUDDHABROT_KEY:
+      args->buddhabrot = arg ? atoi(arg) : 100;
+      if (args->buddhabrot < 1) {
+        critical("Provide a positive number of samples to --buddhabrot\n");
+        argp_usage(state);
+      }
+      break;
+
+    case RESUME_KEY:
+      args->resume = 1;
+      break;
+
+    case PERF_KEY:
+      args->perf = 1;
+      break;
+
+    case TRACE_KEY:
+      args->trace = arg;
+      break;
+
+    case KERNEL_KEY:
+      args->variant = kernel_variant_parse(arg);
+      if (args->variant == KERNEL_VARIANT_INVALID) {
+        critical("Provide auto, scalar or lanes to --kernel\n");
+        argp_usage(state);
+      }
+      break;
+
+    case MAX_THREADS_KEY:
+      args->max_threads = atoi(arg);
+      if (args->max_threads < 1) {
+        critical("Provide an integer to --max-threads higher or equal to 1\n");
+        argp_usage(state);
+      }
+      break;
+
+    case CONTROL_KEY:
+      args->control = arg;
+      break;
+
+    case FOLLOW_KEY:
+      args->follow = resize_follow_parse(arg);
+      if (args->follow == RESIZE_FOLLOW_INVALID) {
+        critical("Provide load, cgroup or load,cgroup to --follow\n");
+        argp_usage(state);
+      }
+      break;
+
+    case ROWS_KEY:
+      args->rows = atoi(arg);
+      if (args->rows < 1) {
+        critical("Provide an integer to --rows higher or equal to 1\n");
+        argp_usage(state);
+      }
+      break;
+
+    case AUTOTUNE_KEY:
+      args->autotune = 1;
+      break;
+
+    case VERIFY_KEY:
+      if (arg != NULL && strcmp(arg, "all") == 0) {
+        args->verify = VERIFY_ALL;
+        break;
+      }
+      args->verify = arg ? atoll(arg) : VERIFY_DEFAULT_SAMPLES;
+      if (args->verify < 1) {
+        critical("Provide all or a positive number of pixels to --verify\n");
+        argp_usage(state);
+      }
+      break;
+
+    case TOLERANCE_KEY:
+      args->tolerance = strtod(arg, NULL);
+      if (args->tolerance < 0 || args->tolerance > 1) {
+        critical("Provide a fraction from 0 to 1 to --tolerance\n");
+        argp_usage(state);
+      }
+      break;
+
+    case PROFILE_KEY:
+      args->profile = arg;
+      break;
+
+    case INDEXED_KEY:
+      args->indexed = 1;
+      break;
+
+    case OUTPUT_KEY:
+      if (args->n_outputs == MAX_OUTPUTS) {
+        critical("Provide at most %d --output\n", MAX_OUTPUTS);
+        argp_usage(state);
+      }
+      args->outputs[args->n_outputs++] = arg;
+      break;
+
+    case POINTS_KEY:
+      args->points = arg;
+      break;
+
+    case POINTS_OUTPUT_KEY:
+      args->points_output = arg;
+      break;
+
+    case FINAL_Z_KEY:
+      args->final_z = 1;
+      break;
+
+    case BATCH_KEY:
+      args->batch = arg;
+      break;
+
+    case RESULTS_KEY:
+      args->results = arg;
+      break;
+
+    case PYRAMID_KEY:
+      args->pyramid = arg ? atoi(arg) : PYRAMID_DEFAULT_TILE_SIZE;
+      if (args->pyramid < PYRAMID_MIN_TILE_SIZE || args->pyramid > PYRAMID_MAX_TILE_SIZE) {
+        critical("Provide a tile size from %d to %d to --pyramid\n",
+            PYRAMID_MIN_TILE_SIZE, PYRAMID_MAX_TILE_SIZE);
+        argp_usage(state);
+      }
+      break;
+
+    case PROGRESS_FD_KEY:
+      args->progress_fd = atoi(arg);
+      if (args->progress_fd < 0 || fcntl(args->progress_fd, F_GETFD) < 0) {
+        critical("Provide an open file descriptor to --progress-fd\n");
+        argp_usage(state);
+      }
+      break;
+
     case ARGP_KEY_ARG:
       if (state->arg_num >= 1) {
         // Provide exactly one output image filename
@@ -104,8 +364,13 @@ static error_t parse_opt(int32_t key, char * arg, struct argp_state * state) {
       break;
 
     case ARGP_KEY_END:
-      if (state->arg_num != 1) {
-        // Provide exactly one output image filename
+      if (args->n_outputs > 0 && state->arg_num == 0 && !args->batch && !args->autotune) {
+        // The --output files are enough
+        break;
+      }
+      if (state->arg_num != (args->batch || args->autotune || args->verify >= 0 || args->points ? 0 : 1)) {
+        // Provide exactly one output image filename, or none with
+        // --batch, --autotune, --verify, --points or --output
         argp_usage(state);
       }
       break;
@@ -122,41 +387,282 @@ int main(int argc, char ** argv) {
   // Default argument values
   args_t arguments;
   arguments.width = 300;
+  arguments.height = 0;
   arguments.iterations = 100;
-  arguments.threads = 1;
-  arguments.supersampling = 0;
+  arguments.threads = 0;
+  arguments.max_threads = 0;
+  arguments.follow = RESIZE_FOLLOW_NONE;
+  arguments.rows = 0;
+  arguments.supersampling = 1;
+  arguments.gamma = 0;
+  arguments.power = 2;
+  arguments.julia = 0;
+  arguments.precision = KERNEL_PRECISION_AUTO;
+  arguments.variant = KERNEL_VARIANT_INVALID;
   arguments.progress = 0;
+  arguments.progress_fd = -1;
+  arguments.coloring = COLORIZE_BANDS;
+  arguments.indexed = 0;
+  arguments.buddhabrot = 0;
+  arguments.pyramid = 0;
   arguments.verbose = 0;
+  arguments.perf = 0;
   arguments.x_min = -2.5;
   arguments.x_max = 1.0;
   arguments.y_min = -1.0;
   arguments.y_max = 1.0;
+  arguments.julia_x = -0.8;
+  arguments.julia_y = 0.156;
   arguments.filename = NULL;
+  arguments.stats = NULL;
+  arguments.state = NULL;
+  arguments.batch = NULL;
+  arguments.results = NULL;
+  arguments.trace = NULL;
+  arguments.profile = NULL;
+  arguments.control = NULL;
+  arguments.points = NULL;
+  arguments.points_output = NULL;
+  arguments.final_z = 0;
+  arguments.n_outputs = 0;
+  arguments.verify = -1;
+  arguments.tolerance = VERIFY_DEFAULT_TOLERANCE;
+  arguments.autotune = 0;
+  arguments.resume = 0;
 
   // Parse arguments
   static struct argp argp = { options, parse_opt, args_doc, doc, NULL, NULL, NULL };
   argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
+  // IMAGE and every --output, which take what they do not give
+  // from the command line
+  output_t outputs[MAX_OUTPUTS + 1];
+  int32_t n_outputs = 0;
+  if (arguments.n_outputs > 0) {
+    if (arguments.batch || arguments.pyramid || arguments.buddhabrot) {
+      critical("--output does not apply to --batch, --pyramid or --buddhabrot\n");
+      return 1;
+    }
+
+    if (arguments.filename != NULL) {
+      output_default(&arguments, arguments.filename, &outputs[n_outputs++]);
+    }
+
+    // Every output is downscaled by supersampling times its scale
+    const int32_t rows = arguments.height > 0 ? arguments.height : round(arguments.width
+        * (arguments.y_max - arguments.y_min) / (arguments.x_max - arguments.x_min));
+
+    for (int32_t i = 0; i < arguments.n_outputs; i++) {
+      const char * message = output_parse(arguments.outputs[i], &arguments, &outputs[n_outputs]);
+      const int32_t scale = outputs[n_outputs].scale;
+      if (message == NULL && arguments.supersampling * scale > DOWNSCALE_MAX_FACTOR) {
+        message = "scale times supersampling is above 64";
+      } else if (message == NULL && (scale > arguments.width || scale > rows)) {
+        message = "scale is above the size of the image";
+      }
+      if (message != NULL) {
+        critical("Invalid --output '%s': %s\n", arguments.outputs[i], message);
+        return 1;
+      }
+      n_outputs++;
+    }
+  }
+
+  // The state file goes next to the image unless given
+  char * state = NULL;
+  if (arguments.resume && arguments.state == NULL) {
+    const char * filename = n_outputs > 0 ? outputs[0].filename : arguments.filename;
+    const size_t length = strlen(filename) + 7;
+    state = mem_alloc(length);
+    snprintf(state, length, "%s.state", filename);
+    arguments.state = state;
+  }
+
+  // Threads, rows and kernel not given (0 and invalid until then)
+  // come from the profile of this host
+  char profile[AUTOTUNE_PATH_SIZE];
+  if (arguments.profile != NULL) {
+    snprintf(profile, sizeof(profile), "%s", arguments.profile);
+  } else if (autotune_profile_path(profile, sizeof(profile)) != 0) {
+    profile[0] = '\0';
+  }
+
+  autotune_profile_t tuned = { 1, 1, KERNEL_VARIANT_AUTO };
+  if (!arguments.autotune && profile[0] != '\0' && autotune_load(profile, &tuned) == 0) {
+    info("Loaded the settings in '%s'\n", profile);
+  }
+  arguments.threads = arguments.threads ? arguments.threads : tuned.threads;
+  arguments.rows = arguments.rows ? arguments.rows : tuned.rows;
+  arguments.variant = arguments.variant != KERNEL_VARIANT_INVALID ? arguments.variant : tuned.variant;
+
+  const double started = stats_now();
+
+  if (arguments.trace != NULL) {
+    trace_init();
+  }
+
+  // Worker pool shared by the render and post-processing passes,
+  // resized while it works if asked to
+  if (arguments.max_threads > 0 || arguments.control != NULL || arguments.follow != RESIZE_FOLLOW_NONE) {
+    resize_start(&arguments);
+  } else {
+    pool_init(arguments.threads);
+  }
+
+  if (arguments.perf) {
+    perf_init();
+  }
+
+  // Nothing to draw, only the profile to write
+  if (arguments.autotune) {
+    int32_t status = 1;
+    if (profile[0] == '\0') {
+      critical("There is no HOME to keep the profile in, provide --profile\n");
+    } else {
+      status = autotune_run(profile);
+    }
+
+    perf_report();
+    trace_write(arguments.trace);
+    mandelbrot_cleanup();
+    resize_stop();
+    pool_destroy();
+    mem_free(state);
+    return status;
+  }
+
+  // Points instead of a view, and records instead of an image
+  if (arguments.points != NULL) {
+    int32_t status = 1;
+    if (arguments.iterations == ITERATIONS_AUTO) {
+      critical("--iterations=auto does not apply to --points\n");
+    } else {
+      const char * output = arguments.points_output ? arguments.points_output : "-";
+      status = points_run(&arguments, arguments.points, output);
+    }
+
+    perf_report();
+    trace_write(arguments.trace);
+    mandelbrot_cleanup();
+    resize_stop();
+    pool_destroy();
+    mem_free(state);
+    return status;
+  }
+
+  // Nothing to write, only the render to check
+  if (arguments.verify >= 0) {
+    int32_t status = 1;
+    if (arguments.batch || arguments.pyramid || arguments.buddhabrot || arguments.n_outputs > 0) {
+      critical("--verify does not apply to --batch, --pyramid, --buddhabrot or --output\n");
+    } else {
+      status = verify_run(&arguments, arguments.verify, arguments.tolerance);
+    }
+
+    perf_report();
+    trace_write(arguments.trace);
+    mandelbrot_cleanup();
+    resize_stop();
+    pool_destroy();
+    mem_free(state);
+    return status;
+  }
+
+  // Every job writes its own image
+  if (arguments.batch != NULL) {
+    if (arguments.stats != NULL) {
+      error("--stats does not apply to --batch, see --results\n");
+    }
+
+    const int32_t status = batch_run(&arguments, arguments.batch, arguments.results);
+
+    perf_report();
+    trace_write(arguments.trace);
+    mandelbrot_cleanup();
+    resize_stop();
+    pool_destroy();
+    mem_free(state);
+    return status;
+  }
+
+  // Tiles are written as they are finished, there is no image
+  if (arguments.pyramid > 0) {
+    const int32_t status = pyramid_write(&arguments, arguments.filename);
+
+    stats.total_seconds = stats_now() - started;
+    if (status == 0 && arguments.stats != NULL) {
+      stats_write(arguments.stats);
+    }
+
+    perf_report();
+    trace_write(arguments.trace);
+    mandelbrot_cleanup();
+    resize_stop();
+    pool_destroy();
+    mem_free(state);
+    return status;
+  }
+
+  // One render, and every output made from it
+  if (n_outputs > 0) {
+    mandelbrot_init(&arguments);
+    const int32_t status = outputs_write(&arguments, outputs, n_outputs);
+
+    stats.total_seconds = stats_now() - started;
+    if (status == 0 && arguments.stats != NULL) {
+      stats_write(arguments.stats);
+    }
+
+    perf_report();
+    trace_write(arguments.trace);
+    mandelbrot_cleanup();
+    resize_stop();
+    pool_destroy();
+    mem_free(state);
+    return status;
+  }
+
   // Mandelbrot calculation
   mandelbrot_init(&arguments);
   image_t * img = mandelbrot_calculate();
 
-  // Scale down to half resolution (1/4 pixels if supersampling was enabled)
-  if (arguments.supersampling) {
-    image_t * old_img = img;
-    img = image_downscale(old_img);
-    image_destroy(old_img);
+  // Interrupted, with the progress saved
+  if (img == NULL) {
+    trace_write(arguments.trace);
+    mandelbrot_cleanup();
+    resize_stop();
+    pool_destroy();
+    mem_free(state);
+    return 1;
   }
 
-  // Convert to RGB
-  {
+  // Scale down by the supersampling factor (1/N^2 pixels) and
+  // convert to RGB
+  img = image_finish(img, arguments.supersampling, arguments.gamma);
+
+  // Averaged colors need a palette of their own
+  if (arguments.indexed && img->mode == IMAGE_MODE_RGB) {
     image_t * old_img = img;
-    img = image_hsv_to_rgb(old_img);
+    img = image_quantize(old_img);
     image_destroy(old_img);
   }
 
   // Write PNG
   image_write_png(img, arguments.filename);
 
+  image_destroy(img);
+
+  stats.total_seconds = stats_now() - started;
+  if (arguments.stats != NULL) {
+    stats_write(arguments.stats);
+  }
+
+  perf_report();
+  trace_write(arguments.trace);
+  mandelbrot_cleanup();
+  resize_stop();
+  pool_destroy();
+  mem_free(state);
+
   return 0;
 }
@@ -16,9 +16,22 @@ int32_t height;
 
 int32_t n_iterations;
 int32_t n_threads;
+int32_t rows_per_unit = 1;
+int32_t iterations_auto;
 
-int32_t supersampling = 0;
+int32_t supersampling = 1;
 int32_t show_progress;
+int32_t progress_fd = -1;
+int32_t coloring;
+int32_t indexed;
+int64_t buddhabrot_samples;
+
+const kernel_t * kernel;
+kernel_params_t kernel_params;
+
+viewport_t viewport;
+
+const char * state_filename;
 
 
 // Global state: Image and mutex
@@ -26,9 +39,168 @@ int32_t show_progress;
 image_t * img;
 int32_t img_next_row;
 
+// Rows handed back by workers that were parked when the pool
+// shrank, taken again before any new row
+int32_t * img_returned_rows;
+int32_t img_n_returned_rows;
+
+// Rows solved in this render, not counting mirrored ones
+int64_t img_n_rows_solved;
+void (*mandelbrot_row_hook)(const int64_t rows) = NULL;
+
+double * img_x_coordinates;
+
+// Rows a and b are mirror images across y = 0 when a + b equals
+// this sum. Set to -1 when the view has no usable symmetry.
+int32_t img_mirror_sum;
+
+// Previously computed field to copy samples from, and the column
+// and row in it for every pixel (or -1 where there is none)
+const cache_entry_t * img_reuse;
+int32_t * img_reuse_cols;
+int32_t * img_reuse_rows;
+
+// Rows that are finished, including mirrored ones
+uint8_t * img_rows_done;
+
+// Orbits of the pixels that reached the cap in the finished rows,
+// collected for the state file when there is one
+state_orbits_t img_orbits;
+
+// Set once the workers are done, and on SIGINT or SIGTERM while
+// rendering with a state file to stop after the current rows
+atomic_int img_finished;
+volatile sig_atomic_t img_interrupted;
+
+// Iteration histograms for histogram coloring. Every worker counts
+// into its own while solving, and the sum is kept with the field.
+uint64_t ** img_histograms;
+int32_t img_n_histograms;
+uint64_t * img_histogram;
+
+// Progress. Every worker adds the pixels and iterations of the
+// rows it finishes to its own counters, aligned to a cache line each,
+// and the progress thread sums them without taking the lock.
+typedef struct {
+  _Alignas(64) atomic_int_fast64_t pixels;
+  atomic_int_fast64_t iterations;
+} progress_counter_t;
+
+progress_counter_t * img_progress;
+int32_t img_n_workers;
+int64_t img_progress_preset;
+
 pthread_mutex_t lock;
 
 
+// Automatic iteration cap. A sparse grid over the view is solved
+// with doubling caps. Samples that escape keep their count, and each
+// round continues the orbits of the ones still inside from the z the
+// previous cap stopped them at. Long doubles would lose precision in
+// between and start over. The cap is the first one where doubling it
+// lets less than a small fraction of the samples escape in addition.
+
+#define AUTO_SAMPLES 64
+#define AUTO_CHUNK 64
+#define AUTO_MAX_ITERATIONS 65536
+#define AUTO_THRESHOLD 0.0025
+
+typedef struct {
+  const kernel_t * kernel;
+  kernel_params_t params;
+  double * cx;
+  double * cy;
+  double * zx;
+  double * zy;
+  int32_t * out;
+  int32_t n;
+  int32_t start;
+} auto_ctx_t;
+
+void _auto_chunk(void * ptr, const int32_t chunk, const int32_t thread)
+{
+  (void) thread;
+
+  const auto_ctx_t * ctx = ptr;
+  const int32_t k = chunk * AUTO_CHUNK;
+  const int32_t n = ctx->n - k < AUTO_CHUNK ? ctx->n - k : AUTO_CHUNK;
+
+  kernel_state_t state = { &ctx->zx[k], &ctx->zy[k], ctx->start };
+  ctx->kernel->solve(&ctx->params, &ctx->cx[k], &ctx->cy[k], n, &ctx->out[k],
+      ctx->kernel->precision <= KERNEL_PRECISION_DOUBLE ? &state : NULL);
+}
+
+int32_t auto_iterations(const kernel_t * k, const kernel_params_t * params)
+{
+  const int32_t sw = AUTO_SAMPLES;
+  const int32_t sh = fmax(1.0, round(AUTO_SAMPLES * y_range / x_range));
+  const int32_t total = sw * sh;
+  const viewport_t grid = { x_min, x_range, y_min, y_range, sw, sh };
+
+  auto_ctx_t ctx = {
+    .kernel = k,
+    .params = *params,
+    .cx = mem_alloc(sizeof(double) * total),
+    .cy = mem_alloc(sizeof(double) * total),
+    .zx = mem_alloc(sizeof(double) * total),
+    .zy = mem_alloc(sizeof(double) * total),
+    .out = mem_alloc(sizeof(int32_t) * total),
+    .n = total,
+    .start = 0,
+  };
+
+  for (int32_t py = 0; py < sh; py++) {
+    for (int32_t px = 0; px < sw; px++) {
+      ctx.cx[py * sw + px] = viewport_x(&grid, px);
+      ctx.cy[py * sw + px] = viewport_y(&grid, py);
+      ctx.zx[py * sw + px] = k->julia ? ctx.cx[py * sw + px] : 0;
+      ctx.zy[py * sw + px] = k->julia ? ctx.cy[py * sw + px] : 0;
+    }
+  }
+
+  int32_t cap = AUTO_MIN_ITERATIONS;
+  int32_t chosen = AUTO_MAX_ITERATIONS;
+  double previous = -1.0;
+
+  for (; cap <= AUTO_MAX_ITERATIONS; cap *= 2) {
+    ctx.params.iterations = cap;
+    perf_parallel_for("auto_iterations", "sample", AUTO_CHUNK, (ctx.n + AUTO_CHUNK - 1) / AUTO_CHUNK,
+        _auto_chunk, &ctx);
+
+    // Keep the samples that are still inside for the next round
+    int32_t remaining = 0;
+    for (int32_t i = 0; i < ctx.n; i++) {
+      if (ctx.out[i] >= cap) {
+        ctx.cx[remaining] = ctx.cx[i];
+        ctx.cy[remaining] = ctx.cy[i];
+        ctx.zx[remaining] = ctx.zx[i];
+        ctx.zy[remaining] = ctx.zy[i];
+        remaining++;
+      }
+    }
+    ctx.n = remaining;
+    ctx.start = cap;
+
+    const double escaped = (double) (total - remaining) / (double) total;
+    debug("auto iterations: cap = %d, escaped = %f\n", cap, escaped);
+
+    if (previous >= 0 && escaped - previous < AUTO_THRESHOLD) {
+      chosen = cap / 2;
+      break;
+    }
+    previous = escaped;
+  }
+
+  mem_free(ctx.cx);
+  mem_free(ctx.cy);
+  mem_free(ctx.zx);
+  mem_free(ctx.zy);
+  mem_free(ctx.out);
+
+  return chosen;
+}
+
+
 // Initiate the Mandelbrot calculation with viewport,
 // size, max iterations, number of threads, whether to
 // render i twice the geometric size and if we are to
@@ -45,23 +217,103 @@ void mandelbrot_init(const args_t * args)
   y_range = y_max - y_min;
 
   width = args->width;
-  height = round(
+  height = args->height > 0 ? args->height : round(
     ((double) width) * ((double) y_range / (double) x_range)
   );
 
   n_iterations = args->iterations;
   n_threads = args->threads;
-  supersampling = args->supersampling;
+  rows_per_unit = args->rows < 1 ? 1 : args->rows;
+  supersampling = args->supersampling < 1 ? 1 : args->supersampling;
 
   show_progress = args->progress;
+  progress_fd = args->progress_fd;
+  coloring = args->coloring;
+  indexed = args->indexed;
+  state_filename = args->state;
+
+  // Pick the cheapest precision that can tell the pixels apart
+  const double spacing = fmin(
+    x_range / (double) (width * supersampling),
+    y_range / (double) (height * supersampling)
+  );
+  const double magnitude = fmax(
+    fmax(fabs(x_min), fabs(x_max)),
+    fmax(fabs(y_min), fabs(y_max))
+  );
+
+  // Sample the view for an iteration cap first, since the
+  // precision depends on it. The sampling pass uses doubles, or
+  // long doubles if the view is deep enough to need them anyway.
+  iterations_auto = n_iterations == ITERATIONS_AUTO;
+  if (iterations_auto) {
+    const int32_t sampling_precision = args->precision != KERNEL_PRECISION_AUTO
+      ? args->precision
+      : kernel_precision_select(spacing, magnitude, AUTO_MIN_ITERATIONS);
+    const kernel_t * k = kernel_select(args->power, args->julia, sampling_precision, args->variant);
+    if (k == NULL) {
+      exit(1);
+    }
+    kernel_params_t params = { 0, args->julia_x, args->julia_y };
+    n_iterations = auto_iterations(k, &params);
+    info("Automatic iteration cap: %d\n", n_iterations);
+  }
+
+  int32_t precision = args->precision;
+  if (precision == KERNEL_PRECISION_AUTO) {
+    precision = kernel_precision_select(spacing, magnitude, n_iterations);
+  }
+  if (kernel_precision_exhausted(spacing, magnitude)) {
+    error("Pixel spacing %g is below what doubles can resolve around %g, "
+        "adjacent pixels will look the same\n", spacing, magnitude);
+  }
+
+  kernel = kernel_select(args->power, args->julia, precision, args->variant);
+  if (kernel == NULL) {
+    exit(1);
+  }
+
+  kernel_params.iterations = n_iterations;
+  kernel_params.julia_x = args->julia_x;
+  kernel_params.julia_y = args->julia_y;
+
+  // Orbits are traced in doubles, the view precision does not
+  // apply. Samples are given per output pixel.
+  buddhabrot_samples = 0;
+  if (args->buddhabrot > 0) {
+    if (args->julia) {
+      critical("--buddhabrot draws the Mandelbrot set and can not be combined with --julia\n");
+      exit(1);
+    }
+    if (state_filename) {
+      error("--state does not apply to --buddhabrot, ignoring it\n");
+      state_filename = NULL;
+    }
+    precision = KERNEL_PRECISION_DOUBLE;
+    kernel = kernel_select(args->power, 0, precision, args->variant);
+    buddhabrot_samples = (int64_t) args->buddhabrot * width * height;
+  }
 
   // Print arguments
   if (args->verbose) {
     printf("[mandelbrot_init] width = %dpx\n", width);
     printf("[mandelbrot_init] height = %dpx\n", height);
     printf("[mandelbrot_init] supersampling = %d\n", supersampling);
-    printf("[mandelbrot_init] iterations = %d\n", n_iterations);
+    printf("[mandelbrot_init] iterations = %d%s\n", n_iterations, iterations_auto ? " (auto)" : "");
     printf("[mandelbrot_init] threads = %d\n", n_threads);
+    printf("[mandelbrot_init] rows per work unit = %d\n", rows_per_unit);
+    printf("[mandelbrot_init] coloring = %s%s\n", colorize_mode_name(coloring),
+        indexed ? " (indexed)" : "");
+    if (buddhabrot_samples > 0) {
+      printf("[mandelbrot_init] buddhabrot = %ld samples\n", (long) buddhabrot_samples);
+    }
+    printf("[mandelbrot_init] precision = %s%s\n", kernel_precision_name(precision),
+        args->precision == KERNEL_PRECISION_AUTO ? " (auto)" : "");
+    printf("[mandelbrot_init] kernel = %s\n", kernel->name);
+    if (args->julia) {
+      printf("[mandelbrot_init] julia_x = %15.12f\n", args->julia_x);
+      printf("[mandelbrot_init] julia_y = %15.12f\n", args->julia_y);
+    }
     printf("[mandelbrot_init] x_min = %15.12f\n", x_min);
     printf("[mandelbrot_init] x_max = %15.12f\n", x_max);
     printf("[mandelbrot_init] y_min = %15.12f\n", y_min);
@@ -69,61 +321,501 @@ void mandelbrot_init(const args_t * args)
     printf("[mandelbrot_init] x_range = %15.12f\n", x_range);
     printf("[mandelbrot_init] y_range = %15.12f\n", y_range);
     printf("[mandelbrot_init] filename = %s\n", args->filename);
+    if (args->state) {
+      printf("[mandelbrot_init] state = %s\n", args->state);
+    }
+  }
+
+  width = width * supersampling;
+  height = height * supersampling;
+
+  stats.width = width / supersampling;
+  stats.height = height / supersampling;
+  stats.supersampling = supersampling;
+  stats.iterations = n_iterations;
+  stats.iterations_auto = iterations_auto;
+  stats.kernel = kernel->name;
+  stats.precision = kernel_precision_name(precision);
+
+  viewport.x_min = x_min;
+  viewport.x_range = x_range;
+  viewport.y_min = y_min;
+  viewport.y_range = y_range;
+  viewport.width = width;
+  viewport.height = height;
+}
+
+
+// Real-axis symmetry. z -> z^d + c commutes with complex
+// conjugation when c is real or is the pixel itself, so the rows
+// below the real axis are copies of the ones above it. Only used
+// when pixel centers line up exactly across y = 0.
+
+#define MIRROR_TOLERANCE 1e-6
+
+int32_t mirror_detect()
+{
+  if (kernel->julia && kernel_params.julia_y != 0.0) {
+    return -1;
+  }
+
+  const double h = (double) height;
+  const double sum = 2.0 * h - 1.0 + 2.0 * h * y_min / y_range;
+  const double rounded = round(sum);
+
+  if (fabs(sum - rounded) > MIRROR_TOLERANCE || rounded < 1 || rounded > 2 * height - 3) {
+    return -1;
   }
 
-  if (supersampling) {
-    width = width * 2;
-    height = height * 2;
+  return (int32_t) rounded;
+}
+
+int32_t mirror_row(const int32_t py)
+{
+  if (img_mirror_sum < 0) {
+    return -1;
   }
+
+  const int32_t mirror = img_mirror_sum - py;
+  return (mirror >= 0 && mirror < height && mirror != py) ? mirror : -1;
 }
 
 
-// Helper functions for threads to access the state
+double py_to_coordinate(const int32_t py);
+
+
+// Resuming from a state file. Only the pixels that reached the
+// old cap are iterated further, starting from the z they stopped
+// at, in chunks spread over the pool. Everything that escaped
+// before keeps its count.
+
+// Divides STATE_ORBIT_CHUNK, so a chunk of the resume is never split
+// over two chunks of orbits
+#define RESUME_CHUNK 1024
+
+typedef struct {
+  image_t * field;
+  state_orbits_t * orbits;
+  int32_t start;
+} resume_ctx_t;
 
-int32_t get_next_row()
+void _resume_chunk(void * ptr, const int32_t chunk, const int32_t thread)
 {
-  int32_t row = -1;
-  pthread_mutex_lock(&lock);
+  (void) thread;
+
+  const resume_ctx_t * ctx = ptr;
+  const int64_t first = (int64_t) chunk * RESUME_CHUNK;
+  const int32_t n = ctx->orbits->n - first < RESUME_CHUNK ? ctx->orbits->n - first : RESUME_CHUNK;
+  state_orbit_t * orbits = state_orbit(ctx->orbits, first);
+
+  double * cx = mem_alloc(sizeof(double) * n);
+  double * cy = mem_alloc(sizeof(double) * n);
+  double * zx = mem_alloc(sizeof(double) * n);
+  double * zy = mem_alloc(sizeof(double) * n);
+  int32_t * out = mem_alloc(sizeof(int32_t) * n);
+
+  for (int32_t k = 0; k < n; k++) {
+    const state_orbit_t * orbit = &orbits[k];
+    cx[k] = img_x_coordinates[orbit->index % width];
+    cy[k] = py_to_coordinate(orbit->index / width);
+    zx[k] = orbit->zx;
+    zy[k] = orbit->zy;
+  }
+
+  kernel_state_t state = { zx, zy, ctx->start };
+  kernel->solve(&kernel_params, cx, cy, n, out, &state);
+
+  for (int32_t k = 0; k < n; k++) {
+    state_orbit_t * orbit = &orbits[k];
+    const int32_t py = orbit->index / width;
+    const int32_t px = orbit->index % width;
+    const int32_t mirror = mirror_row(py);
 
-  if (img_next_row < height) {
-    row = img_next_row++;
+    orbit->zx = zx[k];
+    orbit->zy = zy[k];
+    ctx->field->pixels[orbit->index].i32 = out[k];
+    if (mirror >= 0) {
+      ctx->field->pixels[mirror * width + px].i32 = out[k];
+    }
   }
 
-  pthread_mutex_unlock(&lock);
-  return row;
+  mem_free(cx);
+  mem_free(cy);
+  mem_free(zx);
+  mem_free(zy);
+  mem_free(out);
 }
 
+void mandelbrot_resume(image_t * field, state_t * saved)
+{
+  state_orbits_t * orbits = &saved->orbits;
+  resume_ctx_t ctx = {
+    .field = field,
+    .orbits = orbits,
+    .start = saved->iterations,
+  };
+
+  pool_parallel_for((orbits->n + RESUME_CHUNK - 1) / RESUME_CHUNK, _resume_chunk, &ctx);
+
+  // Keep the orbits that reached the new cap as well. The render
+  // appends after them, into the chunks left over.
+  int64_t remaining = 0;
+  for (int64_t i = 0; i < orbits->n; i++) {
+    if (field->pixels[state_orbit(orbits, i)->index].i32 >= n_iterations) {
+      *state_orbit(orbits, remaining++) = *state_orbit(orbits, i);
+    }
+  }
+
+  if (saved->iterations < n_iterations) {
+    info("Resumed %ld pixels from %d to %d iterations\n",
+        (long) orbits->n, saved->iterations, n_iterations);
+  }
+
+  img_orbits = *orbits;
+  img_orbits.n = remaining;
+  memset(orbits, 0, sizeof(state_orbits_t));
+}
 
-int32_t get_progress()
+// Loads the state file, if it exists and the render can continue
+// from it. A state with a higher cap than asked for has lost the
+// orbits in between and is of no use.
+
+state_t * mandelbrot_state_load()
 {
-  int32_t row = 0;
+  state_t * saved = state_load(state_filename);
+  if (saved == NULL) {
+    return NULL;
+  }
+
+  if (!state_matches(saved, &viewport, kernel, &kernel_params)) {
+    info("State in '%s' is for another view, starting over\n", state_filename);
+  } else if (saved->iterations > n_iterations) {
+    info("State in '%s' has a higher cap (%d), starting over\n", state_filename, saved->iterations);
+  } else {
+    return saved;
+  }
+
+  state_destroy(saved);
+  return NULL;
+}
 
+// Saves the finished rows. Workers keep going while a checkpoint
+// is written, so the rows are copied first, along with the count of
+// orbits and the pointers to their chunks. Finished rows of the field
+// and orbits already appended are not touched again and are read in
+// place, and state_save() leaves the rest alone.
+
+void mandelbrot_state_save(const image_t * field)
+{
   pthread_mutex_lock(&lock);
 
-  row = img_next_row;
+  uint8_t * rows_done = mem_alloc(height);
+  memcpy(rows_done, img_rows_done, height);
+
+  state_orbits_t orbits = img_orbits;
+  orbits.chunks = mem_alloc(sizeof(state_orbit_t *) * (orbits.n_chunks + 1));
+  if (orbits.n_chunks > 0) {
+    memcpy(orbits.chunks, img_orbits.chunks, sizeof(state_orbit_t *) * orbits.n_chunks);
+  }
 
   pthread_mutex_unlock(&lock);
 
-  return row;
+  state_t saved = {
+    .view = viewport,
+    .power = kernel->power,
+    .julia = kernel->julia,
+    .julia_x = kernel_params.julia_x,
+    .julia_y = kernel_params.julia_y,
+    .iterations = n_iterations,
+    .field = (image_t *) field,
+    .rows_done = rows_done,
+    .orbits = orbits,
+  };
+
+  if (state_save(&saved, state_filename) == 0) {
+    debug("saved %ld orbits to %s\n", (long) orbits.n, state_filename);
+  }
+
+  mem_free(rows_done);
+  mem_free(orbits.chunks);
 }
 
 
+// Checkpoints. While rendering with a state file, the finished rows
+// are saved every so often. The interval grows with the time a save
+// takes, to keep the share of the render spent on checkpoints small.
+
+#define CHECKPOINT_MIN_INTERVAL 10.0
+#define CHECKPOINT_OVERHEAD 0.02
+
+void * mandelbrot_checkpoint_thread(void * ptr)
+{
+  (void) ptr;
+
+  struct timespec time;
+  time.tv_sec = 0;
+  time.tv_nsec = 100000000;
+
+  double interval = CHECKPOINT_MIN_INTERVAL;
+  double last = stats_now();
+
+  while (!atomic_load(&img_finished) && !img_interrupted)
+  {
+    nanosleep(&time, NULL);
+    if (stats_now() - last < interval) {
+      continue;
+    }
+
+    const double started = stats_now();
+    mandelbrot_state_save(img);
+    last = stats_now();
+
+    interval = fmax(CHECKPOINT_MIN_INTERVAL, (last - started) / CHECKPOINT_OVERHEAD);
+    debug("checkpoint took %.3fs, next in %.1fs\n", last - started, interval);
+  }
+
+  return NULL;
+}
+
+// First signal stops the render after the rows in progress and
+// saves them, a second one terminates right away
+
+void _interrupt_handler(const int sig)
+{
+  if (img_interrupted) {
+    signal(sig, SIG_DFL);
+    raise(sig);
+    return;
+  }
+  img_interrupted = 1;
+}
+
+
+// Histograms. Slots are indexed by worker, and by pool thread for
+// the rows that come finished from a state file. Both never run at
+// the same time. The slots are summed bin by bin across the pool,
+// so merging needs no locks either.
+
+#define HISTOGRAM_CHUNK 4096
+
+void histogram_begin()
+{
+  img_n_histograms = n_threads > pool_size() ? n_threads : pool_size();
+  img_histograms = mem_alloc(sizeof(uint64_t *) * img_n_histograms);
+  for (int32_t i = 0; i < img_n_histograms; i++) {
+    img_histograms[i] = mem_alloc(sizeof(uint64_t) * (n_iterations + 1));
+  }
+}
+
+void _histogram_count_row(void * ptr, const int32_t py, const int32_t thread)
+{
+  (void) ptr;
+
+  if (!img_rows_done[py]) {
+    return;
+  }
+
+  uint64_t * histogram = img_histograms[thread];
+  const union pixel * row = &img->pixels[py * width];
+  for (int32_t px = 0; px < width; px++) {
+    histogram[row[px].i32]++;
+  }
+}
+
+void _histogram_merge(void * ptr, const int32_t chunk, const int32_t thread)
+{
+  (void) ptr;
+  (void) thread;
+
+  const int32_t first = chunk * HISTOGRAM_CHUNK;
+  const int32_t last = first + HISTOGRAM_CHUNK < n_iterations + 1
+    ? first + HISTOGRAM_CHUNK
+    : n_iterations + 1;
+
+  for (int32_t h = 0; h < img_n_histograms; h++) {
+    const uint64_t * histogram = img_histograms[h];
+    for (int32_t i = first; i < last; i++) {
+      img_histogram[i] += histogram[i];
+    }
+  }
+}
+
+void histogram_end()
+{
+  img_histogram = mem_alloc(sizeof(uint64_t) * (n_iterations + 1));
+  pool_parallel_for((n_iterations + HISTOGRAM_CHUNK) / HISTOGRAM_CHUNK, _histogram_merge, NULL);
+
+  for (int32_t i = 0; i < img_n_histograms; i++) {
+    mem_free(img_histograms[i]);
+  }
+  mem_free(img_histograms);
+  img_histograms = NULL;
+  img_n_histograms = 0;
+}
+
+// The histogram of a finished field, counted now if the render did
+// not count it for histogram coloring
+
+const uint64_t * mandelbrot_histogram(const image_t * field)
+{
+  if (img_histogram != NULL) {
+    return img_histogram;
+  }
+
+  img = (image_t *) field;
+  img_rows_done = mem_alloc(height);
+  memset(img_rows_done, 1, height);
+
+  histogram_begin();
+  pool_parallel_for(height, _histogram_count_row, NULL);
+  histogram_end();
+
+  mem_free(img_rows_done);
+  img_rows_done = NULL;
+  img = NULL;
+
+  return img_histogram;
+}
+
+
+// Helper functions for threads to access the state
+
+// Rows a worker has taken and not started yet. Workers take
+// rows_per_unit rows at a time, so the lock is taken once for each
+// unit instead of for every row.
+
+typedef struct {
+  int32_t * rows;
+  int32_t n;
+  int32_t next;
+} work_unit_t;
+
+int32_t get_next_row(work_unit_t * unit)
+{
+  if (unit->next == unit->n) {
+    unit->n = 0;
+    unit->next = 0;
+    pthread_mutex_lock(&lock);
+
+    while (unit->n < rows_per_unit && img_n_returned_rows > 0 && !img_interrupted) {
+      unit->rows[unit->n++] = img_returned_rows[--img_n_returned_rows];
+    }
+
+    // Skip rows that are finished or are filled in as the mirror
+    // of an earlier row
+    while (unit->n < rows_per_unit && img_next_row < height && !img_interrupted) {
+      const int32_t row = img_next_row++;
+      if (!img_rows_done[row] && (mirror_row(row) < 0 || mirror_row(row) > row)) {
+        unit->rows[unit->n++] = row;
+      }
+    }
+
+    pthread_mutex_unlock(&lock);
+  }
+
+  return unit->next < unit->n ? unit->rows[unit->next++] : -1;
+}
+
+// Hands the rows of a unit that were not started back to the
+// other workers. Every row is either in one unit or in the
+// returned rows, so none is lost or solved twice.
+
+void return_rows(work_unit_t * unit)
+{
+  if (unit->next == unit->n) {
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  while (unit->next < unit->n) {
+    img_returned_rows[img_n_returned_rows++] = unit->rows[--unit->n];
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+
+// Functions for processing each pixel.
+// (i.e. point in the complex plane)
+
+double px_to_coordinate(const int32_t px);
+double py_to_coordinate(const int32_t py);
+int32_t m_solve(const double cx, const double cy);
+void m_solve_row(
+    const viewport_t * view,
+    const kernel_t * k,
+    const kernel_params_t * params,
+    const double * x_coordinates,
+    const int32_t py,
+    int32_t * row,
+    double * cy
+  );
+
+
 // Thread functions (implemented below)
 
-void * mandelbrot_thread(void * ptr);
+// What a worker reads about the render, and the row loop compiled
+// for its options
+typedef struct {
+  const kernel_t * kernel;
+  kernel_params_t params;
+  viewport_t view;
+  const double * x_coordinates;
+  image_t * field;
+  const cache_entry_t * reuse;
+  const int32_t * reuse_cols;
+  const int32_t * reuse_rows;
+} worker_view_t;
+
+typedef void (*worker_fn_t)(const worker_view_t v, const int32_t id);
+
+typedef struct {
+  worker_fn_t run;
+  worker_view_t view;
+} worker_ctx_t;
+
+worker_fn_t worker_select(const int32_t histogram, const int32_t orbits, const int32_t reuse,
+    const int32_t interior);
+int32_t worker_interior_applies(const kernel_t * k, const viewport_t * v, const int32_t orbits);
+
+void mandelbrot_worker(void * ptr, const int32_t item, const int32_t id);
 void * mandelbrot_progress_thread(void * ptr);
+void * mandelbrot_prefetch_thread(void * ptr);
+
+void prefetch_stop();
+
 
+// The public methods for starting a Mandelbrot render. The field
+// of iteration counts returned by mandelbrot_calculate_iterations()
+// belongs to the engine and stays valid until the next render.
+// Both return NULL when a render with a state file is interrupted.
 
-// The public method for starting a Mandelbrot render
+image_t * mandelbrot_calculate_buddhabrot();
+
+// Colors straight to palette indices when every output pixel is
+// one sample, otherwise to HSV for averaging
+
+image_t * mandelbrot_colorize(const image_t * field)
+{
+  return indexed && supersampling == 1 ? image_index(field) : image_colorize(field);
+}
 
 image_t * mandelbrot_calculate()
 {
-  // Create a new image
-  image_t * working_image = image_new(width, height, IMAGE_MODE_HSV);
-  img = working_image;
+  if (buddhabrot_samples > 0) {
+    return mandelbrot_calculate_buddhabrot();
+  }
+
+  const image_t * field = mandelbrot_calculate_iterations();
+  if (field == NULL) {
+    return NULL;
+  }
 
   // Initialize colorizing
-  colorize_init(n_iterations);
+  if (coloring == COLORIZE_HISTOGRAM) {
+    colorize_init_histogram(n_iterations, img_histogram);
+  } else {
+    colorize_init(n_iterations);
+  }
 
   #ifdef DEBUG
   for (int i = 0; i <= n_iterations; i += 16) {
@@ -132,119 +824,791 @@ image_t * mandelbrot_calculate()
   }
   #endif
 
+  return mandelbrot_colorize(field);
+}
+
+const image_t * mandelbrot_calculate_iterations()
+{
+  // Background work on neighbouring views would compete with us
+  prefetch_stop();
+
+  const double started = stats_now();
+  const int64_t begin = trace_begin();
+
+  // The real part of every column is the same for all rows
+  img_x_coordinates = mem_alloc(sizeof(double) * width);
+  for (int32_t px = 0; px < width; px++) {
+    img_x_coordinates[px] = px_to_coordinate(px);
+  }
+
+  img_next_row = 0;
+  img_returned_rows = mem_alloc(sizeof(int32_t) * height);
+  img_n_returned_rows = 0;
+  img_n_rows_solved = 0;
+  img_mirror_sum = mirror_detect();
+  debug("mirror sum = %d\n", img_mirror_sum);
+
+  img_rows_done = mem_alloc(height);
+  memset(&img_orbits, 0, sizeof(state_orbits_t));
+
+  atomic_store(&img_finished, 0);
+  img_interrupted = 0;
+
   // Init lock
   if (pthread_mutex_init(&lock, NULL) != 0) {
     critical("Failed to initialize mutex\n");
     exit(1);
   }
 
-  // Create threads
+  // Stop cleanly and keep what is done when interrupted
+  struct sigaction interrupt, old_int, old_term;
+  if (state_filename) {
+    memset(&interrupt, 0, sizeof(interrupt));
+    interrupt.sa_handler = _interrupt_handler;
+    sigemptyset(&interrupt.sa_mask);
+    sigaction(SIGINT, &interrupt, &old_int);
+    sigaction(SIGTERM, &interrupt, &old_term);
+  }
+
+  state_t * saved = state_filename ? mandelbrot_state_load() : NULL;
+  const int32_t saved_rows = saved != NULL;
+  image_t * field;
+
+  // A finished render at the same cap goes straight to coloring,
+  // and its state file is left as it is
+  const int32_t complete = saved != NULL && saved->iterations == n_iterations && state_complete(saved);
+  if (complete) {
+    info("State in '%s' is complete\n", state_filename);
+  }
+
+  if (saved != NULL) {
+    // Continue the pixels that were still inside at the old cap,
+    // and then the rows that were not finished
+    field = saved->field;
+    saved->field = NULL;
+    mem_free(img_rows_done);
+    img_rows_done = saved->rows_done;
+    saved->rows_done = NULL;
+    if (!complete) {
+      mandelbrot_resume(field, saved);
+    }
+    state_destroy(saved);
+  } else {
+    // Create a new field of iteration counts
+    field = image_new(width, height, IMAGE_MODE_ITERATIONS);
+  }
+  img = field;
+
+  // Rows loaded from the state count as finished from the start
+  img_n_workers = pool_size();
+  img_progress = aligned_alloc(_Alignof(progress_counter_t), sizeof(progress_counter_t) * img_n_workers);
+  if (img_progress == NULL) {
+    critical("failed to allocate the progress counters\n");
+    exit(1);
+  }
+  memset(img_progress, 0, sizeof(progress_counter_t) * img_n_workers);
+  img_progress_preset = 0;
+  for (int32_t py = 0; py < height; py++) {
+    img_progress_preset += img_rows_done[py] ? width : 0;
+  }
+  if (saved_rows && !complete) {
+    info("Resuming '%s' with %" PRId64 " of %" PRId64 " pixels done\n",
+        state_filename, img_progress_preset, (int64_t) width * height);
+  }
+
+  // Count what is already finished, the workers count the rest
+  mem_free(img_histogram);
+  img_histogram = NULL;
+  if (coloring == COLORIZE_HISTOGRAM) {
+    histogram_begin();
+    if (saved_rows) {
+      pool_parallel_for(height, _histogram_count_row, NULL);
+    }
+  }
+
+  // Samples shared with the last render or a prefetched view.
+  // Those come without orbits, so not when collecting them.
+  img_reuse_cols = mem_alloc(sizeof(int32_t) * width);
+  img_reuse_rows = mem_alloc(sizeof(int32_t) * height);
+  img_reuse = state_filename ? NULL
+    : cache_lookup(&viewport, kernel, &kernel_params, img_reuse_cols, img_reuse_rows);
+
+  // Progress and checkpoints run next to the workers, which are
+  // the threads of the pool
   pthread_t progress;
-  pthread_t workers[n_threads];
-  int32_t worker_ids[n_threads];
+  pthread_t checkpoint;
 
-  if (show_progress) {
+  if (show_progress || progress_fd >= 0) {
     pthread_create(&progress, NULL, mandelbrot_progress_thread, NULL);
   }
 
-  for (int32_t i = 0; i < n_threads; i++) {
-    worker_ids[i] = i;
-    pthread_create(&(workers[i]), NULL, mandelbrot_thread, NULL);
+  if (state_filename && !complete) {
+    pthread_create(&checkpoint, NULL, mandelbrot_checkpoint_thread, NULL);
   }
 
-  for (int32_t i = 0; i < n_threads; i++) {
-    pthread_join(workers[i], NULL);
+  // The row loop for these options, picked once for the render
+  const int32_t interior = worker_interior_applies(kernel, &viewport, state_filename != NULL);
+  worker_ctx_t workers = {
+    worker_select(img_histograms != NULL, state_filename != NULL, img_reuse != NULL, interior),
+    { kernel, kernel_params, viewport, img_x_coordinates, field,
+      img_reuse, img_reuse_cols, img_reuse_rows },
+  };
+
+  // One row loop for every thread of the pool, parked or not, so
+  // threads let in halfway through still find one to take
+  if (!complete) {
+    perf_parallel_for(kernel->name, "iteration", 0, img_n_workers, mandelbrot_worker, &workers);
   }
 
-  if (show_progress) {
+  // Rows handed back once every other row loop had run out of rows
+  // are solved here, as thread 0, which is never parked
+  if (img_n_returned_rows > 0 && !img_interrupted) {
+    mandelbrot_worker(&workers, 0, 0);
+  }
+
+  for (int32_t i = 0; i < img_n_workers && perf_enabled(); i++) {
+    perf_units(kernel->name, i, atomic_load(&img_progress[i].iterations));
+  }
+
+  atomic_store(&img_finished, 1);
+
+  if (show_progress || progress_fd >= 0) {
     pthread_join(progress, NULL);
   }
 
+  if (img_histograms != NULL) {
+    histogram_end();
+  }
+
+  if (state_filename) {
+    if (!complete) {
+      pthread_join(checkpoint, NULL);
+      mandelbrot_state_save(field);
+    }
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+  }
+
   pthread_mutex_destroy(&lock);
   img = NULL;
 
-  return working_image;
+  mem_free(img_reuse_cols);
+  mem_free(img_reuse_rows);
+  img_reuse = NULL;
+
+  mem_free(img_x_coordinates);
+  img_x_coordinates = NULL;
+
+  mem_free(img_rows_done);
+  img_rows_done = NULL;
+
+  mem_free(img_returned_rows);
+  img_returned_rows = NULL;
+
+  mem_free(img_progress);
+  img_progress = NULL;
+
+  state_orbits_free(&img_orbits);
+
+  if (img_interrupted) {
+    info("Interrupted, finished rows are saved to '%s'\n", state_filename);
+    image_destroy(field);
+    return NULL;
+  }
+
+  // Keep the field around for the next render to reuse
+  cache_store(&viewport, kernel, &kernel_params, field, 0);
+
+  stats.render_seconds = stats_now() - started;
+  trace_end("render", "phase", begin, -1);
+
+  return field;
+}
+
+
+// Buddhabrot rendering. The densities go through the same colorize
+// path as iteration counts, as levels from 0 up to BUDDHA_LEVELS.
+
+image_t * mandelbrot_calculate_buddhabrot()
+{
+  prefetch_stop();
+
+  const double started = stats_now();
+
+  image_t * field = buddha_render(&viewport, kernel, &kernel_params, buddhabrot_samples);
+
+  const double seconds = stats_now() - started;
+  stats.samples = buddhabrot_samples;
+  stats.samples_per_second = (double) buddhabrot_samples / seconds;
+  info("Buddhabrot: %ld samples in %.2fs (%.0f samples/s)\n",
+      (long) buddhabrot_samples, seconds, stats.samples_per_second);
+
+  mem_free(img_histogram);
+  img_histogram = mem_alloc(sizeof(uint64_t) * (BUDDHA_LEVELS + 1));
+  buddha_levels(field, BUDDHA_LEVELS, img_histogram);
+
+  if (coloring == COLORIZE_HISTOGRAM) {
+    colorize_init_histogram(BUDDHA_LEVELS, img_histogram);
+  } else {
+    colorize_init(BUDDHA_LEVELS);
+  }
+
+  image_t * out = mandelbrot_colorize(field);
+  image_destroy(field);
+
+  stats.render_seconds = stats_now() - started;
+
+  return out;
+}
+
+
+// Release everything kept between renders
+
+void mandelbrot_cleanup()
+{
+  prefetch_stop();
+  cache_clear();
+
+  mem_free(img_histogram);
+  img_histogram = NULL;
+}
+
+
+// Background prefetching. While the engine is idle, neighbouring
+// views are computed one at a time into the cache: half a view in
+// each direction and a zoom in and out by two around the center.
+// Each copies the samples it shares with a cached view and solves
+// the rest. The next render stops the prefetch first and picks up
+// whatever was finished.
+
+#define PREFETCH_VIEWS 6
+
+typedef struct {
+  viewport_t views[PREFETCH_VIEWS];
+  const kernel_t * kernel;
+  kernel_params_t params;
+} prefetch_t;
+
+pthread_t prefetch_thread;
+bool prefetch_running = false;
+atomic_int prefetch_cancel;
+
+void mandelbrot_prefetch()
+{
+  prefetch_stop();
+
+  prefetch_t * job = mem_alloc(sizeof(prefetch_t));
+  job->kernel = kernel;
+  job->params = kernel_params;
+
+  const viewport_t v = viewport;
+  const double dx = v.x_range / v.width;
+  const double dy = v.y_range / v.height;
+
+  for (int32_t i = 0; i < PREFETCH_VIEWS; i++) {
+    job->views[i] = v;
+  }
+
+  // Pans by whole pixels, so they line up with the current view
+  job->views[0].x_min = v.x_min - (v.width / 2) * dx;
+  job->views[1].x_min = v.x_min + (v.width / 2) * dx;
+  job->views[2].y_min = v.y_min - (v.height / 2) * dy;
+  job->views[3].y_min = v.y_min + (v.height / 2) * dy;
+
+  // Zoom in and out around the center, on the grid of the current
+  // view, so they copy the samples they share with it
+  job->views[4] = viewport_zoom_in(&v, 2);
+  job->views[5] = viewport_zoom_out(&v, 2);
+
+  atomic_store(&prefetch_cancel, 0);
+  if (pthread_create(&prefetch_thread, NULL, mandelbrot_prefetch_thread, job) != 0) {
+    error("Failed to start prefetch thread\n");
+    mem_free(job);
+    return;
+  }
+  prefetch_running = true;
+}
+
+void prefetch_stop()
+{
+  if (!prefetch_running) {
+    return;
+  }
+
+  atomic_store(&prefetch_cancel, 1);
+  pthread_join(prefetch_thread, NULL);
+  prefetch_running = false;
+}
+
+void * mandelbrot_prefetch_thread(void * ptr)
+{
+  prefetch_t * job = ptr;
+
+  for (int32_t i = 0; i < PREFETCH_VIEWS; i++) {
+    const viewport_t * view = &job->views[i];
+    if (cache_contains(view, job->kernel, &job->params)) {
+      continue;
+    }
+
+    const int32_t w = view->width;
+    image_t * field = image_new(w, view->height, IMAGE_MODE_ITERATIONS);
+    double * x_coordinates = mem_alloc(sizeof(double) * w);
+    double * cx = mem_alloc(sizeof(double) * w);
+    double * cy = mem_alloc(sizeof(double) * w);
+    int32_t * pixels = mem_alloc(sizeof(int32_t) * w);
+    int32_t * iterations = mem_alloc(sizeof(int32_t) * w);
+    int32_t * cols = mem_alloc(sizeof(int32_t) * w);
+    int32_t * rows = mem_alloc(sizeof(int32_t) * view->height);
+
+    for (int32_t px = 0; px < w; px++) {
+      x_coordinates[px] = viewport_x(view, px);
+    }
+
+    // Samples shared with a cached view, which only the prefetch
+    // stores to or evicts from while it runs
+    const cache_entry_t * reuse = cache_lookup(view, job->kernel, &job->params, cols, rows);
+
+    int32_t py;
+    for (py = 0; py < view->height && !atomic_load(&prefetch_cancel); py++) {
+      int32_t * row = (int32_t *) &field->pixels[py * w];
+      if (reuse == NULL || rows[py] < 0) {
+        m_solve_row(view, job->kernel, &job->params, x_coordinates, py, row, cy);
+        continue;
+      }
+
+      const union pixel * old_row = &reuse->field->pixels[rows[py] * reuse->field->width];
+      const double y = viewport_y(view, py);
+      int32_t n = 0;
+
+      for (int32_t px = 0; px < w; px++) {
+        if (cols[px] >= 0) {
+          row[px] = old_row[cols[px]].i32;
+        } else {
+          cx[n] = x_coordinates[px];
+          cy[n] = y;
+          pixels[n++] = px;
+        }
+      }
+
+      job->kernel->solve(&job->params, cx, cy, n, iterations, NULL);
+      for (int32_t k = 0; k < n; k++) {
+        row[pixels[k]] = iterations[k];
+      }
+    }
+
+    mem_free(x_coordinates);
+    mem_free(cx);
+    mem_free(cy);
+    mem_free(pixels);
+    mem_free(iterations);
+    mem_free(cols);
+    mem_free(rows);
+
+    if (py < view->height) {
+      image_destroy(field);
+      break;
+    }
+
+    cache_store(view, job->kernel, &job->params, field, 1);
+    debug("prefetched view %d\n", i);
+  }
+
+  mem_free(job);
+  return NULL;
+}
+
+
+// The progress thread. Updates the terminal every 0.1s when asked
+// to, and writes a JSON line to the progress descriptor every second
+// and once more at the end.
+
+#define PROGRESS_INTERVAL 1.0
+
+typedef struct {
+  int64_t pixels;
+  int64_t iterations;
+} progress_t;
+
+static progress_t _progress_read()
+{
+  progress_t p = { img_progress_preset, 0 };
+
+  for (int32_t i = 0; i < img_n_workers; i++) {
+    p.pixels += atomic_load_explicit(&img_progress[i].pixels, memory_order_relaxed);
+    p.iterations += atomic_load_explicit(&img_progress[i].iterations, memory_order_relaxed);
+  }
+
+  return p;
+}
+
+static void _progress_bar(const progress_t * p, const int64_t total)
+{
+  const char a = '.';
+  const char b = '#';
+
+  const int32_t percentage = (p->pixels * 100) / total;
+  const int32_t progress = round(((double) percentage) / 4.0);
+
+  printf("\r");
+  for (int i = 0; i < 25; i++) {
+    printf("%c", i <= progress ? b : a);
+  }
+  printf(" %3d %% complete ", percentage);
+  fflush(stdout);
 }
 
+// Returns 0 once the descriptor can not be written to any more
+static int32_t _progress_json(
+    const char * event,
+    const progress_t * p,
+    const int64_t total,
+    const double elapsed
+  )
+{
+  // Rates only count what was solved in this run
+  const int64_t solved = p->pixels - img_progress_preset;
+  const double pixel_rate = elapsed > 0 ? solved / elapsed : 0;
+  const double iteration_rate = elapsed > 0 ? p->iterations / elapsed : 0;
+
+  char eta[32] = "null";
+  if (pixel_rate > 0) {
+    snprintf(eta, sizeof(eta), "%.3f", (total - p->pixels) / pixel_rate);
+  }
 
-// The progress thread.
-// Sleeping and updating terminal every 0.1s.
+  char line[512];
+  const int length = snprintf(line, sizeof(line),
+      "{\"event\": \"%s\", \"pixels\": %" PRId64 ", \"total\": %" PRId64 ", "
+      "\"fraction\": %.6f, \"iterations\": %" PRId64 ", \"elapsed\": %.3f, "
+      "\"pixels_per_second\": %.1f, \"iterations_per_second\": %.1f, \"eta\": %s}\n",
+      event, p->pixels, total, (double) p->pixels / total, p->iterations, elapsed,
+      pixel_rate, iteration_rate, eta);
+
+  for (int written = 0; written < length; ) {
+    const ssize_t n = write(progress_fd, line + written, length - written);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      error("Failed to write progress to descriptor %d, stopping\n", progress_fd);
+      return 0;
+    }
+    written += n;
+  }
 
-void * mandelbrot_progress_thread()
+  return 1;
+}
+
+void * mandelbrot_progress_thread(void * ptr)
 {
+  (void) ptr;
+
   struct timespec time;
   time.tv_sec = 0;
   time.tv_nsec = 100000000;
 
-  char a = '.';
-  char b = '#';
+  const int64_t total = (int64_t) width * height;
+  const double started = stats_now();
+  double last = started;
+  int32_t stream = progress_fd >= 0;
 
-  int32_t row = 0;
-  int32_t percentage = 0;
-  int32_t progress = 0;
+  // A reader that went away is an error for write() here instead of
+  // a SIGPIPE that ends the render. The signal goes to the thread
+  // that writes, so the others keep the default.
+  sigset_t pipe;
+  sigemptyset(&pipe);
+  sigaddset(&pipe, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &pipe, NULL);
 
-  printf("\n");
-  for (int i = 0; i < 25; i++) {
-    printf("%c", a);
+  if (show_progress) {
+    printf("\n");
+    for (int i = 0; i < 25; i++) {
+      printf("%c", '.');
+    }
   }
 
-  while (percentage < 100)
+  while (!atomic_load(&img_finished) && !img_interrupted)
   {
-    row = get_progress();
-    percentage = round((double) row * 100.0) / ((double) height);
-    progress = round(((double) percentage) / 4.0);
+    const progress_t p = _progress_read();
 
-    printf("\r");
-    for (int i = 0; i < 25; i++) {
-      printf("%c", i <= progress ? b : a);
+    if (show_progress) {
+      _progress_bar(&p, total);
     }
-    printf(" %3d %% complete ", percentage);
 
-    if (percentage == 100) {
-      printf("\n\n");
+    const double now = stats_now();
+    if (stream && now - last >= PROGRESS_INTERVAL) {
+      stream = _progress_json("progress", &p, total, now - started);
+      last = now;
     }
 
-    fflush(stdout);
-
     nanosleep(&time, NULL);
   }
 
-  return NULL;
-}
+  const progress_t p = _progress_read();
 
+  if (show_progress) {
+    _progress_bar(&p, total);
+    printf("\n\n");
+  }
 
-// Functions for processing each pixel.
-// (i.e. point in the complex plane)
+  if (stream) {
+    _progress_json(img_interrupted ? "interrupted" : "done", &p, total, stats_now() - started);
+  }
+
+  return NULL;
+}
 
-double px_to_coordinate(const int32_t px);
-double py_to_coordinate(const int32_t py);
-int32_t m_solve(const double cx, const double cy);
-int32_t m_process_pixel(const int32_t px, const int32_t py);
 
+// A worker, one on every pool thread. Solves a full row at a time
+// with the selected kernel, taking whatever it can from a cached
+// field, until there are no rows left.
+//
+// The row loop is compiled once for every combination of the
+// options below, like the kernels, and mandelbrot_worker() runs the
+// one that fits the render. Each is the same inlined loop with the
+// options as constants, so the checks for options that are off are
+// gone from it rather than tested for every row and pixel:
+//
+//   HISTOGRAM  count iterations for histogram coloring
+//   ORBITS     keep the orbits that reach the cap, for a state file
+//   REUSE      copy samples from a cached field
+//   INTERIOR   skip the points in the main cardioid and the
+//              period-2 bulb, which never escape (z^2 + c only)
+//
+// Everything the loop reads about the render is passed by value.
+// The globals may change in any call as far as the compiler knows,
+// these can not, so they are not loaded again after every call
+// into the kernel.
+
+#define WORKER_INLINE static inline __attribute__((always_inline))
+
+// The cardioid and the bulb can only be skipped for z^2 + c, and
+// are worth the check when the view overlaps them at all
+
+WORKER_INLINE int32_t _worker_interior(const double x, const double y)
+{
+  const double y2 = y * y;
+  const double q = (x - 0.25) * (x - 0.25) + y2;
+  return q * (q + (x - 0.25)) < 0.25 * y2 || (x + 1.0) * (x + 1.0) + y2 < 0.0625;
+}
 
-// A worker thread
+int32_t worker_interior_applies(const kernel_t * k, const viewport_t * v, const int32_t orbits)
+{
+  return k->power == 2 && !k->julia && !orbits
+    && v->x_min < 0.375 && v->x_min + v->x_range > -1.25
+    && v->y_min < 0.65 && v->y_min + v->y_range > -0.65;
+}
 
-void * mandelbrot_thread()
+WORKER_INLINE void _worker_rows(
+    const worker_view_t v,
+    const int32_t id,
+    const int32_t with_histogram,
+    const int32_t with_orbits,
+    const int32_t with_reuse,
+    const int32_t with_interior
+  )
 {
+  const int32_t w = v.view.width;
+  const int32_t max = v.params.iterations;
+  uint64_t * histogram = with_histogram ? img_histograms[id] : NULL;
+  progress_counter_t * progress = &img_progress[id];
+
+  work_unit_t unit = { mem_alloc(sizeof(int32_t) * rows_per_unit), 0, 0 };
   int32_t py;
-  int32_t px;
-  int32_t i;
-  int32_t i_current;
 
-  while ((py = get_next_row()) >= 0)
+  double * cx = mem_alloc(sizeof(double) * w);
+  double * cy = mem_alloc(sizeof(double) * w);
+  int32_t * iterations = mem_alloc(sizeof(int32_t) * w);
+  int32_t * pixels = with_reuse || with_interior ? mem_alloc(sizeof(int32_t) * w) : NULL;
+
+  // Orbits that reach the cap in the current row
+  double * zx = NULL;
+  double * zy = NULL;
+  state_orbit_t * orbits = NULL;
+  int64_t n_orbits = 0;
+  int64_t orbits_size = 0;
+
+  if (with_orbits) {
+    zx = mem_alloc(sizeof(double) * w);
+    zy = mem_alloc(sizeof(double) * w);
+  }
+
+  // Stop between rows when the pool shrinks below this thread
+  while (!pool_parked(id) && (py = get_next_row(&unit)) >= 0)
   {
-    i = 0;
-    for (px = 0; px < width; px++)
+    const int64_t begin = trace_begin();
+    int32_t * row = (int32_t *) &v.field->pixels[py * w];
+    const double y = viewport_y(&v.view, py);
+    const int32_t reused = with_reuse && v.reuse_rows[py] >= 0;
+
+    // Iterations the kernel ran for the row, not the copied and
+    // filled in samples
+    int64_t row_iterations = 0;
+
+    if (reused || with_interior) {
+      const image_t * old = reused ? v.reuse->field : NULL;
+      const union pixel * old_row = reused ? &old->pixels[v.reuse_rows[py] * old->width] : NULL;
+      int32_t n = 0;
+
+      // Copy the samples we have, fill in the ones that are
+      // inside for sure and solve the rest
+      for (int32_t px = 0; px < w; px++) {
+        if (reused && v.reuse_cols[px] >= 0) {
+          row[px] = old_row[v.reuse_cols[px]].i32;
+        } else if (with_interior && _worker_interior(v.x_coordinates[px], y)) {
+          row[px] = max;
+        } else {
+          cx[n] = v.x_coordinates[px];
+          cy[n] = y;
+          pixels[n] = px;
+          n++;
+        }
+      }
+
+      v.kernel->solve(&v.params, cx, cy, n, iterations, NULL);
+
+      for (int32_t k = 0; k < n; k++) {
+        row[pixels[k]] = iterations[k];
+        row_iterations += iterations[k];
+      }
+    } else if (with_orbits) {
+      // Same as m_solve_row(), but keeping where every orbit ends
+      for (int32_t px = 0; px < w; px++) {
+        cy[px] = y;
+        zx[px] = v.kernel->julia ? v.x_coordinates[px] : 0;
+        zy[px] = v.kernel->julia ? y : 0;
+      }
+
+      kernel_state_t state = { zx, zy, 0 };
+      v.kernel->solve(&v.params, v.x_coordinates, cy, w, row, &state);
+
+      for (int32_t px = 0; px < w; px++) {
+        if (row[px] < max) {
+          continue;
+        }
+        if (n_orbits == orbits_size) {
+          orbits_size = orbits_size ? orbits_size * 2 : w;
+          orbits = mem_realloc(orbits, sizeof(state_orbit_t) * orbits_size);
+        }
+        state_orbit_t orbit = { (int64_t) py * w + px, zx[px], zy[px] };
+        orbits[n_orbits++] = orbit;
+      }
+    } else {
+      m_solve_row(&v.view, v.kernel, &v.params, v.x_coordinates, py, row, cy);
+    }
+
+    if (!reused && !with_interior) {
+      for (int32_t px = 0; px < w; px++) {
+        row_iterations += row[px];
+      }
+    }
+
+    #ifdef DEBUG
+    int32_t i = 0;
+    for (int32_t px = 0; px < w; px++)
     {
-      i_current = m_process_pixel(px, py);
-      if (i_current > i) {
-        i = i_current;
+      debug("p[%d, %d] = C[%.8f, %.8f] = %d\n",
+          px, py, v.x_coordinates[px], y, row[px]);
+      if (row[px] > i) {
+        i = row[px];
       }
     }
     debug("py = %d, max[i] = %d\n", py, i);
+    #endif
+
+    const int32_t mirror = mirror_row(py);
+    if (mirror >= 0) {
+      memcpy(&v.field->pixels[mirror * w], row, sizeof(union pixel) * w);
+    }
+
+    if (with_histogram) {
+      const uint64_t count = mirror >= 0 ? 2 : 1;
+      for (int32_t px = 0; px < w; px++) {
+        histogram[row[px]] += count;
+      }
+    }
+
+    atomic_fetch_add_explicit(&progress->pixels,
+        mirror >= 0 ? 2 * w : w, memory_order_relaxed);
+    atomic_fetch_add_explicit(&progress->iterations,
+        row_iterations, memory_order_relaxed);
+
+    // The row is done, along with its orbits
+    pthread_mutex_lock(&lock);
+
+    if (with_orbits && n_orbits > 0) {
+      state_orbits_append(&img_orbits, orbits, n_orbits);
+      n_orbits = 0;
+    }
+
+    img_rows_done[py] = 1;
+    if (mirror >= 0) {
+      img_rows_done[mirror] = 1;
+    }
+
+    img_n_rows_solved++;
+    if (mandelbrot_row_hook != NULL) {
+      mandelbrot_row_hook(img_n_rows_solved);
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    trace_end("row", "render", begin, py);
   }
 
-  return NULL;
+  return_rows(&unit);
+
+  mem_free(unit.rows);
+  mem_free(cx);
+  mem_free(cy);
+  mem_free(iterations);
+  mem_free(pixels);
+  mem_free(zx);
+  mem_free(zy);
+  mem_free(orbits);
+}
+
+#define WORKER_DEFINE(HISTOGRAM, ORBITS, REUSE, INTERIOR) \
+  static void _worker_##HISTOGRAM##ORBITS##REUSE##INTERIOR(const worker_view_t v, const int32_t id) \
+  { \
+    _worker_rows(v, id, HISTOGRAM, ORBITS, REUSE, INTERIOR); \
+  }
+
+#define WORKER_DEFINE_INTERIOR(HISTOGRAM, ORBITS, REUSE) \
+  WORKER_DEFINE(HISTOGRAM, ORBITS, REUSE, 0) \
+  WORKER_DEFINE(HISTOGRAM, ORBITS, REUSE, 1)
+
+#define WORKER_DEFINE_REUSE(HISTOGRAM, ORBITS) \
+  WORKER_DEFINE_INTERIOR(HISTOGRAM, ORBITS, 0) \
+  WORKER_DEFINE_INTERIOR(HISTOGRAM, ORBITS, 1)
+
+WORKER_DEFINE_REUSE(0, 0)
+WORKER_DEFINE_REUSE(0, 1)
+WORKER_DEFINE_REUSE(1, 0)
+WORKER_DEFINE_REUSE(1, 1)
+
+// Indexed by the options, in the order above. Orbits are never
+// kept together with reuse or the interior check, but those are
+// compiled all the same to keep the table whole.
+
+static const worker_fn_t workers[2][2][2][2] = {
+  { { { _worker_0000, _worker_0001 }, { _worker_0010, _worker_0011 } },
+    { { _worker_0100, _worker_0101 }, { _worker_0110, _worker_0111 } } },
+  { { { _worker_1000, _worker_1001 }, { _worker_1010, _worker_1011 } },
+    { { _worker_1100, _worker_1101 }, { _worker_1110, _worker_1111 } } },
+};
+
+worker_fn_t worker_select(const int32_t histogram, const int32_t orbits, const int32_t reuse,
+    const int32_t interior)
+{
+  return workers[histogram != 0][orbits != 0][reuse != 0][interior != 0];
+}
+
+void mandelbrot_worker(void * ptr, const int32_t item, const int32_t id)
+{
+  (void) item;
+
+  const worker_ctx_t * ctx = ptr;
+  ctx->run(ctx->view, id);
 }
 
 
@@ -263,6 +1627,30 @@ double py_to_coordinate(const int32_t py)
   return y_min + ((h - p) / h) * y_range;
 }
 
+// Solve a full row of a view into row. cy needs room for a row
+// of coordinates.
+
+void m_solve_row(
+    const viewport_t * view,
+    const kernel_t * k,
+    const kernel_params_t * params,
+    const double * x_coordinates,
+    const int32_t py,
+    int32_t * row,
+    double * cy
+  )
+{
+  const double y = viewport_y(view, py);
+  for (int32_t px = 0; px < view->width; px++) {
+    cy[px] = y;
+  }
+
+  k->solve(params, x_coordinates, cy, view->width, row, NULL);
+}
+
+// The plain quadratic loop. The kernels in kernel.c are
+// generated from the same loop and this is kept as reference.
+
 int32_t m_solve(const double cx, const double cy)
 {
   const int32_t max = n_iterations;
@@ -289,17 +1677,3 @@ int32_t m_solve(const double cx, const double cy)
 
   return max;
 }
-
-int32_t m_process_pixel(const int32_t px, const int32_t py)
-{
-  // Convert from pixel to domain
-  double x = px_to_coordinate(px);
-  double y = py_to_coordinate(py);
-  // "Solve" Mandelbrot for point
-  int32_t iterations = m_solve(x, y);
-  debug("p[%d, %d] = C[%.8f, %.8f] = %d\n", px, py, x, y, iterations);
-  // Set pixel iteration color
-  img->pixels[py * width + px].hsv = colorize(iterations);
-  // Return iterations
-  return iterations;
-}
@@ -1,29 +1,79 @@
 #pragma once
 
-// Required for nanosleep to work
-#define _POSIX_C_SOURCE 199309L
+// Required for nanosleep and pthread_sigmask to work
+#define _POSIX_C_SOURCE 200112L
 
+#include <errno.h>
+#include <inttypes.h>
 #include <math.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <time.h>
 
+#include "buddha.h"
+#include "cache.h"
 #include "colors.h"
 #include "image.h"
+#include "kernel.h"
+#include "pool.h"
+#include "state.h"
+#include "stats.h"
 #include "utils.h"
 
 
+// Pass as iterations to pick a cap by sampling the view
+#define ITERATIONS_AUTO 0
+#define AUTO_MIN_ITERATIONS 64
+
+// Outputs of one render, see outputs.h
+#define MAX_OUTPUTS 16
+
 typedef struct {
   int32_t width;
+  int32_t height;  // 0 to follow the aspect ratio of the view
   int32_t iterations;
   int32_t threads;
+  int32_t max_threads;  // Room to grow the pool to, 0 for a fixed pool
+  int32_t follow;       // RESIZE_FOLLOW_* flags
+  int32_t rows;     // Rows a worker takes at a time
   int32_t supersampling;
+  int32_t gamma;
+  int32_t power;
+  int32_t julia;
+  int32_t precision;
+  int32_t variant;  // KERNEL_VARIANT_*
   int32_t progress;
+  int32_t progress_fd;
+  int32_t coloring;
+  int32_t indexed;
+  int32_t buddhabrot;
+  int32_t pyramid;
   int32_t verbose;
+  int32_t perf;
   double x_min;
   double x_max;
   double y_min;
   double y_max;
+  double julia_x;
+  double julia_y;
   char * filename;
+  char * stats;
+  char * state;
+  char * batch;
+  char * results;
+  char * trace;
+  char * profile;
+  char * control;
+  char * points;
+  char * points_output;
+  int32_t final_z;
+  char * outputs[MAX_OUTPUTS];  // --output specs, parsed in main
+  int32_t n_outputs;
+  int64_t verify;   // Pixels to check with --verify, 0 for all, -1 without
+  double tolerance;
+  int32_t autotune;
+  int32_t resume;
 } args_t;
 
 
@@ -40,11 +90,39 @@ extern int32_t height;
 
 extern int32_t n_iterations;
 extern int32_t n_threads;
+extern int32_t rows_per_unit;
+extern int32_t iterations_auto;
 
 extern int32_t supersampling;
 extern int32_t show_progress;
+extern int32_t progress_fd;
+extern int32_t coloring;
+extern int32_t indexed;
+extern int64_t buddhabrot_samples;
+
+extern const kernel_t * kernel;
+extern kernel_params_t kernel_params;
+
+extern viewport_t viewport;
+
+// Called by the worker that finished a row, with the lock held and
+// the number of rows solved in the render so far, when set
+extern void (*mandelbrot_row_hook)(const int64_t rows);
 
 
 extern void mandelbrot_init(const args_t * args);
 
 extern image_t * mandelbrot_calculate();
+
+extern const image_t * mandelbrot_calculate_iterations();
+
+// The plain loop for z^2 + c in doubles, up to n_iterations. The
+// kernels are checked against it with --verify.
+extern int32_t m_solve(const double cx, const double cy);
+
+// Counts of every iteration in a field from the last render
+extern const uint64_t * mandelbrot_histogram(const image_t * field);
+
+extern void mandelbrot_prefetch();
+
+extern void mandelbrot_cleanup();
@@ -0,0 +1,210 @@
+#include "outputs.h"
+
+
+// Parsing
+
+void output_default(const args_t * args, char * filename, output_t * output)
+{
+  output->filename = filename;
+  output->scale = 1;
+  output->coloring = args->coloring;
+  output->format = args->indexed ? OUTPUT_FORMAT_INDEXED : OUTPUT_FORMAT_PNG;
+}
+
+static int32_t _output_format_parse(const char * name)
+{
+  if (strcmp(name, "png") == 0) {
+    return OUTPUT_FORMAT_PNG;
+  } else if (strcmp(name, "indexed") == 0) {
+    return OUTPUT_FORMAT_INDEXED;
+  } else if (strcmp(name, "raw") == 0) {
+    return OUTPUT_FORMAT_RAW;
+  }
+  return OUTPUT_FORMAT_INVALID;
+}
+
+const char * output_parse(char * spec, const args_t * args, output_t * output)
+{
+  char * options = strchr(spec, ',');
+  if (options != NULL) {
+    *options++ = '\0';
+  }
+
+  if (spec[0] == '\0') {
+    return "no file name";
+  }
+  output_default(args, spec, output);
+
+  for (char * option = options; option != NULL; option = options) {
+    options = strchr(option, ',');
+    if (options != NULL) {
+      *options++ = '\0';
+    }
+
+    char * value = strchr(option, '=');
+    if (value == NULL) {
+      return "options are key=value";
+    }
+    *value++ = '\0';
+
+    if (strcmp(option, "scale") == 0) {
+      output->scale = atoi(value);
+      if (output->scale < 1 || output->scale > OUTPUT_MAX_SCALE) {
+        return "scale is an integer from 1 to 16";
+      }
+    } else if (strcmp(option, "coloring") == 0) {
+      output->coloring = colorize_mode_parse(value);
+      if (output->coloring == COLORIZE_INVALID) {
+        return "coloring is bands or histogram";
+      }
+    } else if (strcmp(option, "format") == 0) {
+      output->format = _output_format_parse(value);
+      if (output->format == OUTPUT_FORMAT_INVALID) {
+        return "format is png, indexed or raw";
+      }
+    } else {
+      return "unknown option, expected scale, coloring or format";
+    }
+  }
+
+  if (output->format == OUTPUT_FORMAT_RAW && output->scale != 1) {
+    return "scale does not apply to format=raw";
+  }
+
+  return NULL;
+}
+
+
+// Writers, one thread for every output
+
+typedef struct {
+  const output_t * output;
+  const image_t * field;  // Raw outputs
+  image_t * img;          // Colored outputs, destroyed once written
+  int32_t status;
+  pthread_t thread;
+} output_job_t;
+
+static int32_t _output_write_raw(const image_t * field, const char * filename)
+{
+  const int64_t begin = trace_begin();
+
+  FILE * fp = fopen(filename, "wb");
+  if (!fp) {
+    critical("failed to open file '%s' in write mode\n", filename);
+    return 2;
+  }
+
+  uint8_t * row = mem_alloc(4 * field->width);
+  int32_t status = 0;
+
+  for (int32_t y = 0; y < field->height && status == 0; y++) {
+    const union pixel * src = &field->pixels[y * field->width];
+    for (int32_t x = 0; x < field->width; x++) {
+      const uint32_t i = (uint32_t) src[x].i32;
+      row[4 * x + 0] = i & 0xff;
+      row[4 * x + 1] = (i >> 8) & 0xff;
+      row[4 * x + 2] = (i >> 16) & 0xff;
+      row[4 * x + 3] = i >> 24;
+    }
+    if (fwrite(row, 4, field->width, fp) != (size_t) field->width) {
+      status = 2;
+    }
+  }
+
+  mem_free(row);
+  status = fclose(fp) == 0 ? status : 2;
+
+  trace_end("write_raw", "io", begin, -1);
+  return status;
+}
+
+static void * _output_writer(void * ptr)
+{
+  output_job_t * job = ptr;
+
+  trace_thread_name("writer");
+
+  if (job->output->format == OUTPUT_FORMAT_RAW) {
+    job->status = _output_write_raw(job->field, job->output->filename);
+  } else if (job->img != NULL) {
+    job->status = image_write_png(job->img, job->output->filename);
+    image_destroy(job->img);
+    job->img = NULL;
+  } else {
+    job->status = 2;
+  }
+
+  return NULL;
+}
+
+
+// Colors the field for one output, at its size
+
+static image_t * _output_color(const output_t * output, const image_t * field, const args_t * args)
+{
+  if (output->coloring == COLORIZE_HISTOGRAM) {
+    colorize_init_histogram(n_iterations, mandelbrot_histogram(field));
+  } else {
+    colorize_init(n_iterations);
+  }
+
+  const int32_t factor = supersampling * output->scale;
+  const int32_t format = output->format;
+
+  image_t * img = format == OUTPUT_FORMAT_INDEXED && factor == 1
+    ? image_index(field)
+    : image_colorize(field);
+
+  img = image_finish(img, factor, args->gamma);
+  if (img == NULL) {
+    return NULL;
+  }
+
+  // Averaged colors need a palette of their own
+  if (format == OUTPUT_FORMAT_INDEXED && img->mode == IMAGE_MODE_RGB) {
+    image_t * old = img;
+    img = image_quantize(old);
+    image_destroy(old);
+  }
+
+  return img;
+}
+
+int32_t outputs_write(const args_t * args, const output_t * outputs, const int32_t n_outputs)
+{
+  const image_t * field = mandelbrot_calculate_iterations();
+  if (field == NULL) {
+    return 1;
+  }
+
+  output_job_t * jobs = mem_alloc(sizeof(output_job_t) * n_outputs);
+
+  // Raw outputs first, they are written while the others are colored
+  for (int32_t pass = 0; pass < 2; pass++) {
+    for (int32_t i = 0; i < n_outputs; i++) {
+      const int32_t raw = outputs[i].format == OUTPUT_FORMAT_RAW;
+      if (raw != (pass == 0)) {
+        continue;
+      }
+
+      jobs[i].output = &outputs[i];
+      jobs[i].field = field;
+      jobs[i].img = raw ? NULL : _output_color(&outputs[i], field, args);
+      pthread_create(&jobs[i].thread, NULL, _output_writer, &jobs[i]);
+    }
+  }
+
+  int32_t status = 0;
+  for (int32_t i = 0; i < n_outputs; i++) {
+    pthread_join(jobs[i].thread, NULL);
+    if (jobs[i].status != 0) {
+      critical("Failed to write '%s'\n", outputs[i].filename);
+      status = 2;
+    }
+  }
+
+  mem_free(jobs);
+
+  return status;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "mandelbrot.h"
+
+
+// Several outputs of one render. The view is computed once, and
+// every output is made from the same field of iteration counts
+// with a size, coloring and format of its own:
+//
+//   --output=thumb.png,scale=8,coloring=histogram,format=indexed
+//
+// scale divides the width and height of the image. format is png,
+// indexed (a PNG with a palette) or raw, the iteration counts of
+// every sample as little endian 32 bit integers, row by row, with
+// no header. Outputs not given a coloring or format take those of
+// the command line.
+//
+// The main thread colors one output after another on the worker
+// pool, and every output is encoded and written by a thread of its
+// own while the next one is colored.
+
+#define OUTPUT_MAX_SCALE 16
+
+enum output_format {
+  OUTPUT_FORMAT_INVALID = -1,
+  OUTPUT_FORMAT_PNG = 0,
+  OUTPUT_FORMAT_INDEXED = 1,
+  OUTPUT_FORMAT_RAW = 2,
+};
+
+typedef struct {
+  char * filename;
+  int32_t scale;
+  int32_t coloring;  // COLORIZE_*
+  int32_t format;
+} output_t;
+
+
+// The output for the IMAGE of the command line in args
+extern void output_default(const args_t * args, char * filename, output_t * output);
+
+// Parses "FILE[,key=value...]" into output, changing spec, with
+// defaults from args. Returns an error message, or NULL.
+extern const char * output_parse(char * spec, const args_t * args, output_t * output);
+
+// Renders the view mandelbrot_init() was given and writes every
+// output. Returns 0 when all were written, 1 when the render was
+// interrupted, and 2 when an output failed.
+extern int32_t outputs_write(const args_t * args, const output_t * outputs, const int32_t n_outputs);
@@ -0,0 +1,318 @@
+// Required for syscall() to work
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "perf.h"
+
+
+enum perf_event {
+  PERF_CYCLES = 0,
+  PERF_INSTRUCTIONS,
+  PERF_BRANCHES,
+  PERF_BRANCH_MISSES,
+  PERF_CACHE_REFERENCES,
+  PERF_CACHE_MISSES,
+  PERF_EVENTS,
+};
+
+static const uint64_t perf_configs[PERF_EVENTS] = {
+  PERF_COUNT_HW_CPU_CYCLES,
+  PERF_COUNT_HW_INSTRUCTIONS,
+  PERF_COUNT_HW_BRANCH_INSTRUCTIONS,
+  PERF_COUNT_HW_BRANCH_MISSES,
+  PERF_COUNT_HW_CACHE_REFERENCES,
+  PERF_COUNT_HW_CACHE_MISSES,
+};
+
+typedef struct {
+  const char * name;
+  const char * unit;
+  _Atomic uint64_t counts[PERF_MAX_THREADS][PERF_EVENTS];
+  _Atomic int64_t units[PERF_MAX_THREADS];
+  atomic_int used[PERF_MAX_THREADS];
+} perf_region_t;
+
+typedef struct {
+  uint64_t enabled;
+  uint64_t running;
+  uint64_t values[PERF_EVENTS];
+} perf_snapshot_t;
+
+
+// Global state: Regions and whether counters work at all
+
+static bool perf_on = false;
+static atomic_int perf_failed;
+static int perf_error = 0;
+
+static perf_region_t perf_regions[PERF_MAX_REGIONS];
+static int32_t perf_n_regions = 0;
+static pthread_mutex_t perf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The group of counters of this thread, and where each event is in
+// what a read of it returns (-1 for events the CPU does not have)
+static _Thread_local int perf_group = -1;
+static _Thread_local bool perf_opened = false;
+static _Thread_local int32_t perf_slots[PERF_EVENTS];
+static _Thread_local int32_t perf_n_slots = 0;
+
+
+// Counters of the calling thread, in user space only, which is what
+// perf_event_paranoid allows unprivileged processes by default
+
+static int _perf_open(const uint64_t config, const int group)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.disabled = group < 0;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP
+    | PERF_FORMAT_TOTAL_TIME_ENABLED
+    | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static bool _perf_thread_open()
+{
+  perf_opened = true;
+
+  if (atomic_load(&perf_failed)) {
+    return false;
+  }
+
+  perf_group = _perf_open(perf_configs[PERF_CYCLES], -1);
+  if (perf_group < 0) {
+    if (atomic_exchange(&perf_failed, 1) == 0) {
+      perf_error = errno;
+      error("Hardware counters are unavailable (%s), --perf will have nothing to report\n",
+          strerror(perf_error));
+    }
+    return false;
+  }
+
+  perf_slots[PERF_CYCLES] = perf_n_slots++;
+  for (int32_t e = 1; e < PERF_EVENTS; e++) {
+    const int fd = _perf_open(perf_configs[e], perf_group);
+    perf_slots[e] = fd < 0 ? -1 : perf_n_slots++;
+  }
+
+  ioctl(perf_group, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  return true;
+}
+
+static bool _perf_read(perf_snapshot_t * snapshot)
+{
+  if (!perf_opened && !_perf_thread_open()) {
+    return false;
+  }
+  if (perf_group < 0) {
+    return false;
+  }
+
+  uint64_t buffer[3 + PERF_EVENTS];
+  const ssize_t size = sizeof(uint64_t) * (3 + perf_n_slots);
+  if (read(perf_group, buffer, size) != size) {
+    return false;
+  }
+
+  snapshot->enabled = buffer[1];
+  snapshot->running = buffer[2];
+  for (int32_t e = 0; e < PERF_EVENTS; e++) {
+    snapshot->values[e] = perf_slots[e] < 0 ? 0 : buffer[3 + perf_slots[e]];
+  }
+  return true;
+}
+
+// Adds the counts between two reads, scaled up for the time the
+// group was not on the CPU when there are more groups than counters
+static void _perf_add(perf_region_t * region, const int32_t thread,
+    const perf_snapshot_t * before, const perf_snapshot_t * after)
+{
+  const uint64_t enabled = after->enabled - before->enabled;
+  const uint64_t running = after->running - before->running;
+  if (running == 0) {
+    return;
+  }
+
+  const double scale = (double) enabled / (double) running;
+  for (int32_t e = 0; e < PERF_EVENTS; e++) {
+    const uint64_t count = (after->values[e] - before->values[e]) * scale;
+    atomic_fetch_add_explicit(&region->counts[thread][e], count, memory_order_relaxed);
+  }
+  atomic_store_explicit(&region->used[thread], 1, memory_order_relaxed);
+}
+
+
+// Regions
+
+static perf_region_t * _perf_region(const char * name, const char * unit)
+{
+  pthread_mutex_lock(&perf_lock);
+
+  perf_region_t * region = NULL;
+  for (int32_t i = 0; i < perf_n_regions && region == NULL; i++) {
+    if (strcmp(perf_regions[i].name, name) == 0) {
+      region = &perf_regions[i];
+    }
+  }
+
+  if (region == NULL && perf_n_regions < PERF_MAX_REGIONS) {
+    region = &perf_regions[perf_n_regions++];
+    region->name = name;
+    region->unit = unit;
+  }
+  if (region != NULL && region->unit == NULL) {
+    region->unit = unit;
+  }
+
+  pthread_mutex_unlock(&perf_lock);
+  return region;
+}
+
+void perf_init()
+{
+  perf_on = true;
+}
+
+bool perf_enabled()
+{
+  return perf_on;
+}
+
+typedef struct {
+  const char * name;
+  perf_region_t * region;  // NULL when only tracing
+  int64_t units_per_item;
+  pool_task_t task;
+  void * ctx;
+} perf_call_t;
+
+static void _perf_item(void * ptr, const int32_t item, const int32_t thread)
+{
+  const perf_call_t * call = ptr;
+  const int32_t slot = thread % PERF_MAX_THREADS;
+
+  perf_snapshot_t before, after;
+  const bool counting = call->region != NULL && _perf_read(&before);
+  const int64_t begin = trace_begin();
+
+  call->task(call->ctx, item, thread);
+
+  trace_end(call->name, "item", begin, item);
+
+  if (counting && _perf_read(&after)) {
+    _perf_add(call->region, slot, &before, &after);
+  }
+  if (call->region != NULL) {
+    atomic_fetch_add_explicit(&call->region->units[slot], call->units_per_item, memory_order_relaxed);
+  }
+}
+
+void perf_parallel_for(
+    const char * name,
+    const char * unit,
+    const int64_t units_per_item,
+    const int32_t n_items,
+    pool_task_t task,
+    void * ctx
+  )
+{
+  perf_region_t * region = perf_on && !atomic_load(&perf_failed) ? _perf_region(name, unit) : NULL;
+  if (region == NULL && !trace_enabled()) {
+    pool_parallel_for(n_items, task, ctx);
+    return;
+  }
+
+  const int64_t begin = trace_begin();
+
+  perf_call_t call = { name, region, units_per_item, task, ctx };
+  pool_parallel_for(n_items, _perf_item, &call);
+
+  trace_end(name, "pass", begin, -1);
+}
+
+void perf_units(const char * name, const int32_t thread, const int64_t units)
+{
+  perf_region_t * region = perf_on && !atomic_load(&perf_failed) ? _perf_region(name, NULL) : NULL;
+  if (region != NULL) {
+    atomic_fetch_add_explicit(&region->units[thread % PERF_MAX_THREADS], units, memory_order_relaxed);
+  }
+}
+
+
+// Report
+
+static void _perf_ratio(char * out, const size_t size, const uint64_t a, const uint64_t b,
+    const double factor, const char * suffix)
+{
+  if (b == 0) {
+    snprintf(out, size, "n/a");
+  } else {
+    snprintf(out, size, "%.3f%s", factor * (double) a / (double) b, suffix);
+  }
+}
+
+static void _perf_line(const char * label, const char * unit, const uint64_t * counts, const int64_t units)
+{
+  char per_unit[32], ipc[32], branch[32], cache[32];
+  _perf_ratio(per_unit, sizeof(per_unit), counts[PERF_CYCLES], units, 1.0, "");
+  _perf_ratio(ipc, sizeof(ipc), counts[PERF_INSTRUCTIONS], counts[PERF_CYCLES], 1.0, "");
+  _perf_ratio(branch, sizeof(branch), counts[PERF_BRANCH_MISSES], counts[PERF_BRANCHES], 100.0, "%");
+  _perf_ratio(cache, sizeof(cache), counts[PERF_CACHE_MISSES], counts[PERF_CACHE_REFERENCES], 100.0, "%");
+
+  fprintf(stderr, "[perf] %-28s %12.4g %ss, %s cycles/%s, IPC %s, branch misses %s, cache misses %s\n",
+      label, (double) units, unit ? unit : "unit", per_unit, unit ? unit : "unit", ipc, branch, cache);
+}
+
+void perf_report()
+{
+  if (!perf_on) {
+    return;
+  }
+  if (atomic_load(&perf_failed)) {
+    fprintf(stderr, "[perf] Hardware counters are unavailable: %s\n", strerror(perf_error));
+    return;
+  }
+
+  for (int32_t i = 0; i < perf_n_regions; i++) {
+    const perf_region_t * region = &perf_regions[i];
+    uint64_t total[PERF_EVENTS] = { 0 };
+    int64_t units = 0;
+    int32_t threads = 0;
+
+    for (int32_t t = 0; t < PERF_MAX_THREADS; t++) {
+      for (int32_t e = 0; e < PERF_EVENTS; e++) {
+        total[e] += region->counts[t][e];
+      }
+      units += region->units[t];
+      threads += region->used[t];
+    }
+
+    _perf_line(region->name, region->unit, total, units);
+
+    for (int32_t t = 0; t < PERF_MAX_THREADS && threads > 1; t++) {
+      if (!region->used[t]) {
+        continue;
+      }
+
+      uint64_t counts[PERF_EVENTS];
+      for (int32_t e = 0; e < PERF_EVENTS; e++) {
+        counts[e] = region->counts[t][e];
+      }
+
+      char label[32];
+      snprintf(label, sizeof(label), "  thread %d", t);
+      _perf_line(label, region->unit, counts, region->units[t]);
+    }
+  }
+}
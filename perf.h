@@ -0,0 +1,41 @@
+#pragma once
+
+#include "pool.h"
+#include "utils.h"
+
+
+// Hardware performance counters (perf_event_open) around the hot
+// loops. Every thread opens its own group of counters the first time
+// it measures something, and the counts go to named regions, split
+// by thread. Where counters are not available, such as in most
+// containers, nothing is counted and the report says why.
+
+#define PERF_MAX_REGIONS 32
+#define PERF_MAX_THREADS 256
+
+
+// Turns counting on. Off by default, so everything below is a plain
+// pool_parallel_for() then.
+extern void perf_init();
+
+extern bool perf_enabled();
+
+// pool_parallel_for(), counting the items into region name, with
+// units_per_item units of work (say, pixels) for each item. With
+// tracing on, the pass and every item are spans named name as well.
+extern void perf_parallel_for(
+    const char * name,
+    const char * unit,
+    const int64_t units_per_item,
+    const int32_t n_items,
+    pool_task_t task,
+    void * ctx
+  );
+
+// Adds units of work done by thread to region name, for tasks that
+// only know it afterwards
+extern void perf_units(const char * name, const int32_t thread, const int64_t units);
+
+// Cycles per unit, IPC, and branch and cache miss rates of every
+// region and thread, to stderr
+extern void perf_report();
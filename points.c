@@ -0,0 +1,230 @@
+#include "points.h"
+
+
+typedef struct {
+  const kernel_t * kernel;
+  const kernel_params_t * params;
+  const double * c;
+  int64_t n;
+  int32_t * iterations;
+  double * z;
+  int32_t interior;
+  int32_t rounds;
+  double * buffers;  // cx, cy, zx and zy of one chunk for each thread
+  int32_t * indices; // Where the points still being solved came from
+  int32_t * solved;
+} points_ctx_t;
+
+
+// Points in the main cardioid and the period-2 bulb never escape,
+// the same check as in the render workers
+
+static inline int32_t _points_inside(const double x, const double y)
+{
+  const double y2 = y * y;
+  const double q = (x - 0.25) * (x - 0.25) + y2;
+  return q * (q + (x - 0.25)) < 0.25 * y2 || (x + 1.0) * (x + 1.0) + y2 < 0.0625;
+}
+
+
+// One chunk. Scattered points next to each other in the lanes of a
+// kernel rarely escape together, and the lanes wait for the last
+// one. So the chunk is solved in rounds with doubling caps, as in
+// auto_iterations(): points that escape are done, and only the
+// rest continue from the z they reached, side by side with points
+// that also got that far.
+//
+// Without the final z, the points inside are left out and get the
+// cap right away. Long doubles would lose precision between rounds
+// and are solved in one.
+
+static void _points_chunk(void * ptr, const int32_t chunk, const int32_t thread)
+{
+  const points_ctx_t * ctx = ptr;
+  const int64_t first = (int64_t) chunk * POINTS_CHUNK;
+  const int32_t n = first + POINTS_CHUNK < ctx->n ? POINTS_CHUNK : (int32_t) (ctx->n - first);
+  const double * c = &ctx->c[2 * first];
+  const int32_t max = ctx->params->iterations;
+  const int32_t julia = ctx->kernel->julia;
+
+  double * cx = &ctx->buffers[4 * POINTS_CHUNK * thread];
+  double * cy = cx + POINTS_CHUNK;
+  double * zx = cy + POINTS_CHUNK;
+  double * zy = zx + POINTS_CHUNK;
+  int32_t * indices = &ctx->indices[POINTS_CHUNK * thread];
+  int32_t * solved = &ctx->solved[POINTS_CHUNK * thread];
+  int32_t * iterations = &ctx->iterations[first];
+  double * z = ctx->z ? &ctx->z[2 * first] : NULL;
+
+  int32_t m = 0;
+  for (int32_t k = 0; k < n; k++) {
+    if (ctx->interior && _points_inside(c[2 * k], c[2 * k + 1])) {
+      iterations[k] = max;
+      continue;
+    }
+    cx[m] = c[2 * k];
+    cy[m] = c[2 * k + 1];
+    zx[m] = julia ? cx[m] : 0;
+    zy[m] = julia ? cy[m] : 0;
+    indices[m++] = k;
+  }
+
+  kernel_params_t params = *ctx->params;
+  int32_t start = 0;
+
+  while (m > 0) {
+    const int32_t cap = !ctx->rounds ? max
+      : start == 0 ? (POINTS_FIRST_CAP < max ? POINTS_FIRST_CAP : max)
+      : (start < max / 2 ? 2 * start : max);
+    params.iterations = cap;
+
+    kernel_state_t state = { zx, zy, start };
+    ctx->kernel->solve(&params, cx, cy, m, solved, &state);
+
+    int32_t left = 0;
+    for (int32_t j = 0; j < m; j++) {
+      if (solved[j] < cap || cap == max) {
+        iterations[indices[j]] = solved[j];
+        if (z != NULL) {
+          z[2 * indices[j]] = zx[j];
+          z[2 * indices[j] + 1] = zy[j];
+        }
+        continue;
+      }
+      cx[left] = cx[j];
+      cy[left] = cy[j];
+      zx[left] = zx[j];
+      zy[left] = zy[j];
+      indices[left++] = indices[j];
+    }
+
+    m = left;
+    start = cap;
+  }
+}
+
+void points_solve(
+    const kernel_t * k,
+    const kernel_params_t * params,
+    const double * c,
+    const int64_t n,
+    int32_t * iterations,
+    double * z
+  )
+{
+  const int32_t threads = pool_size();
+
+  points_ctx_t ctx = {
+    .kernel = k,
+    .params = params,
+    .c = c,
+    .n = n,
+    .iterations = iterations,
+    .z = z,
+    .interior = k->power == 2 && !k->julia && z == NULL,
+    .rounds = k->precision <= KERNEL_PRECISION_DOUBLE,
+    .buffers = mem_alloc(sizeof(double) * 4 * POINTS_CHUNK * threads),
+    .indices = mem_alloc(sizeof(int32_t) * POINTS_CHUNK * threads),
+    .solved = mem_alloc(sizeof(int32_t) * POINTS_CHUNK * threads),
+  };
+
+  perf_parallel_for("points", "point", POINTS_CHUNK, (n + POINTS_CHUNK - 1) / POINTS_CHUNK, _points_chunk, &ctx);
+
+  mem_free(ctx.buffers);
+  mem_free(ctx.indices);
+  mem_free(ctx.solved);
+}
+
+
+// Records of a block, packed
+
+static int32_t _points_write(FILE * fp, const int32_t * iterations, const double * z, const int64_t n,
+    uint8_t * records)
+{
+  if (z == NULL) {
+    return fwrite(iterations, sizeof(int32_t), n, fp) == (size_t) n ? 0 : 2;
+  }
+
+  const size_t size = sizeof(int32_t) + 2 * sizeof(double);
+  for (int64_t k = 0; k < n; k++) {
+    memcpy(&records[k * size], &iterations[k], sizeof(int32_t));
+    memcpy(&records[k * size + sizeof(int32_t)], &z[2 * k], 2 * sizeof(double));
+  }
+
+  return fwrite(records, size, n, fp) == (size_t) n ? 0 : 2;
+}
+
+int32_t points_run(const args_t * args, const char * input, const char * output)
+{
+  FILE * in = strcmp(input, "-") == 0 ? stdin : fopen(input, "rb");
+  if (!in) {
+    critical("failed to open file '%s' in read mode\n", input);
+    return 2;
+  }
+
+  FILE * out = strcmp(output, "-") == 0 ? stdout : fopen(output, "wb");
+  if (!out) {
+    critical("failed to open file '%s' in write mode\n", output);
+    if (in != stdin) {
+      fclose(in);
+    }
+    return 2;
+  }
+
+  // Scattered points have no spacing to pick the precision by
+  const int32_t precision = args->precision == KERNEL_PRECISION_AUTO ? KERNEL_PRECISION_DOUBLE : args->precision;
+  const kernel_t * k = kernel_select(args->power, args->julia, precision, args->variant);
+  const kernel_params_t params = { args->iterations, args->julia_x, args->julia_y };
+
+  double * c = mem_alloc(sizeof(double) * 2 * POINTS_BLOCK);
+  int32_t * iterations = mem_alloc(sizeof(int32_t) * POINTS_BLOCK);
+  double * z = args->final_z ? mem_alloc(sizeof(double) * 2 * POINTS_BLOCK) : NULL;
+  uint8_t * records = args->final_z
+    ? mem_alloc((sizeof(int32_t) + 2 * sizeof(double)) * POINTS_BLOCK) : NULL;
+
+  const double started = stats_now();
+  const size_t point = 2 * sizeof(double);
+  int64_t total = 0;
+  int32_t status = 0;
+  size_t bytes;
+
+  // fread() only comes up short at the end, where a piece of a
+  // point may be left over
+  while (status == 0 && (bytes = fread(c, 1, point * POINTS_BLOCK, in)) > 0) {
+    const int64_t n = bytes / point;
+    points_solve(k, &params, c, n, iterations, z);
+    status = _points_write(out, iterations, z, n, records);
+    total += n;
+
+    if (bytes % point != 0) {
+      error("The last %zu bytes of '%s' are not a whole point\n", bytes % point, input);
+    }
+  }
+
+  if (status != 0) {
+    critical("failed to write the results to '%s'\n", output);
+  } else if (ferror(in)) {
+    critical("failed to read the points in '%s'\n", input);
+    status = 2;
+  }
+
+  const double seconds = stats_now() - started;
+  info("%" PRId64 " points with %s in %.3f s, %.2f Mpoints/s\n",
+      total, k->name, seconds, seconds > 0 ? 1e-6 * total / seconds : 0.0);
+
+  mem_free(c);
+  mem_free(iterations);
+  mem_free(z);
+  mem_free(records);
+
+  if (in != stdin) {
+    fclose(in);
+  }
+  if (out != stdout) {
+    status = fclose(out) == 0 ? status : 2;
+  } else {
+    status = fflush(out) == 0 ? status : 2;
+  }
+
+  return status;
+}
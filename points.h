@@ -0,0 +1,42 @@
+#pragma once
+
+#include "mandelbrot.h"
+
+
+// Escape data for arbitrary points instead of a grid. The input is
+// packed pairs of doubles (cx, cy) in the byte order of the machine,
+// and every point gets a record in the same order:
+//
+//   int32_t iterations
+//   double zx, zy        With --final-z only, where the orbit stopped
+//
+// Records are packed, 4 or 20 bytes each. For Julia sets the points
+// are the starting z, with the c of --cx and --cy.
+//
+// Points are read a block at a time. Every block is split into
+// chunks that the pool solves with the kernels, and is written out
+// before the next one is read. A chunk is solved in rounds with
+// doubling caps from POINTS_FIRST_CAP, so points that escape early
+// do not hold up the lanes of the ones that go on.
+
+#define POINTS_CHUNK 4096
+#define POINTS_FIRST_CAP 64
+#define POINTS_BLOCK (64 * POINTS_CHUNK)
+
+
+// Solves the n points of c, given as (cx, cy) pairs, into
+// iterations, and where each orbit stopped into z as (zx, zy)
+// pairs, unless z is NULL
+extern void points_solve(
+    const kernel_t * k,
+    const kernel_params_t * params,
+    const double * c,
+    const int64_t n,
+    int32_t * iterations,
+    double * z
+  );
+
+// Solves every point of input into records in output, with the
+// kernel and iterations of args. Either may be "-" for stdin and
+// stdout. Returns 0 when all of them were written.
+extern int32_t points_run(const args_t * args, const char * input, const char * output);
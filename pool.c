@@ -0,0 +1,206 @@
+#include "pool.h"
+
+
+// Global state: Threads and the job currently being run
+
+static pthread_t * pool_threads = NULL;
+static int32_t pool_threads_count = 1;
+
+// Threads from this index on are parked. The caller, thread 0, is
+// always active.
+static atomic_int pool_active_count = 1;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pool_call_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+
+static int32_t pool_running = 0;
+static bool pool_quit = false;
+
+static pool_task_t pool_task = NULL;
+static void * pool_ctx = NULL;
+static int32_t pool_items = 0;
+static atomic_int pool_next_item;
+
+// Set while a thread is executing a task. Nested calls to
+// pool_parallel_for() are run directly on that thread.
+static _Thread_local bool pool_inside = false;
+
+
+// Hand out items until there are none left, or until the thread
+// is parked
+
+void _pool_work(const int32_t thread)
+{
+  int32_t item;
+
+  pool_inside = true;
+  while (!pool_parked(thread) && (item = atomic_fetch_add(&pool_next_item, 1)) < pool_items) {
+    pool_task(pool_ctx, item, thread);
+  }
+  pool_inside = false;
+}
+
+
+// A worker thread. Sleeps until there are items it may take,
+// helps out and reports back when done. A thread that was parked
+// in the middle of a job joins it again if it is woken up before
+// the job is over.
+
+void * _pool_thread(void * ptr)
+{
+  const int32_t thread = (int32_t) (intptr_t) ptr;
+
+  char name[TRACE_NAME_SIZE];
+  snprintf(name, sizeof(name), "pool %d", thread);
+  trace_thread_name(name);
+
+  pthread_mutex_lock(&pool_lock);
+
+  while (true)
+  {
+    while (!pool_quit && (pool_task == NULL || pool_parked(thread)
+          || atomic_load(&pool_next_item) >= pool_items)) {
+      pthread_cond_wait(&pool_wake, &pool_lock);
+    }
+    if (pool_quit) {
+      break;
+    }
+    pool_running++;
+    pthread_mutex_unlock(&pool_lock);
+
+    _pool_work(thread);
+
+    pthread_mutex_lock(&pool_lock);
+    if (--pool_running == 0) {
+      pthread_cond_signal(&pool_done);
+    }
+  }
+
+  pthread_mutex_unlock(&pool_lock);
+  return NULL;
+}
+
+
+// Start and stop the pool
+
+void pool_init(const int32_t threads)
+{
+  pool_init_resizable(threads, threads);
+}
+
+void pool_init_resizable(const int32_t threads, const int32_t max_threads)
+{
+  if (pool_threads != NULL) {
+    pool_destroy();
+  }
+
+  pool_threads_count = max_threads < threads ? threads : max_threads;
+  pool_threads_count = pool_threads_count < 1 ? 1 : pool_threads_count;
+  atomic_store(&pool_active_count, threads < 1 ? 1 : threads);
+  pool_quit = false;
+
+  if (pool_threads_count > 1) {
+    pool_threads = mem_alloc(sizeof(pthread_t) * pool_threads_count);
+  }
+
+  for (int32_t i = 1; i < pool_threads_count; i++) {
+    if (pthread_create(&pool_threads[i], NULL, _pool_thread, (void *) (intptr_t) i) != 0) {
+      critical("Failed to create pool thread %d\n", i);
+      exit(1);
+    }
+  }
+}
+
+void pool_destroy()
+{
+  if (pool_threads == NULL) {
+    pool_threads_count = 1;
+    return;
+  }
+
+  pthread_mutex_lock(&pool_lock);
+  pool_quit = true;
+  pthread_cond_broadcast(&pool_wake);
+  pthread_mutex_unlock(&pool_lock);
+
+  for (int32_t i = 1; i < pool_threads_count; i++) {
+    pthread_join(pool_threads[i], NULL);
+  }
+
+  mem_free(pool_threads);
+  pool_threads = NULL;
+  pool_threads_count = 1;
+  atomic_store(&pool_active_count, 1);
+}
+
+int32_t pool_size()
+{
+  return pool_threads_count;
+}
+
+int32_t pool_active()
+{
+  return atomic_load(&pool_active_count);
+}
+
+bool pool_parked(const int32_t thread)
+{
+  return thread >= atomic_load_explicit(&pool_active_count, memory_order_relaxed);
+}
+
+int32_t pool_resize(const int32_t threads)
+{
+  const int32_t active = threads < 1 ? 1 : threads > pool_threads_count ? pool_threads_count : threads;
+
+  // Threads that are let back in join a job that is still running
+  pthread_mutex_lock(&pool_lock);
+  atomic_store(&pool_active_count, active);
+  pthread_cond_broadcast(&pool_wake);
+  pthread_mutex_unlock(&pool_lock);
+
+  return active;
+}
+
+
+// Run task(ctx, item, thread) for every item in [0, n_items)
+// and return when all of them have finished.
+
+void pool_parallel_for(const int32_t n_items, pool_task_t task, void * ctx)
+{
+  if (n_items <= 0) {
+    return;
+  }
+
+  // Run on the calling thread when there is nobody to share
+  // with, or when the pool is already busy with another job
+  if (pool_inside || pool_threads == NULL || n_items == 1
+      || pthread_mutex_trylock(&pool_call_lock) != 0) {
+    for (int32_t i = 0; i < n_items; i++) {
+      task(ctx, i, 0);
+    }
+    return;
+  }
+
+  pthread_mutex_lock(&pool_lock);
+  pool_task = task;
+  pool_ctx = ctx;
+  pool_items = n_items;
+  atomic_store(&pool_next_item, 0);
+  pool_running = 0;
+  pthread_cond_broadcast(&pool_wake);
+  pthread_mutex_unlock(&pool_lock);
+
+  _pool_work(0);
+
+  pthread_mutex_lock(&pool_lock);
+  while (pool_running > 0) {
+    pthread_cond_wait(&pool_done, &pool_lock);
+  }
+  pool_task = NULL;
+  pool_ctx = NULL;
+  pthread_mutex_unlock(&pool_lock);
+
+  pthread_mutex_unlock(&pool_call_lock);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "trace.h"
+#include "utils.h"
+
+
+// A persistent pool of worker threads. The thread calling
+// pool_parallel_for() takes part in the work as thread 0,
+// so a pool of size 1 runs everything on the caller.
+//
+// A resizable pool starts all of its threads, but only the first
+// pool_active() of them take work, the rest are parked. Resizing
+// takes effect between items, so tasks that run for long (such as
+// the render workers) check pool_parked() themselves and return
+// their remaining work when it says so.
+
+typedef void (*pool_task_t)(void * ctx, const int32_t item, const int32_t thread);
+
+
+extern void pool_init(const int32_t threads);
+
+// With threads active, and room to grow to max_threads
+extern void pool_init_resizable(const int32_t threads, const int32_t max_threads);
+
+extern void pool_destroy();
+
+// Threads of the pool, active or not. Thread numbers handed to
+// tasks are below it.
+extern int32_t pool_size();
+
+extern int32_t pool_active();
+
+extern bool pool_parked(const int32_t thread);
+
+// Sets the number of active threads, up to pool_size(), and returns
+// what it was set to
+extern int32_t pool_resize(const int32_t threads);
+
+extern void pool_parallel_for(const int32_t n_items, pool_task_t task, void * ctx);
@@ -0,0 +1,253 @@
+// Python binding for the C render engine. Renders run with the GIL
+// released and come back as a Field, which exposes the pixels
+// through the buffer protocol, so numpy.asarray(field) is a view
+// on the engine's memory without a copy.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <structmember.h>
+
+// Python asks for a newer POSIX level than the engine headers
+#undef _POSIX_C_SOURCE
+
+#include "mandelbrot.h"
+
+
+// The engine keeps its state in globals, so renders from several
+// Python threads take turns
+
+static pthread_mutex_t engine_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// Field: a rendered image owned by Python. Iteration counts are
+// int32 with shape (height, width), RGB is uint8 with shape
+// (height, width, 4) where the last byte is unused.
+
+typedef struct {
+  PyObject_HEAD
+  image_t * image;
+  int32_t width;
+  int32_t height;
+  int32_t iterations;
+  Py_ssize_t shape[3];
+  Py_ssize_t strides[3];
+} field_object_t;
+
+static void field_dealloc(PyObject * self)
+{
+  field_object_t * field = (field_object_t *) self;
+  image_destroy(field->image);
+  Py_TYPE(self)->tp_free(self);
+}
+
+static int field_getbuffer(PyObject * self, Py_buffer * view, int flags)
+{
+  field_object_t * field = (field_object_t *) self;
+  const int32_t rgb = field->image->mode == IMAGE_MODE_RGB;
+
+  view->obj = self;
+  Py_INCREF(self);
+  view->buf = field->image->pixels;
+  view->len = (Py_ssize_t) field->width * field->height * sizeof(union pixel);
+  view->readonly = 0;
+  view->itemsize = rgb ? 1 : sizeof(int32_t);
+  view->format = (flags & PyBUF_FORMAT) ? (rgb ? "B" : "i") : NULL;
+  view->ndim = rgb ? 3 : 2;
+  view->shape = (flags & PyBUF_ND) == PyBUF_ND ? field->shape : NULL;
+  view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? field->strides : NULL;
+  view->suboffsets = NULL;
+  view->internal = NULL;
+
+  return 0;
+}
+
+static PyBufferProcs field_as_buffer = {
+  .bf_getbuffer = field_getbuffer,
+};
+
+static PyMemberDef field_members[] = {
+  {"width", T_INT, offsetof(field_object_t, width), READONLY, "Width in pixels"},
+  {"height", T_INT, offsetof(field_object_t, height), READONLY, "Height in pixels"},
+  {"iterations", T_INT, offsetof(field_object_t, iterations), READONLY, "Iteration cap of the render"},
+  { 0 },
+};
+
+static PyTypeObject field_type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "_mandelbrot.Field",
+  .tp_doc = "Rendered pixels, use numpy.asarray() for a view without a copy",
+  .tp_basicsize = sizeof(field_object_t),
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_dealloc = field_dealloc,
+  .tp_as_buffer = &field_as_buffer,
+  .tp_members = field_members,
+};
+
+static PyObject * field_new(image_t * image, const int32_t iterations)
+{
+  field_object_t * field = PyObject_New(field_object_t, &field_type);
+  if (field == NULL) {
+    image_destroy(image);
+    return NULL;
+  }
+
+  field->image = image;
+  field->width = image->width;
+  field->height = image->height;
+  field->iterations = iterations;
+
+  const Py_ssize_t pixel = sizeof(union pixel);
+  field->shape[0] = image->height;
+  field->shape[1] = image->width;
+  field->shape[2] = 4;
+  field->strides[0] = pixel * image->width;
+  field->strides[1] = pixel;
+  field->strides[2] = 1;
+
+  return (PyObject *) field;
+}
+
+
+// render()
+
+static PyObject * mandelbrot_render(PyObject * module, PyObject * args, PyObject * kwargs)
+{
+  (void) module;
+
+  static char * keywords[] = {
+    "width", "iterations", "xmin", "xmax", "ymin", "ymax", "threads",
+    "supersampling", "power", "julia", "cx", "cy", "precision",
+    "coloring", "output", NULL,
+  };
+
+  args_t a;
+  memset(&a, 0, sizeof(a));
+  a.width = 300;
+  a.iterations = 100;
+  a.threads = 1;
+  a.progress_fd = -1;
+  a.supersampling = 1;
+  a.power = 2;
+  a.x_min = -2.5;
+  a.x_max = 1.0;
+  a.y_min = -1.0;
+  a.y_max = 1.0;
+  a.julia_x = -0.8;
+  a.julia_y = 0.156;
+
+  const char * precision = "auto";
+  const char * coloring = "bands";
+  const char * output = "iterations";
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|iiddddiiipddsss", keywords,
+        &a.width, &a.iterations, &a.x_min, &a.x_max, &a.y_min, &a.y_max,
+        &a.threads, &a.supersampling, &a.power, &a.julia, &a.julia_x, &a.julia_y,
+        &precision, &coloring, &output)) {
+    return NULL;
+  }
+
+  const int32_t rgb = strcmp(output, "rgb") == 0;
+  a.precision = kernel_precision_parse(precision);
+  a.coloring = colorize_mode_parse(coloring);
+
+  if (a.width < 1 || a.iterations < 0 || a.threads < 1) {
+    PyErr_SetString(PyExc_ValueError, "width and threads must be positive, iterations 0 (auto) or more");
+    return NULL;
+  }
+  if (a.supersampling < 1 || a.supersampling > 16) {
+    PyErr_SetString(PyExc_ValueError, "supersampling must be between 1 and 16");
+    return NULL;
+  }
+  if (a.power < KERNEL_MIN_POWER || a.power > KERNEL_MAX_POWER) {
+    PyErr_SetString(PyExc_ValueError, "power must be between 2 and 8");
+    return NULL;
+  }
+  if (!(a.x_max > a.x_min) || !(a.y_max > a.y_min)) {
+    PyErr_SetString(PyExc_ValueError, "xmax and ymax must be above xmin and ymin");
+    return NULL;
+  }
+  if (a.precision == KERNEL_PRECISION_INVALID) {
+    PyErr_SetString(PyExc_ValueError, "precision must be auto, float, double or long");
+    return NULL;
+  }
+  if (a.coloring == COLORIZE_INVALID) {
+    PyErr_SetString(PyExc_ValueError, "coloring must be bands or histogram");
+    return NULL;
+  }
+  if (!rgb && strcmp(output, "iterations") != 0) {
+    PyErr_SetString(PyExc_ValueError, "output must be iterations or rgb");
+    return NULL;
+  }
+
+  image_t * image = NULL;
+  int32_t iterations = 0;
+
+  Py_BEGIN_ALLOW_THREADS
+  pthread_mutex_lock(&engine_lock);
+
+  if (pool_size() != a.threads) {
+    pool_init(a.threads);
+  }
+
+  mandelbrot_init(&a);
+  iterations = n_iterations;
+
+  if (rgb) {
+    image = image_finish(mandelbrot_calculate(), a.supersampling, 0);
+  } else {
+    // The field moves out of the engine's cache to Python
+    image = cache_take(mandelbrot_calculate_iterations());
+  }
+
+  pthread_mutex_unlock(&engine_lock);
+  Py_END_ALLOW_THREADS
+
+  if (image == NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "render failed");
+    return NULL;
+  }
+
+  return field_new(image, iterations);
+}
+
+
+// Module
+
+static PyMethodDef mandelbrot_methods[] = {
+  {"render", (PyCFunction) (void (*)(void)) mandelbrot_render, METH_VARARGS | METH_KEYWORDS,
+    "render(width=300, iterations=100, xmin=-2.5, xmax=1.0, ymin=-1.0, ymax=1.0,\n"
+    "       threads=1, supersampling=1, power=2, julia=False, cx=-0.8, cy=0.156,\n"
+    "       precision='auto', coloring='bands', output='iterations') -> Field\n\n"
+    "Render a view with the C engine. output='iterations' gives the iteration\n"
+    "count of every sample (supersampled), output='rgb' the colored image."},
+  { 0 },
+};
+
+static struct PyModuleDef mandelbrot_module = {
+  PyModuleDef_HEAD_INIT,
+  .m_name = "_mandelbrot",
+  .m_doc = "The C render engine",
+  .m_size = -1,
+  .m_methods = mandelbrot_methods,
+};
+
+PyMODINIT_FUNC PyInit__mandelbrot(void)
+{
+  if (PyType_Ready(&field_type) < 0) {
+    return NULL;
+  }
+
+  PyObject * module = PyModule_Create(&mandelbrot_module);
+  if (module == NULL) {
+    return NULL;
+  }
+
+  Py_INCREF(&field_type);
+  if (PyModule_AddObject(module, "Field", (PyObject *) &field_type) < 0) {
+    Py_DECREF(&field_type);
+    Py_DECREF(module);
+    return NULL;
+  }
+
+  return module;
+}
@@ -1,7 +1,7 @@
 """Render the mandelbrot set.
 
 Usage:
-    mandelbrot.py <filename> [--width=<w>] [--supersample=<s>] [--processes=<p>] [--iterations=<i>] [--xmin=<n>] [--xmax=<n>] [--ymin=<n>] [--ymax=<n>] [--colorize] [--zx=<N>] [--zy=<N>]
+    mandelbrot.py <filename> [--width=<w>] [--supersample=<s>] [--processes=<p>] [--iterations=<i>] [--xmin=<n>] [--xmax=<n>] [--ymin=<n>] [--ymax=<n>] [--colorize] [--zx=<N>] [--zy=<N>] [--engine=<e>]
 
 Options:
     -h --help          Show this screen
@@ -15,11 +15,12 @@ Options:
     --ymax=<n>         Maximum Y [default:  1.0]
     --zx=<n>           Starting point for zx in the equation [default: 0.0]
     --zy=<n>           Starting point for zy in the equation [default: 0.0]
+    --engine=<e>       Solve with the c extension, numpy or python [default: c]
 """
 import math
 from functools import partial
 from itertools import product
-from multiprocessing import Pool
+from multiprocessing import Pool, shared_memory
 
 from docopt import docopt
 from PIL import Image
@@ -27,6 +28,16 @@ from progress.bar import ChargingBar
 
 from colors import COLORIZE_FUNCTIONS
 
+try:
+    import numpy as np
+except ImportError:
+    np = None
+
+try:
+    import _mandelbrot
+except ImportError:
+    _mandelbrot = None
+
 
 # Constants
 X_MIN = -2.5
@@ -67,6 +78,61 @@ def solve(cx, cy, iterations=512):
     return iterations
 
 
+def solve_tile(cx, cy, iterations=512):
+    """Vectorized solve() for arrays of points. Points are dropped from the
+    working arrays as they escape, so every step only costs as much as the
+    points still inside."""
+    out = np.full(cx.shape, iterations, dtype=np.int32)
+    flat = out.reshape(-1)
+
+    index = np.arange(cx.size)
+    cx = cx.reshape(-1)
+    cy = cy.reshape(-1)
+    x = np.full(cx.size, init_x)
+    y = np.full(cx.size, init_y)
+
+    for i in range(iterations):
+        x2 = x * x
+        y2 = y * y
+        escaped = x2 + y2 > 4
+        if escaped.any():
+            flat[index[escaped]] = i
+            inside = ~escaped
+            index, cx, cy = index[inside], cx[inside], cy[inside]
+            x, y, x2, y2 = x[inside], y[inside], x2[inside], y2[inside]
+            if index.size == 0:
+                break
+        y = 2 * x * y + cy
+        x = x2 - y2 + cx
+
+    return out
+
+
+# Rows per tile for the numpy renderer
+TILE_ROWS = 16
+
+
+def process_tile(rows, view=None, shm_name=None, iterations=None):
+    x_min, x_range, y_min, y_range, width, height = view
+    y0, y1 = rows
+
+    # Pixel centers, as in pixel_to_coordinate()
+    px = np.arange(width) + 0.5
+    py = np.arange(y0, y1) + 0.5
+    cx = x_min + (px / width) * x_range
+    cy = y_min + ((height - py) / height) * y_range
+    cx, cy = np.meshgrid(cx, cy)
+
+    # Write straight into the image shared by all workers
+    shm = shared_memory.SharedMemory(name=shm_name)
+    field = np.ndarray((height, width), dtype=np.int32, buffer=shm.buf)
+    field[y0:y1] = solve_tile(cx, cy, iterations=iterations)
+    del field
+    shm.close()
+
+    return y1 - y0
+
+
 def process_pixel(pixel, width=None, height=None, iterations=None):
     px, py = pixel
     x, y = pixel_to_coordinate(px, py, width=width, height=height)
@@ -118,6 +184,89 @@ def mandelbrot(
     return image
 
 
+def colorize_field(values, iterations):
+    """Colors for a whole field of iteration counts at once, through a
+    palette with one color per iteration count."""
+    palette = np.array(
+        [colorize(v, iterations=iterations) for v in range(iterations + 1)],
+        dtype=np.uint8
+    )
+    return Image.fromarray(palette[values], 'RGB')
+
+
+def mandelbrot_numpy(
+        width,
+        height,
+        iterations=1024,
+        processes=1,
+        supersample=1,
+        progress=False):
+    """Same as mandelbrot(), solving tiles of rows with numpy. Workers write
+    the iteration counts into shared memory, so only the tile bounds pass
+    between processes."""
+
+    if supersample > 1:
+        width *= supersample
+        height *= supersample
+
+    size = width * height * np.dtype(np.int32).itemsize
+    shm = shared_memory.SharedMemory(create=True, size=size)
+
+    try:
+        view = (X_MIN, X_RANGE, Y_MIN, Y_RANGE, width, height)
+        tiles = [(y, min(y + TILE_ROWS, height)) for y in range(0, height, TILE_ROWS)]
+
+        if progress:
+            progress = ChargingBar("Rendering Mandelbrot set", max=len(tiles))
+
+        with Pool(processes) as pool:
+            done = pool.imap_unordered(
+                partial(process_tile, view=view, shm_name=shm.name, iterations=iterations),
+                tiles
+            )
+            for _ in done:
+                if progress:
+                    progress.next()
+
+        if progress:
+            progress.finish()
+
+        field = np.ndarray((height, width), dtype=np.int32, buffer=shm.buf)
+        image = colorize_field(field, iterations)
+        del field
+    finally:
+        shm.close()
+        shm.unlink()
+
+    if supersample > 1:
+        image = image.resize((width // supersample, height // supersample))
+
+    return image
+
+
+def mandelbrot_native(
+        width,
+        iterations=1024,
+        processes=1,
+        supersample=1):
+    """Same as mandelbrot(), with the iteration counts from the C engine
+    (see setup.py). The counts are a numpy view on the engine's buffer."""
+
+    field = _mandelbrot.render(
+        width=width * supersample,
+        iterations=iterations,
+        xmin=X_MIN,
+        xmax=X_MAX,
+        ymin=Y_MIN,
+        ymax=Y_MAX,
+        threads=processes,
+    )
+    image = colorize_field(np.asarray(field), iterations)
+
+    if supersample > 1:
+        image = image.resize((field.width // supersample, field.height // supersample))
+
+    return image
 
 
 if __name__ == '__main__':
@@ -129,6 +278,7 @@ if __name__ == '__main__':
     supersample = int(args['--supersample'], 10)
     processes = int(args['--processes'], 10)
     iterations = int(args['--iterations'], 10)
+    engine = args['--engine']
 
     init_x = float(args['--zx'])
     init_y = float(args['--zy'])
@@ -149,13 +299,40 @@ if __name__ == '__main__':
     print(f"xmin={X_MIN}, xmax={X_MAX}")
     print(f"xmin={Y_MIN}, xmax={Y_MAX}")
 
+    # The C engine always starts at z = 0
+    if engine == 'c' and (init_x != 0 or init_y != 0):
+        engine = 'numpy'
+    if engine == 'c' and (_mandelbrot is None or np is None):
+        print("C extension not built (python3 setup.py build_ext --inplace), solving with numpy")
+        engine = 'numpy'
+    if engine == 'numpy' and np is None:
+        print("numpy not installed, solving in python")
+        engine = 'python'
+
     with open(filename, 'wb') as f:
-        image = mandelbrot(
-            width,
-            height,
-            iterations=iterations,
-            supersample=supersample,
-            processes=processes,
-            progress=True
-        )
+        if engine == 'c':
+            image = mandelbrot_native(
+                width,
+                iterations=iterations,
+                supersample=supersample,
+                processes=processes
+            )
+        elif engine == 'numpy':
+            image = mandelbrot_numpy(
+                width,
+                height,
+                iterations=iterations,
+                supersample=supersample,
+                processes=processes,
+                progress=True
+            )
+        else:
+            image = mandelbrot(
+                width,
+                height,
+                iterations=iterations,
+                supersample=supersample,
+                processes=processes,
+                progress=True
+            )
         image.save(f, format='png')
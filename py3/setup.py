@@ -0,0 +1,34 @@
+"""Build the C engine binding in place:
+
+    python3 setup.py build_ext --inplace
+"""
+from setuptools import Extension, setup
+
+
+ENGINE = [
+    'buddha.c',
+    'cache.c',
+    'colors.c',
+    'image.c',
+    'kernel.c',
+    'mandelbrot.c',
+    'perf.c',
+    'pool.c',
+    'state.c',
+    'stats.c',
+    'trace.c',
+    'utils.c',
+]
+
+setup(
+    name='mandelbrot',
+    ext_modules=[
+        Extension(
+            '_mandelbrot',
+            sources=['_mandelbrot.c'] + ['../' + source for source in ENGINE],
+            include_dirs=['..'],
+            libraries=['m', 'pthread', 'png'],
+            extra_compile_args=['-std=c11', '-O3', '-DINFO'],
+        ),
+    ],
+)
@@ -0,0 +1,265 @@
+#include "pyramid.h"
+
+
+typedef struct {
+  args_t args;        // View of the base level, with the cap and precision fixed
+  int32_t tile;
+  int32_t indexed;    // Tiles are quantized when written
+  int32_t depth;      // Index of the base level, level 0 is 1x1
+  int32_t width;      // Size of the base level
+  int32_t height;
+  double dx;          // Pixel size at the base level
+  double dy;
+  char * directory;
+  int64_t tiles;
+  double render_seconds;
+  int32_t failed;
+} pyramid_t;
+
+
+// Every level is half the size of the one below, rounded up
+
+static void _pyramid_size(const pyramid_t * p, const int32_t level, int32_t * w, int32_t * h)
+{
+  *w = p->width;
+  *h = p->height;
+  for (int32_t l = p->depth; l > level; l--) {
+    *w = (*w + 1) / 2;
+    *h = (*h + 1) / 2;
+  }
+}
+
+
+// Base tiles. Each is rendered as a view of its own, through the
+// same steps as a full image, with the pixel centers of the base
+// level.
+
+static image_t * _pyramid_render(pyramid_t * p, const int32_t col, const int32_t row,
+    const int32_t tw, const int32_t th)
+{
+  args_t a = p->args;
+  a.width = tw;
+  a.height = th;
+  a.x_min = p->args.x_min + (double) col * p->tile * p->dx;
+  a.x_max = a.x_min + tw * p->dx;
+  a.y_max = p->args.y_max - (double) row * p->tile * p->dy;
+  a.y_min = a.y_max - th * p->dy;
+
+  mandelbrot_init(&a);
+  image_t * img = mandelbrot_calculate();
+  p->render_seconds += stats.render_seconds;
+
+  return image_finish(img, a.supersampling, a.gamma);
+}
+
+
+// Coarser tiles. The (up to) four tiles below are put together and
+// halved. A level with an odd size ends in half a pixel, the last
+// column or row is repeated to fill it.
+
+static image_t * _pyramid_merge(image_t * children[4], const int32_t tw, const int32_t th,
+    const int32_t tile, const int32_t gamma)
+{
+  image_t * canvas = image_new(2 * tw, 2 * th, IMAGE_MODE_RGB);
+  int32_t cw = 0;
+  int32_t ch = 0;
+
+  for (int32_t k = 0; k < 4; k++) {
+    const image_t * child = children[k];
+    if (child == NULL) {
+      continue;
+    }
+
+    const int32_t ox = (k & 1) * tile;
+    const int32_t oy = (k >> 1) * tile;
+    for (int32_t y = 0; y < child->height; y++) {
+      memcpy(&canvas->pixels[(oy + y) * canvas->width + ox], &child->pixels[y * child->width],
+          sizeof(union pixel) * child->width);
+    }
+
+    cw = ox + child->width > cw ? ox + child->width : cw;
+    ch = oy + child->height > ch ? oy + child->height : ch;
+  }
+
+  if (cw < canvas->width) {
+    for (int32_t y = 0; y < ch; y++) {
+      canvas->pixels[y * canvas->width + cw] = canvas->pixels[y * canvas->width + cw - 1];
+    }
+  }
+  if (ch < canvas->height) {
+    memcpy(&canvas->pixels[ch * canvas->width], &canvas->pixels[(ch - 1) * canvas->width],
+        sizeof(union pixel) * canvas->width);
+  }
+
+  image_t * out = image_downscale(canvas, 2, gamma);
+  image_destroy(canvas);
+
+  return out;
+}
+
+
+// Returns the tile, after writing it, or NULL where the level has
+// no such tile
+
+static image_t * _pyramid_tile(pyramid_t * p, const int32_t level, const int32_t col, const int32_t row)
+{
+  int32_t w, h;
+  _pyramid_size(p, level, &w, &h);
+
+  if (p->failed || col * p->tile >= w || row * p->tile >= h) {
+    return NULL;
+  }
+
+  const int32_t tw = w - col * p->tile < p->tile ? w - col * p->tile : p->tile;
+  const int32_t th = h - row * p->tile < p->tile ? h - row * p->tile : p->tile;
+
+  const int64_t begin = trace_begin();
+  image_t * tile = NULL;
+
+  if (level == p->depth) {
+    tile = _pyramid_render(p, col, row, tw, th);
+  } else {
+    image_t * children[4];
+    for (int32_t k = 0; k < 4; k++) {
+      children[k] = _pyramid_tile(p, level + 1, 2 * col + (k & 1), 2 * row + (k >> 1));
+    }
+
+    if (!p->failed) {
+      tile = _pyramid_merge(children, tw, th, p->tile, p->args.gamma);
+    }
+
+    for (int32_t k = 0; k < 4; k++) {
+      image_destroy(children[k]);
+    }
+  }
+
+  if (tile == NULL) {
+    return NULL;
+  }
+
+  const size_t length = strlen(p->directory) + 48;
+  char * filename = mem_alloc(length);
+  snprintf(filename, length, "%s/%d/%d_%d.png", p->directory, level, col, row);
+
+  image_t * out = p->indexed ? image_quantize(tile) : tile;
+  if (image_write_png(out, filename) != 0) {
+    critical("failed to write tile '%s'\n", filename);
+    p->failed = 1;
+  }
+  p->tiles++;
+
+  if (out != tile) {
+    image_destroy(out);
+  }
+  mem_free(filename);
+
+  trace_end(level == p->depth ? "tile" : "merge", "phase", begin, -1);
+
+  return tile;
+}
+
+
+// The descriptor that viewers load
+
+static int32_t _pyramid_write_dzi(const pyramid_t * p, const char * filename)
+{
+  FILE * fp = fopen(filename, "w");
+  if (!fp) {
+    critical("failed to open file '%s' in write mode\n", filename);
+    return 2;
+  }
+
+  fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+  fprintf(fp, "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\"\n");
+  fprintf(fp, "  TileSize=\"%d\" Overlap=\"0\" Format=\"png\">\n", p->tile);
+  fprintf(fp, "  <Size Width=\"%d\" Height=\"%d\"/>\n", p->width, p->height);
+  fprintf(fp, "</Image>\n");
+
+  return fclose(fp) == 0 ? 0 : 2;
+}
+
+
+int32_t pyramid_write(const args_t * args, const char * filename)
+{
+  if (args->buddhabrot > 0) {
+    critical("--pyramid can not be combined with --buddhabrot\n");
+    return 1;
+  }
+
+  pyramid_t p;
+  memset(&p, 0, sizeof(p));
+  p.args = *args;
+  p.tile = args->pyramid;
+  p.indexed = args->indexed;
+  p.args.indexed = 0;
+
+  // Tiles are colored on their own, so only coloring that does not
+  // depend on the rest of the image can be used
+  if (p.args.coloring == COLORIZE_HISTOGRAM) {
+    error("--coloring=histogram does not apply to --pyramid, using bands\n");
+    p.args.coloring = COLORIZE_BANDS;
+  }
+  if (p.args.state != NULL) {
+    error("--state does not apply to --pyramid, ignoring it\n");
+    p.args.state = NULL;
+  }
+
+  // Settle the size, cap and precision for the whole view, so that
+  // all the tiles agree
+  mandelbrot_init(&p.args);
+
+  p.width = width / supersampling;
+  p.height = height / supersampling;
+  p.dx = x_range / p.width;
+  p.dy = y_range / p.height;
+  p.args.iterations = n_iterations;
+  p.args.precision = kernel->precision;
+  p.args.progress = 0;
+  p.args.progress_fd = -1;
+  p.args.verbose = 0;
+
+  for (int32_t size = p.width > p.height ? p.width : p.height; size > 1; size = (size + 1) / 2) {
+    p.depth++;
+  }
+
+  // NAME.dzi -> NAME_files/
+  const size_t length = strlen(filename) + 8;
+  p.directory = mem_alloc(length);
+  snprintf(p.directory, length, "%s", filename);
+  char * extension = strrchr(p.directory, '.');
+  if (extension != NULL && strcmp(extension, ".dzi") == 0) {
+    *extension = '\0';
+  }
+  strcat(p.directory, "_files");
+
+  char * level = mem_alloc(length + 16);
+  int32_t status = mkdir(p.directory, 0755) != 0 && errno != EEXIST;
+  for (int32_t l = 0; l <= p.depth && !status; l++) {
+    snprintf(level, length + 16, "%s/%d", p.directory, l);
+    status = mkdir(level, 0755) != 0 && errno != EEXIST;
+  }
+  mem_free(level);
+
+  if (status) {
+    critical("failed to create the tile directories in '%s'\n", p.directory);
+    mem_free(p.directory);
+    return 2;
+  }
+
+  const double started = stats_now();
+
+  image_destroy(_pyramid_tile(&p, 0, 0, 0));
+
+  status = p.failed ? 2 : _pyramid_write_dzi(&p, filename);
+
+  info("Pyramid: %ld tiles in %d levels in %.2fs, %.2fs of it rendering the base\n",
+      (long) p.tiles, p.depth + 1, stats_now() - started, p.render_seconds);
+
+  stats.width = p.width;
+  stats.height = p.height;
+  stats.render_seconds = p.render_seconds;
+
+  mem_free(p.directory);
+
+  return status;
+}
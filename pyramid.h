@@ -0,0 +1,26 @@
+#pragma once
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "mandelbrot.h"
+
+
+// Deep Zoom (DZI) pyramid of a view. Only the deepest level is
+// rendered, in tiles, and every coarser tile is the four tiles
+// below it downscaled by two. The quadtree is walked depth first,
+// so tiles are written as soon as they are finished and only a few
+// per level are held in memory at any time.
+//
+// For NAME.dzi the tiles go to NAME_files/LEVEL/COLUMN_ROW.png,
+// and NAME.dzi is written last, once the pyramid is complete.
+
+#define PYRAMID_DEFAULT_TILE_SIZE 256
+#define PYRAMID_MIN_TILE_SIZE 16
+#define PYRAMID_MAX_TILE_SIZE 4096
+
+
+// Renders the view of args at args->width as the base level, with
+// tiles of args->pyramid pixels. Returns 0 on success.
+extern int32_t pyramid_write(const args_t * args, const char * filename);
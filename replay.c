@@ -0,0 +1,495 @@
+#include "autotune.h"
+#include "batch.h"
+#include "mandelbrot.h"
+
+#include <argp.h>
+#include <sys/resource.h>
+
+
+// Replays a recorded session of view requests through the engine,
+// to see how it holds up under a mix of pans and zooms from many
+// users rather than a single image. Every line of the session is a
+// --batch job without an output, with "t" for the seconds since the
+// start of the recording:
+//
+//   {"t": 0.25, "width": 800, "iterations": 500, "xmin": -0.75, ...}
+//
+// Clients take the requests in order. Each waits until its request
+// is due, at its "t" scaled by --speed or at --rate requests a
+// second, and then renders and colors it. The engine works on one
+// view at a time with the whole pool, so requests in flight queue
+// for it. The latency of a request counts from when it was due to
+// when its image is done, so the time spent waiting is part of it.
+
+#define REPLAY_DEFAULT_CLIENTS 4
+
+typedef struct {
+  args_t args;
+  double at;        // Seconds after the start it is due, -1 if not given
+  double due;
+  double started;   // When the engine took it
+  double finished;
+} replay_request_t;
+
+typedef struct {
+  replay_request_t * requests;
+  int64_t n;
+  atomic_int_fast64_t next;
+  int32_t paced;
+  int32_t prefetch;
+  double started;
+  pthread_mutex_t engine;
+} replay_t;
+
+typedef struct {
+  char * session;
+  char * stats;
+  char * profile;
+  int32_t clients;
+  double rate;
+  double speed;
+  int32_t threads;
+  int32_t rows;
+  int32_t variant;
+  int32_t prefetch;
+} replay_args_t;
+
+
+// Clients
+
+static void _replay_sleep_until(const double when)
+{
+  const double wait = when - stats_now();
+  if (wait <= 0) {
+    return;
+  }
+
+  struct timespec ts;
+  ts.tv_sec = (time_t) wait;
+  ts.tv_nsec = (long) ((wait - (double) ts.tv_sec) * 1e9);
+  while (nanosleep(&ts, &ts) != 0) {
+  }
+}
+
+static void * _replay_client(void * ptr)
+{
+  replay_t * r = ptr;
+  int64_t k;
+
+  while ((k = atomic_fetch_add(&r->next, 1)) < r->n) {
+    replay_request_t * q = &r->requests[k];
+
+    // Without a schedule the clients go as fast as the engine lets
+    // them, each with one request at a time
+    q->due = r->paced ? r->started + q->due : stats_now();
+    _replay_sleep_until(q->due);
+
+    pthread_mutex_lock(&r->engine);
+
+    q->started = stats_now();
+    mandelbrot_init(&q->args);
+    image_t * img = image_finish(mandelbrot_calculate(), q->args.supersampling, q->args.gamma);
+    if (r->prefetch) {
+      mandelbrot_prefetch();
+    }
+
+    pthread_mutex_unlock(&r->engine);
+
+    q->finished = stats_now();
+    image_destroy(img);
+  }
+
+  return NULL;
+}
+
+
+// Report
+
+static int _replay_compare(const void * a, const void * b)
+{
+  const double x = *(const double *) a;
+  const double y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+// Nearest rank percentile of sorted values
+static double _replay_percentile(const double * sorted, const int64_t n, const double p)
+{
+  int64_t rank = (int64_t) ceil(p / 100.0 * (double) n);
+  rank = rank < 1 ? 1 : rank > n ? n : rank;
+  return sorted[rank - 1];
+}
+
+typedef struct {
+  double p50;
+  double p90;
+  double p99;
+  double p999;
+  double max;
+  double mean;
+} replay_summary_t;
+
+static replay_summary_t _replay_summary(double * values, const int64_t n)
+{
+  qsort(values, n, sizeof(double), _replay_compare);
+
+  replay_summary_t s;
+  s.p50 = _replay_percentile(values, n, 50.0);
+  s.p90 = _replay_percentile(values, n, 90.0);
+  s.p99 = _replay_percentile(values, n, 99.0);
+  s.p999 = _replay_percentile(values, n, 99.9);
+  s.max = values[n - 1];
+  s.mean = 0.0;
+  for (int64_t i = 0; i < n; i++) {
+    s.mean += values[i] / (double) n;
+  }
+  return s;
+}
+
+static void _replay_print(const char * label, const replay_summary_t * s)
+{
+  printf("[replay] %-8s p50 %9.2f ms, p90 %9.2f ms, p99 %9.2f ms, p99.9 %9.2f ms, max %9.2f ms, mean %9.2f ms\n",
+      label, 1e3 * s->p50, 1e3 * s->p90, 1e3 * s->p99, 1e3 * s->p999, 1e3 * s->max, 1e3 * s->mean);
+}
+
+static void _replay_json(FILE * fp, const char * label, const replay_summary_t * s, const int32_t last)
+{
+  fprintf(fp, "  \"%s\": {\"p50\": %.6f, \"p90\": %.6f, \"p99\": %.6f, \"p99.9\": %.6f, "
+      "\"max\": %.6f, \"mean\": %.6f}%s\n",
+      label, s->p50, s->p90, s->p99, s->p999, s->max, s->mean, last ? "" : ",");
+}
+
+
+// Parameter parsing using argp
+
+enum replay_keys {
+  CLIENTS_KEY = 'c',
+  RATE_KEY = 'r',
+  THREADS_KEY = 't',
+  SPEED_KEY = 0x00100000,
+  ROWS_KEY = 0x00100001,
+  KERNEL_KEY = 0x00100002,
+  PREFETCH_KEY = 0x00100003,
+  STATS_KEY = 0x00100004,
+  PROFILE_KEY = 0x00100005,
+};
+
+const char * argp_program_version = "mandelbrot-replay v0.1";
+static char doc [] = "Replay a session of view requests through the engine and report the latencies.";
+static char args_doc [] = "SESSION.jsonl";
+
+static struct argp_option options [] = {
+  {"clients", CLIENTS_KEY, "N", 0, "Requests in flight at most [default: 4]", -1},
+  {"rate", RATE_KEY, "R", 0, "Send R requests a second instead of at their \"t\"", -1},
+  {"speed", SPEED_KEY, "X", 0, "Play the \"t\" of the session X times as fast [default: 1]", -1},
+  {"threads", THREADS_KEY, "NTHREADS", 0, "Set number of engine threads [default: profile, or 1]", -1},
+  {"rows", ROWS_KEY, "N", 0, "Rows a thread takes at a time [default: profile, or 1]", -1},
+  {"kernel", KERNEL_KEY, "K", 0, "Use auto, scalar or lanes kernels [default: profile, or auto]", -1},
+  {"prefetch", PREFETCH_KEY, 0, 0, "Prefetch the neighbouring views between requests", -1},
+  {"stats", STATS_KEY, "FILE", 0, "Write the report as JSON to FILE", -1},
+  {"profile", PROFILE_KEY, "FILE", 0, "Load the --autotune settings from FILE", -1},
+  { 0 },
+};
+
+static error_t parse_opt(int32_t key, char * arg, struct argp_state * state) {
+  replay_args_t * args = state->input;
+
+  switch (key) {
+    case CLIENTS_KEY:
+      args->clients = atoi(arg);
+      if (args->clients < 1) {
+        critical("Provide an integer to --clients higher or equal to 1\n");
+        argp_usage(state);
+      }
+      break;
+
+    case RATE_KEY:
+      args->rate = strtod(arg, NULL);
+      if (!(args->rate > 0)) {
+        critical("Provide a positive number of requests a second to --rate\n");
+        argp_usage(state);
+      }
+      break;
+
+    case SPEED_KEY:
+      args->speed = strtod(arg, NULL);
+      if (!(args->speed > 0)) {
+        critical("Provide a positive factor to --speed\n");
+        argp_usage(state);
+      }
+      break;
+
+    case THREADS_KEY:
+      args->threads = atoi(arg);
+      if (args->threads < 1) {
+        critical("Provide an integer to --threads higher or equal to 1\n");
+        argp_usage(state);
+      }
+      break;
+
+    case ROWS_KEY:
+      args->rows = atoi(arg);
+      if (args->rows < 1) {
+        critical("Provide an integer to --rows higher or equal to 1\n");
+        argp_usage(state);
+      }
+      break;
+
+    case KERNEL_KEY:
+      args->variant = kernel_variant_parse(arg);
+      if (args->variant == KERNEL_VARIANT_INVALID) {
+        critical("Provide auto, scalar or lanes to --kernel\n");
+        argp_usage(state);
+      }
+      break;
+
+    case PREFETCH_KEY:
+      args->prefetch = 1;
+      break;
+
+    case STATS_KEY:
+      args->stats = arg;
+      break;
+
+    case PROFILE_KEY:
+      args->profile = arg;
+      break;
+
+    case ARGP_KEY_ARG:
+      if (state->arg_num >= 1) {
+        // Provide exactly one session
+        argp_usage(state);
+      }
+      args->session = arg;
+      break;
+
+    case ARGP_KEY_END:
+      if (state->arg_num != 1) {
+        argp_usage(state);
+      }
+      break;
+
+    default:
+      return ARGP_ERR_UNKNOWN;
+  }
+
+  return 0;
+}
+
+
+// Requests start from the defaults of the command line tool
+
+static void _replay_defaults(args_t * a, const replay_args_t * arguments)
+{
+  memset(a, 0, sizeof(*a));
+  a->width = 300;
+  a->iterations = 100;
+  a->threads = arguments->threads;
+  a->rows = arguments->rows;
+  a->variant = arguments->variant;
+  a->supersampling = 1;
+  a->power = 2;
+  a->precision = KERNEL_PRECISION_AUTO;
+  a->progress_fd = -1;
+  a->coloring = COLORIZE_BANDS;
+  a->x_min = -2.5;
+  a->x_max = 1.0;
+  a->y_min = -1.0;
+  a->y_max = 1.0;
+  a->julia_x = -0.8;
+  a->julia_y = 0.156;
+}
+
+static int64_t _replay_load(const char * session, const replay_args_t * arguments, replay_request_t ** requests)
+{
+  const int32_t from_stdin = strcmp(session, "-") == 0;
+  FILE * in = from_stdin ? stdin : fopen(session, "r");
+  if (!in) {
+    critical("failed to open file '%s' in read mode\n", session);
+    return -1;
+  }
+
+  char * line = NULL;
+  size_t size = 0;
+  int64_t n = 0;
+  int64_t allocated = 0;
+  int64_t number = 0;
+
+  while (batch_read_line(in, &line, &size) != NULL)
+  {
+    number++;
+    if (line[strspn(line, " \t\r")] == '\0') {
+      continue;
+    }
+
+    if (n == allocated) {
+      allocated = allocated ? 2 * allocated : 1024;
+      *requests = mem_realloc(*requests, sizeof(replay_request_t) * allocated);
+    }
+
+    replay_request_t * q = &(*requests)[n];
+    memset(q, 0, sizeof(*q));
+    _replay_defaults(&q->args, arguments);
+    q->at = -1.0;
+
+    char * output = NULL;
+    const char * message = batch_parse(line, &q->args, &output, &q->at);
+    if (message != NULL) {
+      error("Line %ld: %s, skipping it\n", (long) number, message);
+      continue;
+    }
+    if (output != NULL) {
+      debug("Line %ld: ignoring \"output\"\n", (long) number);
+    }
+
+    // Nothing but the render is measured
+    q->args.filename = NULL;
+    q->args.state = NULL;
+    n++;
+  }
+
+  mem_free(line);
+  if (!from_stdin) {
+    fclose(in);
+  }
+
+  return n;
+}
+
+
+int main(int argc, char ** argv) {
+  replay_args_t arguments;
+  memset(&arguments, 0, sizeof(arguments));
+  arguments.clients = REPLAY_DEFAULT_CLIENTS;
+  arguments.speed = 1.0;
+  arguments.variant = KERNEL_VARIANT_INVALID;
+
+  static struct argp argp = { options, parse_opt, args_doc, doc, NULL, NULL, NULL };
+  argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+  // The engine settings not given come from the profile of this
+  // host, the same as for the command line tool
+  char profile[AUTOTUNE_PATH_SIZE];
+  if (arguments.profile != NULL) {
+    snprintf(profile, sizeof(profile), "%s", arguments.profile);
+  } else if (autotune_profile_path(profile, sizeof(profile)) != 0) {
+    profile[0] = '\0';
+  }
+
+  autotune_profile_t tuned = { 1, 1, KERNEL_VARIANT_AUTO };
+  if (profile[0] != '\0' && autotune_load(profile, &tuned) == 0) {
+    info("Loaded the settings in '%s'\n", profile);
+  }
+  arguments.threads = arguments.threads ? arguments.threads : tuned.threads;
+  arguments.rows = arguments.rows ? arguments.rows : tuned.rows;
+  arguments.variant = arguments.variant != KERNEL_VARIANT_INVALID ? arguments.variant : tuned.variant;
+
+  replay_t r;
+  memset(&r, 0, sizeof(r));
+  r.n = _replay_load(arguments.session, &arguments, &r.requests);
+  if (r.n <= 0) {
+    critical("No requests to replay in '%s'\n", arguments.session);
+    mem_free(r.requests);
+    return r.n < 0 ? 2 : 1;
+  }
+
+  // When every request is due: at a fixed rate, at the times in the
+  // session (a request without one goes with the one before), or as
+  // soon as a client is free
+  r.paced = arguments.rate > 0;
+  double at = 0.0;
+  for (int64_t k = 0; k < r.n; k++) {
+    replay_request_t * q = &r.requests[k];
+    r.paced |= q->at >= 0;
+    at = q->at >= 0 ? q->at : at;
+    q->due = arguments.rate > 0 ? (double) k / arguments.rate : at / arguments.speed;
+  }
+  r.prefetch = arguments.prefetch;
+  atomic_store(&r.next, 0);
+  pthread_mutex_init(&r.engine, NULL);
+
+  pool_init(arguments.threads);
+
+  pthread_t * clients = mem_alloc(sizeof(pthread_t) * arguments.clients);
+  r.started = stats_now();
+
+  for (int32_t i = 0; i < arguments.clients; i++) {
+    if (pthread_create(&clients[i], NULL, _replay_client, &r) != 0) {
+      critical("Failed to create client thread %d\n", i);
+      exit(1);
+    }
+  }
+  for (int32_t i = 0; i < arguments.clients; i++) {
+    pthread_join(clients[i], NULL);
+  }
+
+  const double seconds = stats_now() - r.started;
+
+  mandelbrot_cleanup();
+  pool_destroy();
+  pthread_mutex_destroy(&r.engine);
+  mem_free(clients);
+
+  // Latency from due to done, of which the engine took service and
+  // the rest was spent waiting for it
+  double * latency = mem_alloc(sizeof(double) * r.n);
+  double * service = mem_alloc(sizeof(double) * r.n);
+  double * waiting = mem_alloc(sizeof(double) * r.n);
+  int64_t pixels = 0;
+
+  for (int64_t k = 0; k < r.n; k++) {
+    const replay_request_t * q = &r.requests[k];
+    latency[k] = q->finished - q->due;
+    service[k] = q->finished - q->started;
+    waiting[k] = q->started - q->due;
+    pixels += (int64_t) q->args.width * (q->args.height > 0 ? q->args.height : round(
+      (double) q->args.width * (q->args.y_max - q->args.y_min) / (q->args.x_max - q->args.x_min)));
+  }
+
+  const replay_summary_t l = _replay_summary(latency, r.n);
+  const replay_summary_t s = _replay_summary(service, r.n);
+  const replay_summary_t w = _replay_summary(waiting, r.n);
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  const double peak = (double) usage.ru_maxrss / 1024.0;
+
+  printf("[replay] %ld requests in %.2fs, %.2f requests/s, %.2f Mpixels/s, %d clients, %d threads, %s\n",
+      (long) r.n, seconds, (double) r.n / seconds, 1e-6 * (double) pixels / seconds,
+      arguments.clients, arguments.threads,
+      arguments.rate > 0 ? "fixed rate" : r.paced ? "session times" : "back to back");
+  _replay_print("latency", &l);
+  _replay_print("service", &s);
+  _replay_print("waiting", &w);
+  printf("[replay] memory high-water mark %.1f MB\n", peak);
+
+  int32_t status = 0;
+  if (arguments.stats != NULL) {
+    FILE * fp = fopen(arguments.stats, "w");
+    if (!fp) {
+      critical("failed to open file '%s' in write mode\n", arguments.stats);
+      status = 2;
+    } else {
+      fprintf(fp, "{\n");
+      fprintf(fp, "  \"requests\": %ld,\n", (long) r.n);
+      fprintf(fp, "  \"seconds\": %.6f,\n", seconds);
+      fprintf(fp, "  \"requests_per_second\": %.3f,\n", (double) r.n / seconds);
+      fprintf(fp, "  \"pixels_per_second\": %.1f,\n", (double) pixels / seconds);
+      fprintf(fp, "  \"clients\": %d,\n", arguments.clients);
+      fprintf(fp, "  \"threads\": %d,\n", arguments.threads);
+      fprintf(fp, "  \"max_rss_bytes\": %ld,\n", (long) usage.ru_maxrss * 1024);
+      _replay_json(fp, "latency", &l, 0);
+      _replay_json(fp, "service", &s, 0);
+      _replay_json(fp, "waiting", &w, 1);
+      fprintf(fp, "}\n");
+      status = fclose(fp) == 0 ? 0 : 2;
+    }
+  }
+
+  mem_free(latency);
+  mem_free(service);
+  mem_free(waiting);
+  mem_free(r.requests);
+
+  return status;
+}
@@ -0,0 +1,277 @@
+#include "resize.h"
+
+#include <unistd.h>
+
+
+// Global state: The thread following the sources
+
+static pthread_t resize_thread;
+static bool resize_running = false;
+static atomic_int resize_stopping;
+
+// Threads added by SIGUSR1 less those removed by SIGUSR2, since the
+// last look. Signals still pending when the same one comes again
+// count once.
+static atomic_int resize_signals;
+
+// A "threads N at R" line of the control file, applied by the render
+// itself once it has solved R rows, and the N it applied
+static atomic_llong resize_at_row;
+static atomic_int resize_at_threads;
+static atomic_int resize_applied;
+
+static struct sigaction resize_old_usr1;
+static struct sigaction resize_old_usr2;
+static sigset_t resize_old_mask;
+
+typedef struct {
+  const char * control;
+  int32_t follow;
+  int32_t requested;   // From --threads, signals and the control file
+  int32_t control_threads;
+  int32_t cpus;
+} resize_t;
+
+static resize_t resize;
+
+
+int32_t resize_follow_parse(const char * names)
+{
+  int32_t follow = RESIZE_FOLLOW_NONE;
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), "%s", names);
+
+  for (char * name = strtok(buffer, ","); name != NULL; name = strtok(NULL, ",")) {
+    if (strcmp(name, "load") == 0) {
+      follow |= RESIZE_FOLLOW_LOAD;
+    } else if (strcmp(name, "cgroup") == 0) {
+      follow |= RESIZE_FOLLOW_CGROUP;
+    } else {
+      return RESIZE_FOLLOW_INVALID;
+    }
+  }
+
+  return follow;
+}
+
+
+// Sources
+
+static void _resize_signal(const int sig)
+{
+  atomic_fetch_add(&resize_signals, sig == SIGUSR1 ? 1 : -1);
+}
+
+// The N of the last "threads N" line in filename, or 0. The last
+// "threads N at R" line is handed to the render.
+static int32_t _resize_control(const char * filename)
+{
+  FILE * fp = fopen(filename, "r");
+  if (!fp) {
+    return 0;
+  }
+
+  char line[256];
+  int32_t threads = 0;
+  int32_t n;
+  long long row;
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (sscanf(line, " threads %d at %lld", &n, &row) == 2 && n >= 1 && row >= 1) {
+      atomic_store(&resize_at_threads, n);
+      atomic_store(&resize_at_row, row);
+    } else if (sscanf(line, " threads %d", &n) == 1 && n >= 1) {
+      threads = n;
+    }
+  }
+
+  fclose(fp);
+  return threads;
+}
+
+// Runs on the worker that solved the row, see mandelbrot.h
+static void _resize_row(const int64_t rows)
+{
+  if (rows != atomic_load(&resize_at_row)) {
+    return;
+  }
+
+  const int32_t threads = pool_resize(atomic_load(&resize_at_threads));
+  atomic_store(&resize_applied, threads);
+  info("Threads: %d at row %" PRId64 "\n", threads, rows);
+}
+
+static int32_t _resize_load(double * load)
+{
+  FILE * fp = fopen("/proc/loadavg", "r");
+  if (!fp) {
+    return 1;
+  }
+
+  const int32_t status = fscanf(fp, "%lf", load) == 1 ? 0 : 1;
+  fclose(fp);
+  return status;
+}
+
+// CPUs the cgroup quota allows, rounded up, or 0 without a quota
+static int32_t _resize_cgroup()
+{
+  long long quota = -1;
+  long long period = 0;
+  char text[32];
+
+  FILE * fp = fopen("/sys/fs/cgroup/cpu.max", "r");
+  if (fp) {
+    if (fscanf(fp, "%31s %lld", text, &period) == 2 && strcmp(text, "max") != 0) {
+      quota = atoll(text);
+    }
+    fclose(fp);
+  } else if ((fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r")) != NULL) {
+    if (fscanf(fp, "%lld", &quota) != 1) {
+      quota = -1;
+    }
+    fclose(fp);
+    if ((fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r")) != NULL) {
+      if (fscanf(fp, "%lld", &period) != 1) {
+        period = 0;
+      }
+      fclose(fp);
+    }
+  }
+
+  if (quota <= 0 || period <= 0) {
+    return 0;
+  }
+  return (int32_t) ((quota + period - 1) / period);
+}
+
+
+// Every source in turn. Signals and the control file set the
+// number asked for, the load takes its place when followed, and
+// the cgroup quota is a limit on top of either.
+
+static void _resize_step(resize_t * r)
+{
+  const int32_t active = pool_active();
+
+  const int32_t applied = atomic_exchange(&resize_applied, 0);
+  if (applied > 0) {
+    r->requested = applied;
+  }
+  r->requested += atomic_exchange(&resize_signals, 0);
+
+  if (r->control != NULL) {
+    const int32_t threads = _resize_control(r->control);
+    if (threads > 0 && threads != r->control_threads) {
+      r->control_threads = threads;
+      r->requested = threads;
+    }
+  }
+
+  r->requested = r->requested < 1 ? 1 : r->requested > pool_size() ? pool_size() : r->requested;
+  int32_t target = r->requested;
+
+  double load;
+  if (r->follow & RESIZE_FOLLOW_LOAD && _resize_load(&load) == 0) {
+    const double others = load > active ? load - active : 0.0;
+    target = r->cpus - (int32_t) lround(others);
+  }
+
+  const int32_t quota = r->follow & RESIZE_FOLLOW_CGROUP ? _resize_cgroup() : 0;
+  if (quota > 0 && target > quota) {
+    target = quota;
+  }
+
+  target = target < 1 ? 1 : target > pool_size() ? pool_size() : target;
+  if (target != active) {
+    pool_resize(target);
+    info("Threads: %d -> %d\n", active, target);
+  }
+}
+
+static void * _resize_thread(void * ptr)
+{
+  resize_t * r = ptr;
+
+  trace_thread_name("resize");
+
+  // The only thread the signals are delivered to
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  sigaddset(&signals, SIGUSR2);
+  pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+
+  const struct timespec interval = { 0, RESIZE_INTERVAL_MS * 1000000L };
+  while (!atomic_load(&resize_stopping)) {
+    nanosleep(&interval, NULL);
+    _resize_step(r);
+  }
+
+  return NULL;
+}
+
+
+void resize_start(const args_t * args)
+{
+  const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  resize.control = args->control;
+  resize.follow = args->follow;
+  resize.requested = args->threads;
+  resize.control_threads = 0;
+  resize.cpus = cpus < 1 ? 1 : cpus;
+
+  // Signals interrupt the blocking calls of the thread they land on,
+  // such as the writes of PNGs, progress and checkpoints. They are
+  // blocked here, and so in every thread started from now on, and
+  // only the resize thread takes them.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  sigaddset(&signals, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &signals, &resize_old_mask);
+
+  const int32_t max_threads = args->max_threads > 0 ? args->max_threads
+    : args->threads > resize.cpus ? args->threads : resize.cpus;
+  pool_init_resizable(args->threads, max_threads);
+
+  atomic_store(&resize_signals, 0);
+  atomic_store(&resize_stopping, 0);
+  atomic_store(&resize_at_row, -1);
+  atomic_store(&resize_applied, 0);
+  mandelbrot_row_hook = _resize_row;
+
+  struct sigaction change;
+  memset(&change, 0, sizeof(change));
+  change.sa_handler = _resize_signal;
+  sigemptyset(&change.sa_mask);
+  sigaction(SIGUSR1, &change, &resize_old_usr1);
+  sigaction(SIGUSR2, &change, &resize_old_usr2);
+
+  // The control file is read once before the first render, so that
+  // lines in it from the start apply from the first row
+  _resize_step(&resize);
+
+  pthread_create(&resize_thread, NULL, _resize_thread, &resize);
+  resize_running = true;
+
+  info("Resizable pool of %d threads, %d active\n", pool_size(), pool_active());
+}
+
+void resize_stop()
+{
+  if (!resize_running) {
+    return;
+  }
+
+  atomic_store(&resize_stopping, 1);
+  pthread_join(resize_thread, NULL);
+  resize_running = false;
+  mandelbrot_row_hook = NULL;
+
+  // Signals still pending go to our handler before the old one is back
+  pthread_sigmask(SIG_SETMASK, &resize_old_mask, NULL);
+  sigaction(SIGUSR1, &resize_old_usr1, NULL);
+  sigaction(SIGUSR2, &resize_old_usr2, NULL);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "mandelbrot.h"
+
+
+// Growing and shrinking the pool while it works. With room for
+// --max-threads, the pool starts with --threads of them active and
+// a background thread changes that every RESIZE_INTERVAL_MS from:
+//
+//   SIGUSR1 and SIGUSR2, which add and remove a thread
+//   --control=FILE, with a line "threads N", whenever N changes, and
+//     "threads N at R" to change to N once a render has solved R rows
+//   --follow=load, to use the CPUs that the one minute load average
+//     says other processes leave idle
+//   --follow=cgroup, to stay within the CPU quota of the cgroup
+//     (cpu.max of cgroup v2, or the CFS quota of v1)
+//
+// The kernel does not queue standard signals, so SIGUSR1 or SIGUSR2
+// sent again before the handler has run for the first one are lost.
+// Quick bursts may move the pool by fewer threads than were sent;
+// the control file sets an exact count. Only the resize thread takes
+// the signals, so they do not interrupt I/O on the other threads.
+//
+// Renders take the change between rows, see pool.h.
+
+#define RESIZE_INTERVAL_MS 200
+
+enum resize_follow {
+  RESIZE_FOLLOW_INVALID = -1,
+  RESIZE_FOLLOW_NONE = 0,
+  RESIZE_FOLLOW_LOAD = 1,
+  RESIZE_FOLLOW_CGROUP = 2,
+};
+
+
+// Parses a comma separated list of load and cgroup into flags
+extern int32_t resize_follow_parse(const char * names);
+
+// Starts the pool with the threads and room of args, and follows
+// the sources it gives
+extern void resize_start(const args_t * args);
+
+// Stops following, before the pool is destroyed
+extern void resize_stop();
@@ -0,0 +1,268 @@
+#include "state.h"
+
+
+// File layout, all in native byte order:
+//
+//   magic     8 bytes, "MBSTATE2"
+//   header    state_header_t
+//   rows      height bytes, non-zero for finished rows
+//   field     width * height int32 iteration counts
+//   orbits    n_orbits state_orbit_t
+
+#define STATE_MAGIC "MBSTATE2"
+#define STATE_MAGIC_SIZE 8
+
+typedef struct {
+  viewport_t view;
+  int32_t power;
+  int32_t julia;
+  double julia_x;
+  double julia_y;
+  int32_t iterations;
+  int64_t n_orbits;
+} state_header_t;
+
+
+// Orbit chunks. A new chunk is only added once the last one is full.
+
+static state_orbit_t * _state_orbits_chunk(state_orbits_t * orbits)
+{
+  if (orbits->n_chunks == orbits->chunks_size) {
+    orbits->chunks_size = orbits->chunks_size ? 2 * orbits->chunks_size : 16;
+    orbits->chunks = mem_realloc(orbits->chunks, sizeof(state_orbit_t *) * orbits->chunks_size);
+  }
+  orbits->chunks[orbits->n_chunks] = mem_alloc(sizeof(state_orbit_t) * STATE_ORBIT_CHUNK);
+  return orbits->chunks[orbits->n_chunks++];
+}
+
+void state_orbits_append(state_orbits_t * orbits, const state_orbit_t * append, int64_t n)
+{
+  while (n > 0) {
+    const int64_t offset = orbits->n % STATE_ORBIT_CHUNK;
+    if (orbits->n / STATE_ORBIT_CHUNK == orbits->n_chunks) {
+      _state_orbits_chunk(orbits);
+    }
+
+    const int64_t k = n < STATE_ORBIT_CHUNK - offset ? n : STATE_ORBIT_CHUNK - offset;
+    memcpy(state_orbit(orbits, orbits->n), append, sizeof(state_orbit_t) * k);
+    orbits->n += k;
+    append += k;
+    n -= k;
+  }
+}
+
+void state_orbits_free(state_orbits_t * orbits)
+{
+  for (int64_t c = 0; c < orbits->n_chunks; c++) {
+    mem_free(orbits->chunks[c]);
+  }
+  mem_free(orbits->chunks);
+  memset(orbits, 0, sizeof(state_orbits_t));
+}
+
+
+// Load. Counts and orbits are used as indices later, so the ones
+// out of range are not taken on trust: every count of a finished row
+// is within the cap, and every orbit is a pixel of a finished row.
+
+static int32_t _state_valid(const state_t * state)
+{
+  const int32_t w = state->view.width;
+  const int32_t h = state->view.height;
+
+  for (int32_t py = 0; py < h; py++) {
+    for (int32_t px = 0; px < w && state->rows_done[py]; px++) {
+      const int32_t count = state->field->pixels[py * w + px].i32;
+      if (count < 0 || count > state->iterations) {
+        return 0;
+      }
+    }
+  }
+
+  for (int64_t i = 0; i < state->orbits.n; i++) {
+    const int64_t index = state_orbit(&state->orbits, i)->index;
+    if (index < 0 || index >= (int64_t) w * h || !state->rows_done[index / w]) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+state_t * state_load(const char * filename)
+{
+  FILE * fp = fopen(filename, "rb");
+  if (!fp) {
+    return NULL;
+  }
+
+  char magic[STATE_MAGIC_SIZE];
+  state_header_t header;
+
+  if (fread(magic, STATE_MAGIC_SIZE, 1, fp) != 1
+      || memcmp(magic, STATE_MAGIC, STATE_MAGIC_SIZE) != 0
+      || fread(&header, sizeof(header), 1, fp) != 1
+      || header.view.width <= 0 || header.view.height <= 0
+      || header.n_orbits < 0
+      || header.n_orbits > (int64_t) header.view.width * header.view.height) {
+    error("'%s' is not a state file, ignoring it\n", filename);
+    fclose(fp);
+    return NULL;
+  }
+
+  const int32_t w = header.view.width;
+  const int32_t h = header.view.height;
+
+  state_t * state = mem_alloc(sizeof(state_t));
+  state->view = header.view;
+  state->power = header.power;
+  state->julia = header.julia;
+  state->julia_x = header.julia_x;
+  state->julia_y = header.julia_y;
+  state->iterations = header.iterations;
+  state->field = image_new(w, h, IMAGE_MODE_ITERATIONS);
+  state->rows_done = mem_alloc(h);
+
+  int32_t * row = mem_alloc(sizeof(int32_t) * w);
+  int32_t ok = fread(state->rows_done, 1, h, fp) == (size_t) h;
+
+  for (int32_t py = 0; py < h && ok; py++) {
+    ok = fread(row, sizeof(int32_t), w, fp) == (size_t) w;
+    for (int32_t px = 0; px < w && ok; px++) {
+      state->field->pixels[py * w + px].i32 = row[px];
+    }
+  }
+
+  mem_free(row);
+
+  for (int64_t read = 0; ok && read < header.n_orbits; read += STATE_ORBIT_CHUNK) {
+    const int64_t n = header.n_orbits - read < STATE_ORBIT_CHUNK ? header.n_orbits - read : STATE_ORBIT_CHUNK;
+    state_orbit_t * chunk = _state_orbits_chunk(&state->orbits);
+    ok = fread(chunk, sizeof(state_orbit_t), n, fp) == (size_t) n;
+    state->orbits.n += ok ? n : 0;
+  }
+
+  fclose(fp);
+
+  if (!ok) {
+    error("'%s' is truncated, ignoring it\n", filename);
+    state_destroy(state);
+    return NULL;
+  }
+
+  if (!_state_valid(state)) {
+    error("'%s' is corrupt, ignoring it\n", filename);
+    state_destroy(state);
+    return NULL;
+  }
+
+  return state;
+}
+
+
+// Save. Written next to the target, synced and renamed over it,
+// so a crash at any point leaves either the previous state or the
+// new one in place.
+
+int32_t state_save(const state_t * state, const char * filename)
+{
+  const size_t length = strlen(filename) + 5;
+  char * tmp = mem_alloc(length);
+  snprintf(tmp, length, "%s.tmp", filename);
+
+  FILE * fp = fopen(tmp, "wb");
+  if (!fp) {
+    critical("failed to open file '%s' in write mode\n", tmp);
+    mem_free(tmp);
+    return 2;
+  }
+
+  state_header_t header;
+  memset(&header, 0, sizeof(header));
+  header.view = state->view;
+  header.power = state->power;
+  header.julia = state->julia;
+  header.julia_x = state->julia_x;
+  header.julia_y = state->julia_y;
+  header.iterations = state->iterations;
+  header.n_orbits = state->orbits.n;
+
+  const int32_t w = state->view.width;
+  const int32_t h = state->view.height;
+  int32_t * row = mem_alloc(sizeof(int32_t) * w);
+
+  int32_t ok = fwrite(STATE_MAGIC, STATE_MAGIC_SIZE, 1, fp) == 1
+    && fwrite(&header, sizeof(header), 1, fp) == 1
+    && fwrite(state->rows_done, 1, h, fp) == (size_t) h;
+
+  // Rows that are not done may still be written to by the workers,
+  // and are saved as zeros without reading them
+  for (int32_t py = 0; py < h && ok; py++) {
+    for (int32_t px = 0; px < w; px++) {
+      row[px] = state->rows_done[py] ? state->field->pixels[py * w + px].i32 : 0;
+    }
+    ok = fwrite(row, sizeof(int32_t), w, fp) == (size_t) w;
+  }
+
+  mem_free(row);
+
+  for (int64_t written = 0; ok && written < state->orbits.n; written += STATE_ORBIT_CHUNK) {
+    const int64_t n = state->orbits.n - written < STATE_ORBIT_CHUNK ? state->orbits.n - written : STATE_ORBIT_CHUNK;
+    ok = fwrite(state_orbit(&state->orbits, written), sizeof(state_orbit_t), n, fp) == (size_t) n;
+  }
+
+  ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+  ok = fclose(fp) == 0 && ok;
+
+  if (!ok || rename(tmp, filename) != 0) {
+    critical("failed to write state to '%s'\n", filename);
+    remove(tmp);
+    mem_free(tmp);
+    return 2;
+  }
+
+  mem_free(tmp);
+  return 0;
+}
+
+
+// Compatibility. The precision may differ, orbits are stored as
+// doubles and continue in whatever the new render uses.
+
+int32_t state_matches(
+    const state_t * state,
+    const viewport_t * view,
+    const kernel_t * kernel,
+    const kernel_params_t * params
+  )
+{
+  return memcmp(&state->view, view, sizeof(viewport_t)) == 0
+    && state->power == kernel->power
+    && state->julia == kernel->julia
+    && state->julia_x == params->julia_x
+    && state->julia_y == params->julia_y;
+}
+
+
+int32_t state_complete(const state_t * state)
+{
+  for (int32_t py = 0; py < state->view.height; py++) {
+    if (!state->rows_done[py]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+void state_destroy(state_t * state)
+{
+  if (state == NULL) {
+    return;
+  }
+
+  image_destroy(state->field);
+  mem_free(state->rows_done);
+  state_orbits_free(&state->orbits);
+  mem_free(state);
+}
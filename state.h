@@ -0,0 +1,82 @@
+#pragma once
+
+// Required for fsync to work
+#define _POSIX_C_SOURCE 200112L
+
+#include <unistd.h>
+
+#include "cache.h"
+#include "image.h"
+#include "kernel.h"
+#include "utils.h"
+
+
+// Saved state of a render, either finished or a checkpoint of one
+// in progress. The field holds the count of every pixel in the
+// finished rows, and every such pixel that reached the cap has its
+// orbit saved with the z it stopped at, so the cap can be raised
+// later. Orbits are only kept for rows that were actually solved,
+// rows mirrored across the real axis are copies of their twin.
+
+typedef struct {
+  int64_t index;  // py * width + px
+  double zx;
+  double zy;
+} state_orbit_t;
+
+// Orbits in chunks that never move once allocated. New ones are only
+// appended, so the first n of them can be read without a lock while
+// more are added, as long as the chunk pointers were copied.
+
+#define STATE_ORBIT_CHUNK 65536
+
+typedef struct {
+  state_orbit_t ** chunks;
+  int64_t n;
+  int64_t n_chunks;
+  int64_t chunks_size;
+} state_orbits_t;
+
+static inline state_orbit_t * state_orbit(const state_orbits_t * orbits, const int64_t i)
+{
+  return &orbits->chunks[i / STATE_ORBIT_CHUNK][i % STATE_ORBIT_CHUNK];
+}
+
+typedef struct {
+  viewport_t view;
+  int32_t power;
+  int32_t julia;
+  double julia_x;
+  double julia_y;
+  int32_t iterations;
+  image_t * field;
+  uint8_t * rows_done;  // Non-zero for every finished row
+  state_orbits_t orbits;
+} state_t;
+
+
+extern void state_orbits_append(state_orbits_t * orbits, const state_orbit_t * append, int64_t n);
+
+extern void state_orbits_free(state_orbits_t * orbits);
+
+
+// Returns NULL when the file does not exist or is not a state file
+extern state_t * state_load(const char * filename);
+
+// Only the rows marked in rows_done are read from the field, the
+// others are saved as zeros
+extern int32_t state_save(const state_t * state, const char * filename);
+
+// Whether a render of the view with the kernel and parameters can
+// continue from the state
+extern int32_t state_matches(
+    const state_t * state,
+    const viewport_t * view,
+    const kernel_t * kernel,
+    const kernel_params_t * params
+  );
+
+// Whether every row is finished
+extern int32_t state_complete(const state_t * state);
+
+extern void state_destroy(state_t * state);
@@ -0,0 +1,43 @@
+#include "stats.h"
+
+
+stats_t stats;
+
+
+// Monotonic wall clock time in seconds
+
+double stats_now()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double) now.tv_sec + (double) now.tv_nsec * 1e-9;
+}
+
+
+// Write the stats as a single JSON object
+
+int32_t stats_write(const char * filename)
+{
+  FILE * fp = fopen(filename, "w");
+  if (!fp) {
+    critical("failed to open file '%s' in write mode\n", filename);
+    return 2;
+  }
+
+  fprintf(fp, "{\n");
+  fprintf(fp, "  \"width\": %d,\n", stats.width);
+  fprintf(fp, "  \"height\": %d,\n", stats.height);
+  fprintf(fp, "  \"supersampling\": %d,\n", stats.supersampling);
+  fprintf(fp, "  \"iterations\": %d,\n", stats.iterations);
+  fprintf(fp, "  \"iterations_auto\": %s,\n", stats.iterations_auto ? "true" : "false");
+  fprintf(fp, "  \"kernel\": \"%s\",\n", stats.kernel ? stats.kernel : "");
+  fprintf(fp, "  \"precision\": \"%s\",\n", stats.precision ? stats.precision : "");
+  fprintf(fp, "  \"samples\": %ld,\n", (long) stats.samples);
+  fprintf(fp, "  \"samples_per_second\": %.1f,\n", stats.samples_per_second);
+  fprintf(fp, "  \"render_seconds\": %.6f,\n", stats.render_seconds);
+  fprintf(fp, "  \"total_seconds\": %.6f\n", stats.total_seconds);
+  fprintf(fp, "}\n");
+
+  fclose(fp);
+  return 0;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+// Required for clock_gettime to work
+#define _POSIX_C_SOURCE 200112L
+
+#include <time.h>
+
+#include "utils.h"
+
+
+// Numbers about the current render, filled in by the engine and
+// written out as a JSON object with --stats.
+
+typedef struct {
+  int32_t width;
+  int32_t height;
+  int32_t supersampling;
+  int32_t iterations;
+  int32_t iterations_auto;
+  const char * kernel;
+  const char * precision;
+  int64_t samples;  // Buddhabrot only
+  double samples_per_second;
+  double render_seconds;
+  double total_seconds;
+} stats_t;
+
+
+extern stats_t stats;
+
+extern double stats_now();
+
+extern int32_t stats_write(const char * filename);
@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# Runs the jobs of tests/batch_ranges.jsonl, which have widths,
+# iterations and sample counts out of range, non-integer values and
+# unknown keys, next to two valid ones. Every job has to get the
+# result in tests/batch_ranges.expected, without the timings of the
+# valid jobs.
+#
+# Usage: tests/batch_ranges.sh [path to mandelbrot]
+
+set -e
+
+MANDELBROT=$(realpath "${1:-./mandelbrot}")
+TESTS=$(realpath "$(dirname "$0")")
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# The outputs of the valid jobs are written next to the results
+cd "$DIR"
+
+status=0
+$MANDELBROT --profile=/none --batch="$TESTS/batch_ranges.jsonl" --results=results.jsonl \
+  2> /dev/null || status=$?
+
+if [ $status -ne 1 ]; then
+  echo "[batch_ranges] exit status $status, expected 1 for the failed jobs"
+  exit 1
+fi
+
+# Writers finish the valid jobs in any order
+sed 's/\("status": "ok"\).*/\1}/' results.jsonl | sort -n -k2,2 > results.sorted
+
+if diff -u "$TESTS/batch_ranges.expected" results.sorted; then
+  echo "[batch_ranges] $(wc -l < results.sorted) jobs: ok"
+else
+  echo "[batch_ranges] results differ"
+  exit 1
+fi
@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# Shrinks the pool during the last work units of a render and checks
+# that it still solves every row. The image has two units of 900 rows,
+# one for each of the two threads, and the second thread is parked
+# once the render has solved a given number of rows, at several points
+# of the second unit. The field has to match the one of a render
+# without resizing.
+#
+# Usage: tests/resize_shrink.sh [path to mandelbrot]
+
+set -e
+
+MANDELBROT=${1:-./mandelbrot}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+VIEW="--profile=/none --xmin=-0.76 --xmax=-0.72 --ymin=0.14 --ymax=0.26 -w 600 -i 2000 --rows=900"
+
+$MANDELBROT $VIEW -t 1 --output="$DIR/fixed.raw,format=raw" 2> /dev/null
+
+status=0
+for row in 1 100 900 1200 1799; do
+  printf 'threads 2\nthreads 1 at %d\n' $row > "$DIR/control"
+  $MANDELBROT $VIEW -t 1 --max-threads=2 --control="$DIR/control" \
+    --output="$DIR/resized.raw,format=raw" 2> /dev/null
+
+  if cmp -s "$DIR/fixed.raw" "$DIR/resized.raw"; then
+    echo "[resize_shrink] shrink at row $row: ok"
+  else
+    echo "[resize_shrink] shrink at row $row: rows differ"
+    status=1
+  fi
+done
+
+exit $status
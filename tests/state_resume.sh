@@ -0,0 +1,148 @@
+#!/bin/sh
+#
+# Continues renders from state files and checks that the field matches
+# the one of a render without a state file: from a state with half of
+# the rows finished, and from a finished one with a lower cap. Then
+# corrupts a saved state in several ways and checks that it is
+# rejected with a message, and that the render starts over and still
+# matches.
+#
+# Usage: tests/state_resume.sh [path to mandelbrot]
+
+set -e
+
+MANDELBROT=${1:-./mandelbrot}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# Not symmetric across the real axis, so every row is solved and has
+# its own orbits. 200 x 100 pixels.
+VIEW="--profile=/none --xmin=-1.5 --xmax=0.5 --ymin=0.1 --ymax=1.1 -w 200"
+W=200
+H=100
+
+# Offsets in the state file, see state.c: the magic and the header
+# take 88 bytes, then a byte per row, an int32 per pixel and 24 bytes
+# (index, zx, zy) per orbit
+ROWS=88
+FIELD=$((ROWS + H))
+ORBITS=$((FIELD + 4 * W * H))
+
+# Edits a state file in place: set-i32, set-i64 and set-f64 OFFSET
+# VALUE, truncate SIZE, or half, which leaves only the upper half of
+# the rows finished along with their orbits
+edit() {
+  python3 - "$@" <<'EOF'
+import struct, sys
+
+name, op = sys.argv[1], sys.argv[2]
+data = bytearray(open(name, "rb").read())
+
+if op == "half":
+    w, h = struct.unpack_from("=ii", data, 40)
+    rows, field = 88, 88 + h
+    orbits = field + 4 * w * h
+    n = struct.unpack_from("=q", data, 80)[0]
+    kept = [data[orbits + 24 * i:orbits + 24 * (i + 1)] for i in range(n)
+            if struct.unpack_from("=q", data, orbits + 24 * i)[0] < (h // 2) * w]
+    for py in range(h // 2, h):
+        data[rows + py] = 0
+    data[field + 4 * w * (h // 2):orbits] = bytes(4 * w * (h - h // 2))
+    struct.pack_into("=q", data, 80, len(kept))
+    data = data[:orbits] + b"".join(kept)
+elif op == "truncate":
+    data = data[:int(sys.argv[3])]
+else:
+    fmt = {"set-i32": "=i", "set-i64": "=q", "set-f64": "=d"}[op]
+    value = float(sys.argv[4]) if op == "set-f64" else int(sys.argv[4])
+    struct.pack_into(fmt, data, int(sys.argv[3]), value)
+
+open(name, "wb").write(data)
+EOF
+}
+
+status=0
+
+check() {
+  if cmp -s "$DIR/fixed.raw" "$DIR/resumed.raw"; then
+    echo "[state_resume] $1: ok"
+  else
+    echo "[state_resume] $1: field differs"
+    status=1
+  fi
+}
+
+# Renders from the state file with the full cap and checks the field
+# and that the log says message
+render() {
+  $MANDELBROT $VIEW -i 1000 --state="$DIR/test.state" \
+    --output="$DIR/resumed.raw,format=raw" 2> "$DIR/log" || true
+  if ! grep -q "$2" "$DIR/log"; then
+    echo "[state_resume] $1: no \"$2\" in the log"
+    status=1
+    return
+  fi
+  check "$1"
+}
+
+$MANDELBROT $VIEW -i 1000 --output="$DIR/fixed.raw,format=raw" 2> /dev/null
+$MANDELBROT $VIEW -i 1000 --state="$DIR/saved.state" --output="$DIR/resumed.raw,format=raw" 2> /dev/null
+check "render with a state file"
+
+n_orbits=$(python3 -c "import struct; print(struct.unpack_from('=q', open('$DIR/saved.state', 'rb').read(), 80)[0])")
+if [ "$n_orbits" -lt 2 ]; then
+  echo "[state_resume] the view has $n_orbits orbits, expected more"
+  exit 1
+fi
+
+# Resuming
+
+cp "$DIR/saved.state" "$DIR/test.state"
+edit "$DIR/test.state" half
+render "resume half of the rows" "Resuming"
+
+$MANDELBROT $VIEW -i 400 --state="$DIR/test.state" --output="$DIR/resumed.raw,format=raw" 2> /dev/null
+render "resume with a higher cap" "Resuming"
+
+# Corrupt states
+
+corrupt() {
+  cp "$DIR/saved.state" "$DIR/test.state"
+  edit "$DIR/test.state" "$@"
+}
+
+corrupt set-i64 $ORBITS $((W * H))
+render "orbit index past the field" "is corrupt"
+
+corrupt set-i64 $ORBITS -1
+render "negative orbit index" "is corrupt"
+
+corrupt half
+edit "$DIR/test.state" set-i64 $ORBITS $((W * H - 1))
+render "orbit of an unfinished row" "is corrupt"
+
+corrupt set-i32 $FIELD 1001
+render "count above the cap" "is corrupt"
+
+corrupt set-i32 $FIELD -1
+render "negative count" "is corrupt"
+
+corrupt set-f64 8 -1.25
+render "header of another view" "another view"
+
+corrupt set-i32 40 $((W + 1))
+render "header with another width" "is truncated"
+
+corrupt set-i64 80 $((n_orbits + 1))
+render "header with more orbits" "is truncated"
+
+corrupt set-i64 80 $((W * H + 1))
+render "header with too many orbits" "not a state file"
+
+corrupt truncate $((FIELD + 1000))
+render "truncated in the field" "is truncated"
+
+corrupt truncate $((ORBITS + 24 * n_orbits - 8))
+render "truncated in the orbits" "is truncated"
+
+exit $status
@@ -0,0 +1,179 @@
+// Required for clock_gettime to work
+#define _POSIX_C_SOURCE 200112L
+
+#include <inttypes.h>
+#include <time.h>
+
+#include "trace.h"
+
+
+typedef struct {
+  const char * name;
+  const char * category;
+  int64_t begin;     // Nanoseconds since trace_init()
+  int64_t duration;
+  int64_t item;
+} trace_event_t;
+
+typedef struct {
+  char name[TRACE_NAME_SIZE];
+  int64_t count;     // Spans recorded, the buffer holds the last ones
+  trace_event_t * events;
+} trace_thread_t;
+
+
+// Global state: Threads that have recorded something
+
+static bool trace_on = false;
+static int64_t trace_started = 0;
+
+static trace_thread_t * trace_threads[TRACE_MAX_THREADS];
+static int32_t trace_n_threads = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Set from trace_thread_name() even before recording is turned on,
+// as the pool threads start first
+static _Thread_local char trace_name[TRACE_NAME_SIZE];
+static _Thread_local trace_thread_t * trace_self = NULL;
+static _Thread_local bool trace_full = false;
+
+
+static int64_t _trace_clock()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// The buffer of the calling thread, made on its first span
+
+static trace_thread_t * _trace_thread()
+{
+  if (trace_self != NULL || trace_full) {
+    return trace_self;
+  }
+
+  pthread_mutex_lock(&trace_lock);
+
+  if (trace_n_threads < TRACE_MAX_THREADS) {
+    trace_self = mem_alloc(sizeof(trace_thread_t));
+    trace_self->events = mem_alloc(sizeof(trace_event_t) * TRACE_EVENTS_PER_THREAD);
+    if (trace_name[0] != '\0') {
+      snprintf(trace_self->name, TRACE_NAME_SIZE, "%s", trace_name);
+    } else {
+      snprintf(trace_self->name, TRACE_NAME_SIZE, "thread %d", trace_n_threads);
+    }
+    trace_threads[trace_n_threads++] = trace_self;
+  } else {
+    trace_full = true;
+  }
+
+  pthread_mutex_unlock(&trace_lock);
+  return trace_self;
+}
+
+
+void trace_init()
+{
+  trace_started = _trace_clock();
+  trace_on = true;
+
+  // The main thread comes first in the timeline
+  if (trace_name[0] == '\0') {
+    trace_thread_name("main");
+  }
+  _trace_thread();
+}
+
+bool trace_enabled()
+{
+  return trace_on;
+}
+
+void trace_thread_name(const char * name)
+{
+  snprintf(trace_name, TRACE_NAME_SIZE, "%s", name);
+}
+
+int64_t trace_begin()
+{
+  return trace_on ? _trace_clock() : 0;
+}
+
+void trace_end(const char * name, const char * category, const int64_t begin, const int64_t item)
+{
+  if (!trace_on) {
+    return;
+  }
+
+  trace_thread_t * t = _trace_thread();
+  if (t == NULL) {
+    return;
+  }
+
+  trace_event_t * event = &t->events[t->count % TRACE_EVENTS_PER_THREAD];
+  event->name = name;
+  event->category = category;
+  event->begin = begin - trace_started;
+  event->duration = _trace_clock() - begin;
+  event->item = item;
+  t->count++;
+}
+
+
+// Output in the JSON object format of the trace event format, with
+// complete ("X") events in microseconds and a name for every thread
+
+int32_t trace_write(const char * filename)
+{
+  if (!trace_on) {
+    return 0;
+  }
+
+  FILE * fp = fopen(filename, "w");
+  if (!fp) {
+    critical("failed to open file '%s' in write mode\n", filename);
+    return 2;
+  }
+
+  int64_t spans = 0;
+  int64_t dropped = 0;
+
+  fprintf(fp, "{\"traceEvents\": [\n");
+  fprintf(fp, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, "
+      "\"args\": {\"name\": \"mandelbrot\"}}");
+
+  for (int32_t i = 0; i < trace_n_threads; i++) {
+    const trace_thread_t * t = trace_threads[i];
+    const int64_t first = t->count > TRACE_EVENTS_PER_THREAD ? t->count - TRACE_EVENTS_PER_THREAD : 0;
+
+    fprintf(fp, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+        "\"args\": {\"name\": \"%s\"}}", i, t->name);
+    fprintf(fp, ",\n{\"name\": \"thread_sort_index\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+        "\"args\": {\"sort_index\": %d}}", i, i);
+
+    for (int64_t n = first; n < t->count; n++) {
+      const trace_event_t * e = &t->events[n % TRACE_EVENTS_PER_THREAD];
+      fprintf(fp, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+          "\"ts\": %.3f, \"dur\": %.3f", e->name, e->category, i, e->begin * 1e-3, e->duration * 1e-3);
+      if (e->item >= 0) {
+        fprintf(fp, ", \"args\": {\"item\": %" PRId64 "}", e->item);
+      }
+      fprintf(fp, "}");
+    }
+
+    spans += t->count - first;
+    dropped += first;
+  }
+
+  fprintf(fp, "\n],\n\"displayTimeUnit\": \"ms\",\n");
+  fprintf(fp, "\"otherData\": {\"spans\": %" PRId64 ", \"dropped\": %" PRId64 "}}\n", spans, dropped);
+
+  if (dropped > 0) {
+    error("The trace kept the last %d spans of every thread, %" PRId64 " earlier ones are not in it\n",
+        TRACE_EVENTS_PER_THREAD, dropped);
+  }
+  info("Trace: %" PRId64 " spans of %d threads written to '%s'\n", spans, trace_n_threads, filename);
+
+  return fclose(fp) == 0 ? 0 : 2;
+}
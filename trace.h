@@ -0,0 +1,36 @@
+#pragma once
+
+#include <pthread.h>
+
+#include "utils.h"
+
+
+// Timeline of what every thread did, written as Chrome trace
+// events for chrome://tracing or Perfetto. Each thread records
+// spans into a ring buffer of its own, without locks, and keeps the
+// last TRACE_EVENTS_PER_THREAD of them. The buffers are only read
+// by trace_write(), when the threads are idle.
+
+#define TRACE_EVENTS_PER_THREAD 65536
+#define TRACE_MAX_THREADS 256
+#define TRACE_NAME_SIZE 32
+
+
+// Turns recording on. Off by default, so the calls below do nothing.
+extern void trace_init();
+
+extern bool trace_enabled();
+
+// Names the calling thread in the timeline, threads that are not
+// named are numbered
+extern void trace_thread_name(const char * name);
+
+// Start of a span, to hand to trace_end() when it is over
+extern int64_t trace_begin();
+
+// Records a span from begin until now. name and category must
+// outlive the trace, item is the row or other item worked on, or -1.
+extern void trace_end(const char * name, const char * category, const int64_t begin, const int64_t item);
+
+// Writes every recorded span as a JSON object to filename
+extern int32_t trace_write(const char * filename);
@@ -0,0 +1,167 @@
+#include "verify.h"
+
+
+// The pixels to check are picked by selection sampling, so every
+// one is picked at most once and they come in order. The seed is
+// fixed, and the same view checks the same pixels every time.
+
+#define VERIFY_SEED 0x7665726966792121
+
+typedef struct {
+  const image_t * field;
+  const kernel_t * reference;  // NULL for m_solve()
+  const int64_t * pixels;
+  int64_t n_pixels;
+  int32_t * expected;
+} verify_ctx_t;
+
+typedef struct {
+  int64_t pixel;
+  int32_t got;
+  int32_t expected;
+} verify_miss_t;
+
+
+// SplitMix64, as in buddha.c
+
+static uint64_t _verify_random(uint64_t * state)
+{
+  uint64_t z = (*state += 0x9e3779b97f4a7c15);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return z ^ (z >> 31);
+}
+
+static int64_t * _verify_pick(const int64_t total, const int64_t samples)
+{
+  int64_t * pixels = mem_alloc(sizeof(int64_t) * samples);
+  uint64_t state = VERIFY_SEED;
+  int64_t n = 0;
+
+  for (int64_t p = 0; p < total && n < samples; p++) {
+    const double u = (double) (_verify_random(&state) >> 11) * 0x1.0p-53;
+    if ((double) (total - p) * u < (double) (samples - n)) {
+      pixels[n++] = p;
+    }
+  }
+
+  return pixels;
+}
+
+
+// Solves a chunk of the picked pixels with the reference
+
+static void _verify_chunk(void * ptr, const int32_t chunk, const int32_t thread)
+{
+  (void) thread;
+
+  const verify_ctx_t * ctx = ptr;
+  const int32_t w = ctx->field->width;
+  const int64_t first = (int64_t) chunk * VERIFY_CHUNK;
+  const int64_t last = first + VERIFY_CHUNK < ctx->n_pixels ? first + VERIFY_CHUNK : ctx->n_pixels;
+
+  for (int64_t i = first; i < last; i++) {
+    const double cx = viewport_x(&viewport, ctx->pixels[i] % w);
+    const double cy = viewport_y(&viewport, ctx->pixels[i] / w);
+
+    if (ctx->reference == NULL) {
+      ctx->expected[i] = m_solve(cx, cy);
+    } else {
+      ctx->reference->solve(&kernel_params, &cx, &cy, 1, &ctx->expected[i], NULL);
+    }
+  }
+}
+
+// Keeps the VERIFY_WORST largest differences, largest first
+
+static void _verify_worst(verify_miss_t * worst, int32_t * n_worst, const verify_miss_t * miss)
+{
+  const int32_t delta = abs(miss->got - miss->expected);
+
+  if (*n_worst == VERIFY_WORST && abs(worst[VERIFY_WORST - 1].got - worst[VERIFY_WORST - 1].expected) >= delta) {
+    return;
+  }
+
+  int32_t i = *n_worst < VERIFY_WORST ? (*n_worst)++ : VERIFY_WORST - 1;
+  for (; i > 0 && abs(worst[i - 1].got - worst[i - 1].expected) < delta; i--) {
+    worst[i] = worst[i - 1];
+  }
+  worst[i] = *miss;
+}
+
+
+int32_t verify_run(const args_t * args, const int64_t samples, const double tolerance)
+{
+  mandelbrot_init(args);
+
+  const double rendered = stats_now();
+  const image_t * field = mandelbrot_calculate_iterations();
+  const double render_seconds = stats_now() - rendered;
+
+  if (field == NULL) {
+    return 2;
+  }
+
+  const int64_t total = (int64_t) field->width * field->height;
+  const int64_t n_pixels = samples == VERIFY_ALL || samples > total ? total : samples;
+
+  // m_solve() is the loop for z^2 + c in doubles only
+  const kernel_t * reference = NULL;
+  if (kernel->power != 2 || kernel->julia || kernel->precision > KERNEL_PRECISION_DOUBLE) {
+    const int32_t precision = kernel->precision > KERNEL_PRECISION_DOUBLE
+      ? kernel->precision : KERNEL_PRECISION_DOUBLE;
+    reference = kernel_select(kernel->power, kernel->julia, precision, KERNEL_VARIANT_SCALAR);
+  }
+
+  verify_ctx_t ctx = {
+    .field = field,
+    .reference = reference,
+    .pixels = _verify_pick(total, n_pixels),
+    .n_pixels = n_pixels,
+    .expected = mem_alloc(sizeof(int32_t) * n_pixels),
+  };
+
+  const double solved = stats_now();
+  perf_parallel_for("verify", "pixel", VERIFY_CHUNK, (n_pixels + VERIFY_CHUNK - 1) / VERIFY_CHUNK, _verify_chunk, &ctx);
+  const double reference_seconds = stats_now() - solved;
+
+  verify_miss_t worst[VERIFY_WORST];
+  int32_t n_worst = 0;
+  int64_t misses = 0;
+
+  for (int64_t i = 0; i < n_pixels; i++) {
+    const verify_miss_t miss = { ctx.pixels[i], field->pixels[ctx.pixels[i]].i32, ctx.expected[i] };
+    if (miss.got != miss.expected) {
+      _verify_worst(worst, &n_worst, &miss);
+      misses++;
+    }
+  }
+
+  const double fraction = n_pixels > 0 ? (double) misses / n_pixels : 0.0;
+  const double fast = total / render_seconds;
+  const double slow = n_pixels / reference_seconds;
+
+  printf("[verify] %s against %s, %d iterations\n",
+      kernel->name, reference ? reference->name : "m_solve()", n_iterations);
+  printf("[verify] %" PRId64 " of %" PRId64 " pixels checked, %" PRId64 " differ (%.4f%%, tolerance %.4f%%)\n",
+      n_pixels, total, misses, 100.0 * fraction, 100.0 * tolerance);
+
+  for (int32_t i = 0; i < n_worst; i++) {
+    const int32_t px = worst[i].pixel % field->width;
+    const int32_t py = worst[i].pixel / field->width;
+    printf("[verify]   %+6d iterations at (%d, %d), c = %.17g %+.17gi: %d instead of %d\n",
+        worst[i].got - worst[i].expected, px, py, viewport_x(&viewport, px), viewport_y(&viewport, py),
+        worst[i].got, worst[i].expected);
+  }
+
+  printf("[verify] %.2f Mpixels/s against %.2f Mpixels/s, %.1fx faster\n",
+      1e-6 * fast, 1e-6 * slow, fast / slow);
+
+  const int32_t status = fraction > tolerance;
+  printf("[verify] %s\n", status ? "FAILED" : "Passed");
+
+  mem_free((int64_t *) ctx.pixels);
+  mem_free(ctx.expected);
+
+  return status;
+}
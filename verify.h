@@ -0,0 +1,28 @@
+#pragma once
+
+#include "mandelbrot.h"
+
+
+// Checks the fast path against the reference. The view is
+// rendered as usual, with the selected kernel, workers and every
+// shortcut they take, and then a random sample of its pixels (or
+// all of them) is solved again one point at a time with m_solve(),
+// the plain loop. Powers other than 2, Julia sets and views that
+// need long doubles have no m_solve() and are checked against the
+// scalar kernel of at least double precision instead.
+//
+// The report lists how many pixels differ, the worst differences
+// in iterations and the speed of both, as pixels per second on the
+// same pool.
+
+#define VERIFY_ALL 0
+#define VERIFY_DEFAULT_SAMPLES 100000
+#define VERIFY_DEFAULT_TOLERANCE 0.001
+#define VERIFY_WORST 5
+#define VERIFY_CHUNK 256
+
+
+// Renders the view of args and checks samples of its pixels, or
+// VERIFY_ALL. Returns 0 when at most a fraction tolerance of them
+// differ, 1 when more do and 2 when the render was interrupted.
+extern int32_t verify_run(const args_t * args, const int64_t samples, const double tolerance);